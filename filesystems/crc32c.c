@@ -20,61 +20,61 @@
  *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-static uint32_t crc32c_table [256];
+/* Slicing-by-8: crc32c_table[0] is the classic byte table, crc32c_table[k]
+   advances a byte through k further zero bytes, so eight input bytes can be
+   folded in with eight independent lookups.  */
+static uint32_t crc32c_table [8][256];
 
 static void
 init_crc32c_table (void)
 {
-  auto uint32_t reflect (uint32_t ref, int len);
-  uint32_t reflect (uint32_t ref, int len)
-    {
-      uint32_t result = 0;
-      int i;
-
-      for (i = 1; i <= len; i++)
-        {
-          if (ref & 1)
-            result |= 1 << (len - i);
-          ref >>= 1;
-        }
-
-      return result;
-    }
-
   static int crc32c_table_inited;
+  int i, j;
+
   if(crc32c_table_inited)
 	  return;
   crc32c_table_inited = 1;
 
-  uint32_t polynomial = 0x1edc6f41;
-  int i, j;
-
+  /* 0x82f63b78 is the Castagnoli polynomial 0x1edc6f41, bit-reflected */
   for(i = 0; i < 256; i++)
     {
-      crc32c_table[i] = reflect(i, 8) << 24;
+      uint32_t crc = i;
       for (j = 0; j < 8; j++)
-        crc32c_table[i] = (crc32c_table[i] << 1) ^
-            (crc32c_table[i] & (1 << 31) ? polynomial : 0);
-      crc32c_table[i] = reflect(crc32c_table[i], 32);
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+      crc32c_table[0][i] = crc;
     }
+
+  for(i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8)
+          ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
 }
 
 uint32_t
 grub_getcrc32c (uint32_t crc, const void *buf, int size)
 {
-  int i;
   const uint8_t *data = buf;
 
-  if (! crc32c_table[1])
+  if (! crc32c_table[0][1])
     init_crc32c_table ();
 
   crc^= 0xffffffff;
 
-  for (i = 0; i < size; i++)
+  for (; size >= 8; size -= 8, data += 8)
     {
-      crc = (crc >> 8) ^ crc32c_table[(crc & 0xFF) ^ *data];
-      data++;
+      uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16
+                           | (uint32_t) data[3] << 24);
+      uint32_t hi = data[4] | data[5] << 8 | data[6] << 16
+                    | (uint32_t) data[7] << 24;
+
+      crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+          ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+          ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+          ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
     }
 
+  for (; size > 0; size--, data++)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc & 0xFF) ^ *data];
+
   return crc ^ 0xffffffff;
 }
@@ -40,6 +40,13 @@
 #define DPRINT(x...)    /* */
 #endif
 
+/* Check tree node and file data checksums (crc32c volumes only) and fall
+ * back to another copy of the block when they don't match. Off by default,
+ * it costs a checksum tree lookup per data read.  */
+#ifndef BTRFS_VERIFY_CSUM
+#define BTRFS_VERIFY_CSUM 0
+#endif
+
 /* no single io/element size over 2G */
 #define fsw_size_t int
 #define fsw_ssize_t int
@@ -48,7 +55,7 @@
 #define grub_size_t int32_t
 #define grub_ssize_t int32_t
 #include "crc32c.c"
-#include "gzio.c"
+#include "fsw_zlib.h"
 #define MINILZO_CFG_SKIP_LZO_PTR 1
 #define MINILZO_CFG_SKIP_LZO_UTIL 1
 #define MINILZO_CFG_SKIP_LZO_STRING 1
@@ -57,7 +64,13 @@
 #define MINILZO_CFG_SKIP_LZO1X_1_COMPRESS 1
 #define MINILZO_CFG_SKIP_LZO_STRING 1
 #include "minilzo.c"
+#ifndef HOST_POSIX
 #include "scandisk.c"
+#else
+/* the POSIX test host mounts a single image, there are no other devices to scan */
+static struct fsw_volume *clone_dummy_volume(struct fsw_volume *vol) { return NULL; }
+static int scan_disks(int (*hook)(struct fsw_volume *, struct fsw_volume *), struct fsw_volume *master) { return 0; }
+#endif
 
 #define BTRFS_DEFAULT_BLOCK_SIZE 4096
 #define GRUB_BTRFS_SIGNATURE "_BHRfS_M"
@@ -105,7 +118,10 @@ struct btrfs_superblock
     uint32_t sectorsize;
     uint32_t nodesize;
 
-    uint8_t dummy3[0x31];
+    uint8_t dummy3[0x2c];
+#define BTRFS_CSUM_TYPE_CRC32   0
+    uint16_t csum_type;
+    uint8_t dummy5[3];
     struct btrfs_device this_device;
     char label[0x100];
     uint8_t dummy4[0x100];
@@ -116,7 +132,8 @@ struct btrfs_header
 {
     btrfs_checksum_t checksum;
     btrfs_uuid_t uuid;
-    uint8_t dummy[0x30];
+    uint64_t bytenr;
+    uint8_t dummy[0x28];
     uint32_t nitems;
     uint8_t level;
 } __attribute__ ((__packed__));
@@ -136,6 +153,22 @@ struct fsw_btrfs_recover_cache
     BOOLEAN valid;
 };
 
+struct fsw_btrfs_chunk_map
+{
+    uint64_t start;
+    uint64_t size;
+    struct btrfs_key *key;  /* key, chunk item and stripes, laid out as in bootstrap_mapping */
+};
+
+#define NODE_CACHE_SIZE 16
+struct fsw_btrfs_node_cache
+{
+    uint64_t addr;
+    uint64_t stamp;     /* LRU clock, 0 for never used */
+    char *buffer;       /* whole tree node, nodesize bytes */
+    BOOLEAN valid;
+};
+
 struct fsw_btrfs_volume
 {
     struct fsw_volume g;            //!< Generic volume structure
@@ -151,13 +184,20 @@ struct fsw_btrfs_volume
     unsigned num_devices;
     unsigned sectorshift;
     unsigned sectorsize;
+    unsigned nodesize;
     int is_master;
     int rescan_once;
+    int verify_csum;
+    uint64_t csum_tree; /* 0 if there is none */
 
     struct fsw_btrfs_device_desc *devices_attached;
     unsigned n_devices_attached;
     unsigned n_devices_allocated;
 
+    /* The whole chunk tree, sorted by logical address.  */
+    struct fsw_btrfs_chunk_map *chunk_map;
+    unsigned n_chunks;
+
     /* Cached extent data.  */
     uint64_t extstart;
     uint64_t extend;
@@ -166,6 +206,10 @@ struct fsw_btrfs_volume
     uint32_t extsize;
     struct btrfs_extent_data *extent;
     struct fsw_btrfs_recover_cache *rcache;
+
+    /* Recently used tree nodes, by logical address.  */
+    struct fsw_btrfs_node_cache *ncache;
+    uint64_t ncache_stamp;
 };
 
 enum
@@ -174,6 +218,7 @@ enum
     GRUB_BTRFS_ITEM_TYPE_INODE_REF = 0x0c,
     GRUB_BTRFS_ITEM_TYPE_DIR_ITEM = 0x54,
     GRUB_BTRFS_ITEM_TYPE_EXTENT_ITEM = 0x6c,
+    GRUB_BTRFS_ITEM_TYPE_EXTENT_CSUM = 0x80,
     GRUB_BTRFS_ITEM_TYPE_ROOT_ITEM = 0x84,
     GRUB_BTRFS_ITEM_TYPE_DEVICE = 0xd8,
     GRUB_BTRFS_ITEM_TYPE_CHUNK = 0xe4
@@ -292,6 +337,14 @@ struct btrfs_inode
 struct fsw_btrfs_dnode {
     struct fsw_dnode g;              //!< Generic dnode structure
     struct btrfs_inode *raw;    //!< Full raw inode structure
+    struct fsw_btrfs_leaf_descriptor dir_desc;  //!< Tree path of the last entry returned by dir_read
+    uint64_t dir_pos;           //!< shandle position dir_desc belongs to
+    char *zcache;               //!< Decompressed contents of the compressed extent used last
+    uint64_t zcache_laddr;      //!< Logical address of that extent on disk
+    uint64_t zcache_start;      //!< Offset in the uncompressed extent of the first byte in zcache
+    uint32_t zcache_size;       //!< Valid bytes in zcache, 0 if none
+    z_stream *zstrm;            //!< Inflate state while a zlib extent is only partly in zcache
+    char *zin;                  //!< Compressed data zstrm reads from
 };
 
 struct btrfs_extent_data
@@ -324,7 +377,12 @@ struct btrfs_extent_data
 #define GRUB_BTRFS_COMPRESSION_ZSTD  3
 #define GRUB_BTRFS_COMPRESSION_MAX  3
 
+/* the kernel compresses at most this much data into one extent */
+#define GRUB_BTRFS_MAX_UNCOMPRESSED (128 * 1024)
+
 #define GRUB_BTRFS_OBJECT_ID_CHUNK 0x100
+#define GRUB_BTRFS_OBJECT_ID_CSUM_TREE 7
+#define GRUB_BTRFS_OBJECT_ID_CSUM 0xfffffffffffffff6ULL
 
 struct fsw_btrfs_uuid_list {
     struct fsw_btrfs_volume *master;
@@ -386,6 +444,9 @@ static fsw_status_t btrfs_set_superblock_info(struct fsw_btrfs_volume *vol, stru
             break;
         }
     }
+    vol->nodesize = fsw_u32_le_swap(sb->nodesize);
+    vol->verify_csum = BTRFS_VERIFY_CSUM
+        && fsw_u16_le_swap(sb->csum_type) == BTRFS_CSUM_TYPE_CRC32;
     if(fsw_u64_le_swap(sb->num_devices) > BTRFS_MAX_NUM_DEVICES)
         vol->num_devices = BTRFS_MAX_NUM_DEVICES;
     else
@@ -403,6 +464,10 @@ static uint64_t superblock_pos[4] = {
 
 static fsw_status_t fsw_btrfs_read_logical(struct fsw_btrfs_volume *vol,
         uint64_t addr, void *buf, fsw_size_t size, int rdepth, int cache_level);
+static fsw_status_t fsw_btrfs_read_logical_mirror (struct fsw_btrfs_volume *vol,
+        uint64_t addr, void *buf, fsw_size_t size, int rdepth, int cache_level,
+        unsigned mirror);
+static unsigned fsw_btrfs_num_copies (struct fsw_btrfs_volume *vol, uint64_t addr);
 
 static fsw_status_t btrfs_read_superblock (struct fsw_volume *vol, struct btrfs_superblock *sb_out)
 {
@@ -476,6 +541,7 @@ static int key_cmp (const struct btrfs_key *a, const struct btrfs_key *b)
 static void free_iterator (struct fsw_btrfs_leaf_descriptor *desc)
 {
     fsw_free (desc->data);
+    desc->data = NULL;
 }
 
 static fsw_status_t save_ref (struct fsw_btrfs_leaf_descriptor *desc,
@@ -501,13 +567,97 @@ static fsw_status_t save_ref (struct fsw_btrfs_leaf_descriptor *desc,
     return FSW_SUCCESS;
 }
 
+/*
+ * Check a tree node against the crc32c in its header, which covers the rest
+ * of the node, and against the address it claims to live at.
+ */
+static int fsw_btrfs_node_ok (struct fsw_btrfs_volume *vol, uint64_t addr,
+        struct btrfs_header *head)
+{
+    uint32_t csum = grub_getcrc32c (0, (uint8_t *) head + sizeof (btrfs_checksum_t),
+            vol->nodesize - sizeof (btrfs_checksum_t));
+
+    return csum == fsw_u32_le_swap (*(uint32_t *) head->checksum)
+        && fsw_u64_le_swap (head->bytenr) == addr;
+}
+
+/*
+ * Return the tree node at logical address addr, read whole into the node
+ * cache. The buffer belongs to the cache: it is only good until the next
+ * fsw_btrfs_get_node() call, which may reuse its slot. With checksums
+ * verified, a node that fails the check is read again from the other
+ * copies of its chunk.
+ */
+static fsw_status_t fsw_btrfs_get_node (struct fsw_btrfs_volume *vol,
+        uint64_t addr, int rdepth, int cache_level,
+        struct btrfs_header **head_out)
+{
+    struct fsw_btrfs_node_cache *nc, *victim;
+    struct btrfs_header *head;
+    fsw_status_t err;
+    unsigned i, itemsize, mirror;
+
+    if (vol->ncache == NULL) {
+        err = fsw_alloc_zero(sizeof(struct fsw_btrfs_node_cache) * NODE_CACHE_SIZE, (void **)&vol->ncache);
+        if (err)
+            return err;
+    }
+
+    victim = vol->ncache;
+    for (i = 0; i < NODE_CACHE_SIZE; i++) {
+        nc = &vol->ncache[i];
+        if (nc->valid && nc->addr == addr) {
+            nc->stamp = ++vol->ncache_stamp;
+            *head_out = (struct btrfs_header *) nc->buffer;
+            return FSW_SUCCESS;
+        }
+        if (nc->stamp < victim->stamp)
+            victim = nc;
+    }
+
+    if (victim->buffer == NULL) {
+        err = fsw_alloc(vol->nodesize, (void **)&victim->buffer);
+        if (err)
+            return err;
+    }
+    /* claim the slot before reading, the read may look up chunk tree nodes */
+    victim->valid = FALSE;
+    victim->stamp = ++vol->ncache_stamp;
+
+    head = (struct btrfs_header *) victim->buffer;
+    for (mirror = 0; ; mirror++) {
+        err = fsw_btrfs_read_logical_mirror (vol, addr, victim->buffer, vol->nodesize,
+                rdepth, cache_level, mirror);
+        if (!err && vol->verify_csum && !fsw_btrfs_node_ok (vol, addr, head))
+            err = FSW_VOLUME_CORRUPTED;
+        if (!err)
+            break;
+        if (!vol->verify_csum || mirror + 1 >= fsw_btrfs_num_copies (vol, addr)) {
+            victim->stamp = 0;
+            return err;
+        }
+    }
+
+    itemsize = head->level ? sizeof (struct btrfs_internal_node) : sizeof (struct btrfs_leaf_node);
+    if (fsw_u32_le_swap (head->nitems) > (vol->nodesize - sizeof (*head)) / itemsize) {
+        victim->stamp = 0;
+        return FSW_VOLUME_CORRUPTED;
+    }
+
+    victim->addr = addr;
+    victim->valid = TRUE;
+    *head_out = head;
+    return FSW_SUCCESS;
+}
+
 static int next (struct fsw_btrfs_volume *vol,
         struct fsw_btrfs_leaf_descriptor *desc,
         uint64_t * outaddr, fsw_size_t * outsize,
         struct btrfs_key *key_out)
 {
     fsw_status_t err;
-    struct btrfs_leaf_node leaf;
+    struct btrfs_header *head;
+    struct btrfs_leaf_node *leaf;
 
     for (; desc->depth > 0; desc->depth--)
     {
@@ -520,37 +670,32 @@ static int next (struct fsw_btrfs_volume *vol,
         return 0;
     while (!desc->data[desc->depth - 1].leaf)
     {
-        struct btrfs_internal_node node;
-        struct btrfs_header head;
-        fsw_memzero(&node, sizeof(node));
-
-        err = fsw_btrfs_read_logical (vol, desc->data[desc->depth - 1].iter
-                * sizeof (node)
-                + sizeof (struct btrfs_header)
-                + desc->data[desc->depth - 1].addr,
-                &node, sizeof (node), 0, 1);
+        struct btrfs_internal_node *node;
+        uint64_t child;
+
+        err = fsw_btrfs_get_node (vol, desc->data[desc->depth - 1].addr, 0, 1, &head);
         if (err)
             return -err;
+        node = (struct btrfs_internal_node *) (head + 1)
+            + desc->data[desc->depth - 1].iter;
+        child = fsw_u64_le_swap (node->addr);
 
-        err = fsw_btrfs_read_logical (vol, fsw_u64_le_swap (node.addr),
-                &head, sizeof (head), 0, 1);
+        err = fsw_btrfs_get_node (vol, child, 0, 1, &head);
         if (err)
             return -err;
 
-        save_ref (desc, fsw_u64_le_swap (node.addr), 0,
-                fsw_u32_le_swap (head.nitems), !head.level);
+        err = save_ref (desc, child, 0, fsw_u32_le_swap (head->nitems), !head->level);
+        if (err)
+            return -err;
     }
-    err = fsw_btrfs_read_logical (vol, desc->data[desc->depth - 1].iter
-            * sizeof (leaf)
-            + sizeof (struct btrfs_header)
-            + desc->data[desc->depth - 1].addr, &leaf,
-            sizeof (leaf), 0, 1);
+    err = fsw_btrfs_get_node (vol, desc->data[desc->depth - 1].addr, 0, 1, &head);
     if (err)
         return -err;
-    *outsize = fsw_u32_le_swap (leaf.size);
+    leaf = (struct btrfs_leaf_node *) (head + 1) + desc->data[desc->depth - 1].iter;
+    *outsize = fsw_u32_le_swap (leaf->size);
     *outaddr = desc->data[desc->depth - 1].addr + sizeof (struct btrfs_header)
-        + fsw_u32_le_swap (leaf.offset);
-    *key_out = leaf.key;
+        + fsw_u32_le_swap (leaf->offset);
+    *key_out = leaf->key;
     return 1;
 }
 
@@ -586,117 +731,68 @@ static fsw_status_t lower_bound (struct fsw_btrfs_volume *vol,
     while (1)
     {
         fsw_status_t err;
-        struct btrfs_header head;
-        fsw_memzero(&head, sizeof(head));
+        struct btrfs_header *head;
+        unsigned nitems, itemsize;
+        int lo, hi, i;
 
-reiter:
         depth++;
-        /* FIXME: preread few nodes into buffer. */
-        err = fsw_btrfs_read_logical (vol, addr, &head, sizeof (head),
-                rdepth + 1, depth2cache(rdepth));
+        err = fsw_btrfs_get_node (vol, addr, rdepth + 1, depth2cache(rdepth), &head);
         if (err)
             return err;
-        addr += sizeof (head);
-        if (head.level)
+        nitems = fsw_u32_le_swap (head->nitems);
+        itemsize = head->level ? sizeof (struct btrfs_internal_node) : sizeof (struct btrfs_leaf_node);
+
+        /* Items are sorted by key, find the last one not above key_in.  */
+        lo = 0;
+        hi = nitems;
+        while (lo < hi)
         {
-            unsigned i;
-            struct btrfs_internal_node node, node_last;
-            int have_last = 0;
-            fsw_memzero (&node_last, sizeof (node_last));
-            for (i = 0; i < fsw_u32_le_swap (head.nitems); i++)
-            {
-                err = fsw_btrfs_read_logical (vol, addr + i * sizeof (node),
-                        &node, sizeof (node), rdepth + 1, depth2cache(rdepth));
-                if (err)
-                    return err;
+            int mid = (lo + hi) / 2;
+            struct btrfs_key *key = (struct btrfs_key *)
+                ((uint8_t *) (head + 1) + mid * itemsize);
+
+            if (key_cmp (key, key_in) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo - 1;
 
-                DPRINT (L"btrfs: internal node (depth %d) %lx %x %lx\n", depth,
-                        node.key.object_id, node.key.type,
-                        node.key.offset);
+        DPRINT (L"btrfs: %s (depth %d) %lx: item %d of %d\n",
+                head->level ? L"internal node" : L"leaf", depth, addr, i, nitems);
 
-                if (key_cmp (&node.key, key_in) == 0)
-                {
-                    err = FSW_SUCCESS;
-                    if (desc)
-                        err = save_ref (desc, addr - sizeof (head), i,
-                                fsw_u32_le_swap (head.nitems), 0);
-                    if (err)
-                        return err;
-                    addr = fsw_u64_le_swap (node.addr);
-                    goto reiter;
-                }
-                if (key_cmp (&node.key, key_in) > 0)
-                    break;
-                node_last = node;
-                have_last = 1;
-            }
-            if (have_last)
-            {
-                err = FSW_SUCCESS;
-                if (desc)
-                    err = save_ref (desc, addr - sizeof (head), i - 1,
-                            fsw_u32_le_swap (head.nitems), 0);
-                if (err)
-                    return err;
-                addr = fsw_u64_le_swap (node_last.addr);
-                goto reiter;
-            }
+        if (i < 0)
+        {
             *outsize = 0;
             *outaddr = 0;
             fsw_memzero (key_out, sizeof (*key_out));
             if (desc)
-                return save_ref (desc, addr - sizeof (head), -1,
-                        fsw_u32_le_swap (head.nitems), 0);
+                return save_ref (desc, addr, -1, nitems, !head->level);
             return FSW_SUCCESS;
         }
+
+        if (head->level)
         {
-            unsigned i;
-            struct btrfs_leaf_node leaf, leaf_last;
-            int have_last = 0;
-            for (i = 0; i < fsw_u32_le_swap (head.nitems); i++)
+            struct btrfs_internal_node *node = (struct btrfs_internal_node *) (head + 1) + i;
+
+            if (desc)
             {
-                err = fsw_btrfs_read_logical (vol, addr + i * sizeof (leaf),
-                        &leaf, sizeof (leaf), rdepth + 1, depth2cache(rdepth));
+                err = save_ref (desc, addr, i, nitems, 0);
                 if (err)
                     return err;
-
-                DPRINT (L"btrfs: leaf (depth %d) %lx %x %lx\n", depth,
-                        leaf.key.object_id, leaf.key.type, leaf.key.offset);
-
-                if (key_cmp (&leaf.key, key_in) == 0)
-                {
-                    fsw_memcpy (key_out, &leaf.key, sizeof (*key_out));
-                    *outsize = fsw_u32_le_swap (leaf.size);
-                    *outaddr = addr + fsw_u32_le_swap (leaf.offset);
-                    if (desc)
-                        return save_ref (desc, addr - sizeof (head), i,
-                                fsw_u32_le_swap (head.nitems), 1);
-                    return FSW_SUCCESS;
-                }
-
-                if (key_cmp (&leaf.key, key_in) > 0)
-                    break;
-
-                have_last = 1;
-                leaf_last = leaf;
             }
+            addr = fsw_u64_le_swap (node->addr);
+            continue;
+        }
 
-            if (have_last)
-            {
-                fsw_memcpy (key_out, &leaf_last.key, sizeof (*key_out));
-                *outsize = fsw_u32_le_swap (leaf_last.size);
-                *outaddr = addr + fsw_u32_le_swap (leaf_last.offset);
-                if (desc)
-                    return save_ref (desc, addr - sizeof (head), i - 1,
-                            fsw_u32_le_swap (head.nitems), 1);
-                return FSW_SUCCESS;
-            }
-            *outsize = 0;
-            *outaddr = 0;
-            fsw_memzero (key_out, sizeof (*key_out));
+        {
+            struct btrfs_leaf_node *leaf = (struct btrfs_leaf_node *) (head + 1) + i;
+
+            fsw_memcpy (key_out, &leaf->key, sizeof (*key_out));
+            *outsize = fsw_u32_le_swap (leaf->size);
+            *outaddr = addr + sizeof (struct btrfs_header) + fsw_u32_le_swap (leaf->offset);
             if (desc)
-                return save_ref (desc, addr - sizeof (head), -1,
-                        fsw_u32_le_swap (head.nitems), 1);
+                return save_ref (desc, addr, i, nitems, 1);
             return FSW_SUCCESS;
         }
     }
@@ -853,10 +949,10 @@ static struct fsw_btrfs_recover_cache *get_recover_cache(struct fsw_btrfs_volume
 	if(fsw_alloc_zero(sizeof(struct fsw_btrfs_recover_cache) * RECOVER_CACHE_SIZE, (void **)&vol->rcache) != FSW_SUCCESS)
 	    return NULL;
     }
-#ifdef __MAKEWITH_TIANO
-    unsigned hash;
-#else
+#ifdef __MAKEWITH_GNUEFI
     UINTN hash;
+#else
+    unsigned hash;
 #endif
     DivU64x32Remainder(((device_id >> 32) | device_id | (offset >> 32) | offset), RECOVER_CACHE_SIZE, &hash);
     struct fsw_btrfs_recover_cache *rc = &vol->rcache[hash];
@@ -872,8 +968,91 @@ static struct fsw_btrfs_recover_cache *get_recover_cache(struct fsw_btrfs_volume
     return rc;
 }
 
-static fsw_status_t fsw_btrfs_read_logical (struct fsw_btrfs_volume *vol, uint64_t addr,
-        void *buf, fsw_size_t size, int rdepth, int cache_level)
+static struct btrfs_key *fsw_btrfs_map_chunk (struct fsw_btrfs_volume *vol, uint64_t addr)
+{
+    struct fsw_btrfs_chunk_map *map;
+    unsigned lo = 0, hi = vol->n_chunks;
+
+    /* find the last chunk starting at or below addr */
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (vol->chunk_map[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    map = &vol->chunk_map[lo - 1];
+    if (addr - map->start >= map->size)
+        return NULL;
+    return map->key;
+}
+
+/* Look addr up among the system chunks that come with the superblock.  */
+static struct btrfs_key *fsw_btrfs_bootstrap_chunk (struct fsw_btrfs_volume *vol, uint64_t addr)
+{
+    struct btrfs_key *key;
+    struct btrfs_chunk_item *chunk;
+    uint8_t *ptr;
+
+    for (ptr = vol->bootstrap_mapping; ptr < vol->bootstrap_mapping + sizeof (vol->bootstrap_mapping) - sizeof (struct btrfs_key);)
+    {
+        key = (struct btrfs_key *) ptr;
+        if (key->type != GRUB_BTRFS_ITEM_TYPE_CHUNK)
+            break;
+        chunk = (struct btrfs_chunk_item *) (key + 1);
+        if (fsw_u64_le_swap (key->offset) <= addr
+                && addr < fsw_u64_le_swap (key->offset)
+                + fsw_u64_le_swap (chunk->size))
+        {
+            return key;
+        }
+        ptr += sizeof (*key) + sizeof (*chunk)
+            + sizeof (struct btrfs_chunk_stripe)
+            * fsw_u16_le_swap (chunk->nstripes);
+    }
+    return NULL;
+}
+
+/*
+ * Number of mirrors fsw_btrfs_read_logical_mirror() can read addr from:
+ * the copies of DUP, RAID1 and RAID10 chunks, and for RAID5/6 the data
+ * stripe itself and its reconstruction from the others.
+ */
+static unsigned fsw_btrfs_num_copies (struct fsw_btrfs_volume *vol, uint64_t addr)
+{
+    struct btrfs_key *key;
+    struct btrfs_chunk_item *chunk;
+
+    key = vol->chunk_map ? fsw_btrfs_map_chunk (vol, addr) : fsw_btrfs_bootstrap_chunk (vol, addr);
+    if (!key)
+        return 1;
+    chunk = (struct btrfs_chunk_item *) (key + 1);
+
+    switch (fsw_u64_le_swap (chunk->type) & ~GRUB_BTRFS_CHUNK_TYPE_BITS_DONTCARE)
+    {
+        case GRUB_BTRFS_CHUNK_TYPE_DUPLICATED:
+        case GRUB_BTRFS_CHUNK_TYPE_RAID1:
+        case GRUB_BTRFS_CHUNK_TYPE_RAID5:
+        case GRUB_BTRFS_CHUNK_TYPE_RAID6:
+            return 2;
+        case GRUB_BTRFS_CHUNK_TYPE_RAID10:
+            return fsw_u16_le_swap (chunk->nsubstripes);
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Read size bytes at logical address addr. Mirror 0 is the normal read;
+ * mirror 1 and up pick another copy for redundant chunks (see
+ * fsw_btrfs_num_copies()), for callers that found the first one bad.
+ */
+static fsw_status_t fsw_btrfs_read_logical_mirror (struct fsw_btrfs_volume *vol,
+        uint64_t addr, void *buf, fsw_size_t size, int rdepth, int cache_level,
+        unsigned mirror)
 {
     struct stripe_table *stripe_table = NULL;
     int challoc = 0;
@@ -881,7 +1060,6 @@ static fsw_status_t fsw_btrfs_read_logical (struct fsw_btrfs_volume *vol, uint64
     fsw_status_t err = 0;
     while (size > 0)
     {
-        uint8_t *ptr;
         struct btrfs_key *key;
         uint64_t csize;
         struct btrfs_key key_out;
@@ -890,21 +1068,22 @@ static fsw_status_t fsw_btrfs_read_logical (struct fsw_btrfs_volume *vol, uint64
         uint64_t chaddr;
 
 	err = 0;
-        for (ptr = vol->bootstrap_mapping; ptr < vol->bootstrap_mapping + sizeof (vol->bootstrap_mapping) - sizeof (struct btrfs_key);)
+        if (vol->chunk_map)
         {
-            key = (struct btrfs_key *) ptr;
-            if (key->type != GRUB_BTRFS_ITEM_TYPE_CHUNK)
-                break;
+            key = fsw_btrfs_map_chunk (vol, addr);
+            if (!key)
+                //"couldn't find the chunk descriptor");
+                return FSW_VOLUME_CORRUPTED;
             chunk = (struct btrfs_chunk_item *) (key + 1);
-            if (fsw_u64_le_swap (key->offset) <= addr
-                    && addr < fsw_u64_le_swap (key->offset)
-                    + fsw_u64_le_swap (chunk->size))
-            {
-                goto chunk_found;
-            }
-            ptr += sizeof (*key) + sizeof (*chunk)
-                + sizeof (struct btrfs_chunk_stripe)
-                * fsw_u16_le_swap (chunk->nstripes);
+            goto chunk_found;
+        }
+
+        /* Still mounting: the system chunks come with the superblock.  */
+        key = fsw_btrfs_bootstrap_chunk (vol, addr);
+        if (key)
+        {
+            chunk = (struct btrfs_chunk_item *) (key + 1);
+            goto chunk_found;
         }
 
         key_in.object_id = fsw_u64_le_swap (GRUB_BTRFS_OBJECT_ID_CHUNK);
@@ -1065,9 +1244,11 @@ chunk_found:
                 csize = size;
 
 	    if(redundancy < RAID5_TAG) {
+		if (mirror >= redundancy)
+		    goto volume_corrupted;
 begin_direct_read:
 		err = 0;
-                for (i = 0; !err && i < redundancy; i++)
+                for (i = mirror; !err && i < redundancy; i++)
                 {
                     struct btrfs_chunk_stripe *stripe;
                     uint64_t paddr;
@@ -1130,6 +1311,10 @@ begin_direct_read:
 		struct btrfs_chunk_stripe *stripe = (struct btrfs_chunk_stripe *) (chunk + 1);
 		unsigned sectorsize = vol->sectorsize;
 
+		// mirror 1 is the data rebuilt from the other stripes
+		if (mirror > 1)
+		    goto volume_corrupted;
+
 		{
 		    uint64_t sectormask = fsw_u64_le_swap(sectorsize - 1);
 		    for(i = 0; i < nstripes; i++)
@@ -1156,7 +1341,7 @@ begin_direct_read:
 		    struct fsw_btrfs_recover_cache *rcache = NULL;
 		    uint64_t paddrN = (fsw_u64_le_swap (stripe[stripen].offset) >> vol->sectorshift) + stripe_offset;
 
-		    if(dev && !(err = fsw_block_get(dev, paddrN, cache_level, (void **)&buffer))) {
+		    if(mirror == 0 && dev && !(err = fsw_block_get(dev, paddrN, cache_level, (void **)&buffer))) {
 			// reading direct sector first
                         fsw_memcpy(buf+n, buffer+off, used_bytes);
                         fsw_block_release(dev, paddrN, (void *)buffer);
@@ -1291,7 +1476,305 @@ io_error:
     return err;
 }
 
+static fsw_status_t fsw_btrfs_read_logical (struct fsw_btrfs_volume *vol, uint64_t addr,
+        void *buf, fsw_size_t size, int rdepth, int cache_level)
+{
+    return fsw_btrfs_read_logical_mirror (vol, addr, buf, size, rdepth, cache_level, 0);
+}
+
+/*
+ * Replace a data sector that failed its checksum by a copy from another
+ * mirror that passes it, if the chunk has one.
+ */
+static fsw_status_t fsw_btrfs_fix_sector (struct fsw_btrfs_volume *vol, uint64_t addr,
+        char *sector, uint32_t csum)
+{
+    unsigned mirror, copies = fsw_btrfs_num_copies (vol, addr);
+    fsw_status_t err;
+    char *tmp;
+
+    err = fsw_alloc (vol->sectorsize, (void **)&tmp);
+    if (err)
+        return err;
+
+    for (mirror = 1; mirror < copies; mirror++)
+    {
+        if (fsw_btrfs_read_logical_mirror (vol, addr, tmp, vol->sectorsize, 0, 0, mirror) == FSW_SUCCESS
+                && grub_getcrc32c (0, tmp, vol->sectorsize) == fsw_u32_le_swap (csum))
+        {
+            fsw_memcpy (sector, tmp, vol->sectorsize);
+            fsw_free (tmp);
+            return FSW_SUCCESS;
+        }
+    }
+    fsw_free (tmp);
+    DPRINT (L"btrfs: bad checksum at laddr 0x%lx\n", addr);
+    return FSW_VOLUME_CORRUPTED;
+}
+
+/*
+ * Read file data. With checksums verified, every whole sector read is
+ * checked against the checksum tree, and a bad one is replaced by a good
+ * copy. Sectors without a checksum (nodatasum files) are taken as read.
+ */
+static fsw_status_t fsw_btrfs_read_data (struct fsw_btrfs_volume *vol, uint64_t addr,
+        void *buf, fsw_size_t size)
+{
+    struct fsw_btrfs_leaf_descriptor desc;
+    struct btrfs_key key_in, key_out;
+    uint64_t elemaddr, sector, start, end, item_end;
+    fsw_size_t elemsize;
+    uint32_t csums[64];
+    fsw_status_t err;
+    unsigned i, n;
+    int r;
+
+    err = fsw_btrfs_read_logical (vol, addr, buf, size, 0, 0);
+    if (err || !vol->verify_csum || !vol->csum_tree)
+        return err;
+
+    end = addr + size;
+    sector = (addr + vol->sectorsize - 1) & ~(uint64_t) (vol->sectorsize - 1);
+    while (sector + vol->sectorsize <= end)
+    {
+        key_in.object_id = fsw_u64_le_swap (GRUB_BTRFS_OBJECT_ID_CSUM);
+        key_in.type = GRUB_BTRFS_ITEM_TYPE_EXTENT_CSUM;
+        key_in.offset = fsw_u64_le_swap (sector);
+        err = lower_bound (vol, &key_in, &key_out, vol->csum_tree, &elemaddr, &elemsize, &desc, 0);
+        if (err) {
+            if (desc.data)
+                free_iterator (&desc);
+            return err;
+        }
+        if (key_out.object_id != key_in.object_id || key_out.type != key_in.type
+                || fsw_u64_le_swap (key_out.offset)
+                + ((uint64_t) (elemsize / sizeof (uint32_t)) << vol->sectorshift) <= sector)
+        {
+            /* no checksum for this sector, go on with the next item */
+            r = next (vol, &desc, &elemaddr, &elemsize, &key_out);
+            if (r <= 0 || key_out.object_id != key_in.object_id || key_out.type != key_in.type)
+            {
+                free_iterator (&desc);
+                return r < 0 ? -r : FSW_SUCCESS;
+            }
+        }
+        free_iterator (&desc);
+        if (elemsize < (fsw_size_t) sizeof (uint32_t))
+            return FSW_VOLUME_CORRUPTED;
+
+        start = fsw_u64_le_swap (key_out.offset);
+        item_end = start + ((uint64_t) (elemsize / sizeof (uint32_t)) << vol->sectorshift);
+        if (sector < start)
+            sector = start;
+
+        while (sector < item_end && sector + vol->sectorsize <= end)
+        {
+            n = (item_end - sector) >> vol->sectorshift;
+            if (n > (end - sector) >> vol->sectorshift)
+                n = (end - sector) >> vol->sectorshift;
+            if (n > sizeof (csums) / sizeof (csums[0]))
+                n = sizeof (csums) / sizeof (csums[0]);
+
+            err = fsw_btrfs_read_logical (vol,
+                    elemaddr + ((sector - start) >> vol->sectorshift) * sizeof (uint32_t),
+                    csums, n * sizeof (uint32_t), 0, 1);
+            if (err)
+                return err;
+
+            for (i = 0; i < n; i++, sector += vol->sectorsize)
+            {
+                char *p = (char *) buf + (sector - addr);
+
+                if (grub_getcrc32c (0, p, vol->sectorsize) == fsw_u32_le_swap (csums[i]))
+                    continue;
+                err = fsw_btrfs_fix_sector (vol, sector, p, csums[i]);
+                if (err)
+                    return err;
+            }
+        }
+    }
+    return FSW_SUCCESS;
+}
+
+/*
+ * Map a logical address of file data to the volume's own device, for
+ * profiles that keep a full copy of the data in one place (single, DUP and
+ * RAID1). On success *paddr_out is the byte offset on that device and
+ * *len_out the number of bytes that stay physically contiguous from there.
+ * Everything else (striped and parity RAID, data on other devices) must go
+ * through fsw_btrfs_read_logical().
+ */
+static int fsw_btrfs_map_direct(struct fsw_btrfs_volume *vol, uint64_t addr,
+        uint64_t *paddr_out, uint64_t *len_out)
+{
+    struct btrfs_key *key;
+    struct btrfs_chunk_item *chunk;
+    struct btrfs_chunk_stripe *stripe;
+    uint64_t off, stripe_length, stripen;
+    uint16_t nstripes;
+    unsigned i;
+
+    key = fsw_btrfs_map_chunk (vol, addr);
+    if (!key)
+        return 0;
+    chunk = (struct btrfs_chunk_item *) (key + 1);
+    stripe = (struct btrfs_chunk_stripe *) (chunk + 1);
+    nstripes = fsw_u16_le_swap (chunk->nstripes);
+    off = addr - fsw_u64_le_swap (key->offset);
+
+    switch (fsw_u64_le_swap (chunk->type) & ~GRUB_BTRFS_CHUNK_TYPE_BITS_DONTCARE)
+    {
+        case GRUB_BTRFS_CHUNK_TYPE_SINGLE:
+            stripe_length = FSW_U64_DIV (fsw_u64_le_swap (chunk->size), nstripes);
+            if (stripe_length == 0 || stripe_length >= 1ULL<<32)
+                return 0;
+            stripen = FSW_U64_DIV (off, (uint32_t)stripe_length);
+            if (stripen >= nstripes)
+                return 0;
+            stripe += stripen;
+            off -= stripen * stripe_length;
+            *len_out = stripe_length - off;
+            break;
+        case GRUB_BTRFS_CHUNK_TYPE_DUPLICATED:
+        case GRUB_BTRFS_CHUNK_TYPE_RAID1:
+            /* any copy on this device will do */
+            for (i = 0; i < nstripes; i++, stripe++)
+                if (stripe->device_id == vol->devices_attached[0].id)
+                    break;
+            if (i == nstripes)
+                return 0;
+            *len_out = fsw_u64_le_swap (chunk->size) - off;
+            break;
+        default:
+            return 0;
+    }
+
+    if (stripe->device_id != vol->devices_attached[0].id)
+        return 0;
+    *paddr_out = fsw_u64_le_swap (stripe->offset) + off;
+    if ((*paddr_out & (vol->sectorsize - 1)) || *len_out < vol->sectorsize)
+        return 0;
+    return 1;
+}
+
+static void fsw_btrfs_free_chunk_map(struct fsw_btrfs_volume *vol)
+{
+    unsigned i;
+
+    for (i = 0; i < vol->n_chunks; i++)
+        FreePool (vol->chunk_map[i].key);
+    if (vol->chunk_map)
+        FreePool (vol->chunk_map);
+    vol->chunk_map = NULL;
+    vol->n_chunks = 0;
+}
+
+/*
+ * Read every chunk item of the chunk tree into vol->chunk_map. The driver
+ * never writes, so the map stays valid for the life of the mount and
+ * fsw_btrfs_read_logical() no longer needs to search the chunk tree.
+ */
+static fsw_status_t fsw_btrfs_load_chunk_map(struct fsw_btrfs_volume *vol)
+{
+    struct fsw_btrfs_chunk_map *map = NULL;
+    struct fsw_btrfs_leaf_descriptor desc;
+    struct btrfs_key key_in, key_out;
+    uint64_t elemaddr;
+    fsw_size_t elemsize;
+    unsigned n = 0, allocated = 0;
+    fsw_status_t err;
+    int r = 1;
+
+    key_in.object_id = fsw_u64_le_swap (GRUB_BTRFS_OBJECT_ID_CHUNK);
+    key_in.type = GRUB_BTRFS_ITEM_TYPE_CHUNK;
+    key_in.offset = 0;
+    err = lower_bound (vol, &key_in, &key_out, vol->chunk_tree, &elemaddr, &elemsize, &desc, 0);
+    if (err) {
+        if (desc.data)
+            free_iterator (&desc);
+        return err;
+    }
+
+    /* lower_bound may stop at the item just before the first chunk */
+    if (key_cmp (&key_out, &key_in) < 0)
+        r = next (vol, &desc, &elemaddr, &elemsize, &key_out);
+
+    for (; r > 0; r = next (vol, &desc, &elemaddr, &elemsize, &key_out))
+    {
+        struct btrfs_key *key;
+        struct btrfs_chunk_item *chunk;
+
+        if (key_out.object_id != key_in.object_id || key_out.type != GRUB_BTRFS_ITEM_TYPE_CHUNK)
+            break;
+
+        if (elemsize < sizeof (*chunk))
+        {
+            err = FSW_VOLUME_CORRUPTED;
+            goto out;
+        }
+
+        if (n == allocated)
+        {
+            struct fsw_btrfs_chunk_map *newmap;
+
+            allocated = allocated ? allocated * 2 : 16;
+            newmap = AllocatePool (sizeof (*map) * allocated);
+            if (!newmap)
+            {
+                err = FSW_OUT_OF_MEMORY;
+                goto out;
+            }
+            if (map)
+            {
+                fsw_memcpy (newmap, map, sizeof (*map) * n);
+                FreePool (map);
+            }
+            map = newmap;
+        }
+
+        key = AllocatePool (sizeof (*key) + elemsize);
+        if (!key)
+        {
+            err = FSW_OUT_OF_MEMORY;
+            goto out;
+        }
+        *key = key_out;
+        chunk = (struct btrfs_chunk_item *) (key + 1);
+        err = fsw_btrfs_read_logical (vol, elemaddr, chunk, elemsize, 0, 1);
+        if (!err && (fsw_u16_le_swap (chunk->nstripes) == 0
+                    || elemsize < sizeof (*chunk) + sizeof (struct btrfs_chunk_stripe)
+                    * fsw_u16_le_swap (chunk->nstripes)
+                    || fsw_u64_le_swap (chunk->size) == 0))
+            err = FSW_VOLUME_CORRUPTED;
+        if (err)
+        {
+            FreePool (key);
+            goto out;
+        }
+
+        map[n].start = fsw_u64_le_swap (key_out.offset);
+        map[n].size = fsw_u64_le_swap (chunk->size);
+        map[n].key = key;
+        n++;
+        DPRINT (L"btrfs: chunk %lx+%lx\n", map[n-1].start, map[n-1].size);
+    }
+    if (r < 0)
+        err = -r;
+
+out:
+    free_iterator (&desc);
+    if (!err && n == 0)
+        err = FSW_VOLUME_CORRUPTED;
+    vol->chunk_map = map;
+    vol->n_chunks = n;
+    if (err)
+        fsw_btrfs_free_chunk_map (vol);
+    return err;
+}
+
 static fsw_status_t fsw_btrfs_get_default_root(struct fsw_btrfs_volume *vol, uint64_t root_dir_objectid);
+static fsw_status_t fsw_btrfs_get_root_tree(struct fsw_btrfs_volume *vol,
+        struct btrfs_key *key_in, uint64_t *tree_out);
 static fsw_status_t fsw_btrfs_volume_mount(struct fsw_volume *volg) {
     struct btrfs_superblock sblock;
     struct fsw_btrfs_volume *vol = (struct fsw_btrfs_volume *)volg;
@@ -1311,6 +1794,10 @@ static fsw_status_t fsw_btrfs_volume_mount(struct fsw_volume *volg) {
     if(vol->sectorshift == 0)
         return FSW_UNSUPPORTED;
 
+    if(vol->nodesize < vol->sectorsize || vol->nodesize > 0x10000
+            || (vol->nodesize & (vol->nodesize - 1)))
+        return FSW_UNSUPPORTED;
+
     if(vol->num_devices >= BTRFS_MAX_NUM_DEVICES)
         return FSW_UNSUPPORTED;
 
@@ -1355,6 +1842,25 @@ static fsw_status_t fsw_btrfs_volume_mount(struct fsw_volume *volg) {
         return err;
     }
 
+    err = fsw_btrfs_load_chunk_map(vol);
+    if (err) {
+        DPRINT(L"chunk tree not readable\n");
+        FreePool (vol->devices_attached);
+        vol->devices_attached = NULL;
+        return err;
+    }
+
+    if (vol->verify_csum) {
+        struct btrfs_key csum_root_key;
+
+        /* without a checksum tree, only tree nodes get checked */
+        csum_root_key.object_id = fsw_u64_le_swap(GRUB_BTRFS_OBJECT_ID_CSUM_TREE);
+        csum_root_key.type = GRUB_BTRFS_ITEM_TYPE_ROOT_ITEM;
+        csum_root_key.offset = -1LL;
+        if (fsw_btrfs_get_root_tree (vol, &csum_root_key, &vol->csum_tree) != FSW_SUCCESS)
+            vol->csum_tree = 0;
+    }
+
     err = fsw_btrfs_get_default_root(vol, sblock.root_dir_objectid);
     if (err) {
         DPRINT(L"root not found\n");
@@ -1385,14 +1891,21 @@ static void fsw_btrfs_volume_free(struct fsw_volume *volg)
 	}
 	FreePool (vol->devices_attached);
     }
+    fsw_btrfs_free_chunk_map(vol);
     if(vol->extent)
         FreePool (vol->extent);
     if(vol->rcache) {
 	for(i = 0; i < RECOVER_CACHE_SIZE; i++)
-	    if(vol->rcache->buffer)
-		FreePool(vol->rcache->buffer);
+	    if(vol->rcache[i].buffer)
+		FreePool(vol->rcache[i].buffer);
         FreePool (vol->rcache);
     }
+    if(vol->ncache) {
+	for(i = 0; i < NODE_CACHE_SIZE; i++)
+	    if(vol->ncache[i].buffer)
+		FreePool(vol->ncache[i].buffer);
+        FreePool (vol->ncache);
+    }
 }
 
 static fsw_status_t fsw_btrfs_volume_stat(struct fsw_volume *volg, struct fsw_volume_stat *sb)
@@ -1470,11 +1983,18 @@ static fsw_status_t fsw_btrfs_dnode_fill(struct fsw_volume *volg, struct fsw_dno
     return FSW_SUCCESS;
 }
 
+static void fsw_btrfs_zstream_free(struct fsw_btrfs_dnode *dno);
+
 static void fsw_btrfs_dnode_free(struct fsw_volume *volg, struct fsw_dnode *dnog)
 {
     struct fsw_btrfs_dnode *dno = (struct fsw_btrfs_dnode *)dnog;
     if (dno->raw)
         FreePool(dno->raw);
+    if (dno->dir_desc.data)
+        free_iterator (&dno->dir_desc);
+    if (dno->zcache)
+        FreePool(dno->zcache);
+    fsw_btrfs_zstream_free(dno);
 }
 
 static fsw_status_t fsw_btrfs_dnode_stat(struct fsw_volume *volg, struct fsw_dnode *dnog, struct fsw_dnode_stat *sb)
@@ -1583,11 +2103,82 @@ static fsw_ssize_t grub_btrfs_lzo_decompress(char *ibuf, fsw_size_t isize, grub_
     return ret;
 }
 
+/*
+ * Inflate up to osize bytes from strm into obuf. Returns the number of bytes
+ * produced, or -1 if the data is corrupt or ends too early. Fewer than osize
+ * bytes come back only when the stream ends, *done is then set. zlib checks
+ * the Adler-32 of the data when it reaches the end of the stream.
+ */
+static fsw_ssize_t btrfs_zlib_inflate (z_stream *strm, char *obuf, fsw_size_t osize, int *done)
+{
+    int rc;
+
+    strm->next_out = (Byte *) obuf;
+    strm->avail_out = osize;
+    do {
+        rc = zlib_inflate (strm, Z_SYNC_FLUSH);
+    } while (rc == Z_OK && strm->avail_out);
+
+    if (rc == Z_OK) {
+        /* The output is full. Read on in case only the trailer is left, so
+           that the checksum of data read up to its end is always checked.  */
+        rc = zlib_inflate (strm, Z_SYNC_FLUSH);
+        if (rc == Z_BUF_ERROR)
+            rc = Z_OK;
+    }
+    if (rc != Z_OK && rc != Z_STREAM_END)
+        return -1;
+
+    *done = (rc == Z_STREAM_END);
+    return osize - strm->avail_out;
+}
+
+/*
+ * Inflate and throw away the next n bytes of strm, using buf as scratch
+ * space. Returns 0, or -1 on error or if the stream ends first.
+ */
+static int btrfs_zlib_skip (z_stream *strm, char *buf, fsw_size_t bufsize, uint64_t n)
+{
+    fsw_ssize_t ret;
+    int done = 0;
+
+    while (n > 0) {
+        if (done)
+            return -1;
+        ret = btrfs_zlib_inflate (strm, buf, n < (uint64_t) bufsize ? (fsw_size_t) n : bufsize, &done);
+        if (ret < 0)
+            return -1;
+        n -= ret;
+    }
+    return 0;
+}
+
+static fsw_ssize_t btrfs_zlib_decompress (char *inbuf, fsw_size_t insize, grub_off_t off,
+        char *outbuf, fsw_size_t outsize)
+{
+    z_stream strm;
+    fsw_ssize_t ret = -1;
+    int done = 0;
+
+    fsw_memzero (&strm, sizeof (strm));
+    strm.workspace = AllocatePool (zlib_inflate_workspacesize ());
+    if (!strm.workspace)
+        return -1;
+    if (zlib_inflateInit2 (&strm, MAX_WBITS) == Z_OK) {
+        strm.next_in = (Byte *) inbuf;
+        strm.avail_in = insize;
+        if (btrfs_zlib_skip (&strm, outbuf, outsize, off) == 0)
+            ret = btrfs_zlib_inflate (&strm, outbuf, outsize, &done);
+    }
+    FreePool (strm.workspace);
+    return ret;
+}
+
 #include "fsw_btrfs_zstd.h"
 
 typedef fsw_ssize_t (*decompressor_t)(char *ibuf, fsw_size_t isize, grub_off_t off, char *obuf, fsw_size_t osize);
 static decompressor_t btrfs_decompressor_table[GRUB_BTRFS_COMPRESSION_MAX] = {
-	grub_zlib_decompress,
+	btrfs_zlib_decompress,
 	grub_btrfs_lzo_decompress,
 	zstd_decompress,
 };
@@ -1600,6 +2191,131 @@ static fsw_ssize_t btrfs_decompress(uint8_t comp,
 	return btrfs_decompressor_table[comp-1](ibuf, isize, off, obuf, osize);
 }
 
+/* Drop the dnode's inflate state, if any.  */
+static void fsw_btrfs_zstream_free(struct fsw_btrfs_dnode *dno)
+{
+    if (dno->zstrm) {
+        FreePool (dno->zstrm->workspace);
+        FreePool (dno->zstrm);
+        dno->zstrm = NULL;
+    }
+    if (dno->zin) {
+        FreePool (dno->zin);
+        dno->zin = NULL;
+    }
+}
+
+/*
+ * Make the dnode's cache hold the uncompressed data of the compressed extent
+ * described by vol->extent from offset off on, up to offset end as far as it
+ * fits. LZO and zstd extents are decompressed whole. A zlib extent is only
+ * inflated as far as needed, and the inflate state stays on the dnode until
+ * the end of the extent, so the next read carries on from there. Extents
+ * larger than the cache slide through it. Reading a file in pieces, or through
+ * file extents that share one compressed extent, then costs one read of the
+ * extent and decompresses each byte once.
+ */
+static fsw_status_t fsw_btrfs_fill_zcache(struct fsw_btrfs_volume *vol, struct fsw_btrfs_dnode *dno,
+        uint64_t off, uint64_t end)
+{
+    uint64_t laddr = fsw_u64_le_swap (vol->extent->laddr);
+    uint64_t zsize = fsw_u64_le_swap (vol->extent->compressed_size);
+    uint64_t ram = fsw_u64_le_swap (vol->extent->size);
+    uint64_t zread;
+    fsw_ssize_t ret;
+    fsw_status_t err;
+    char *tmp;
+    int done = 0;
+
+    if (dno->zcache_laddr != laddr || off < dno->zcache_start) {
+        fsw_btrfs_zstream_free (dno);
+        dno->zcache_laddr = 0;
+        dno->zcache_start = 0;
+        dno->zcache_size = 0;
+
+        if (!dno->zcache) {
+            dno->zcache = AllocatePool (GRUB_BTRFS_MAX_UNCOMPRESSED);
+            if (!dno->zcache)
+                return FSW_OUT_OF_MEMORY;
+        }
+
+        if (zsize == 0)
+            return FSW_VOLUME_CORRUPTED;
+        /* whole sectors, so that all of them can be checked */
+        zread = (zsize + vol->sectorsize - 1) & ~(uint64_t) (vol->sectorsize - 1);
+        tmp = AllocatePool (zread);
+        if (!tmp)
+            return FSW_OUT_OF_MEMORY;
+        err = fsw_btrfs_read_data (vol, laddr, tmp, zread);
+        if (err) {
+            FreePool (tmp);
+            return err;
+        }
+
+        if (vol->extent->compression != GRUB_BTRFS_COMPRESSION_ZLIB) {
+            ret = btrfs_decompress (vol->extent->compression, tmp, zsize, 0, dno->zcache, ram);
+            FreePool (tmp);
+            if (ret <= 0)
+                return FSW_VOLUME_CORRUPTED;
+            dno->zcache_laddr = laddr;
+            dno->zcache_size = ret;
+            return FSW_SUCCESS;
+        }
+
+        dno->zin = tmp;
+        dno->zstrm = AllocatePool (sizeof (*dno->zstrm));
+        if (!dno->zstrm)
+            return FSW_OUT_OF_MEMORY;
+        fsw_memzero (dno->zstrm, sizeof (*dno->zstrm));
+        dno->zstrm->workspace = AllocatePool (zlib_inflate_workspacesize ());
+        if (!dno->zstrm->workspace) {
+            FreePool (dno->zstrm);
+            dno->zstrm = NULL;
+            return FSW_OUT_OF_MEMORY;
+        }
+        if (zlib_inflateInit2 (dno->zstrm, MAX_WBITS) != Z_OK)
+            goto bad;
+        dno->zstrm->next_in = (Byte *) dno->zin;
+        dno->zstrm->avail_in = zsize;
+        dno->zcache_laddr = laddr;
+    }
+
+    /* everything there is has been decompressed */
+    if (!dno->zstrm)
+        return FSW_SUCCESS;
+
+    if (off - dno->zcache_start >= GRUB_BTRFS_MAX_UNCOMPRESSED) {
+        /* Beyond the window, move it up to off.  */
+        uint64_t pos = dno->zcache_start + dno->zcache_size;
+
+        if (btrfs_zlib_skip (dno->zstrm, dno->zcache, GRUB_BTRFS_MAX_UNCOMPRESSED, off - pos) < 0)
+            goto bad;
+        dno->zcache_start = off;
+        dno->zcache_size = 0;
+    }
+
+    if (end - dno->zcache_start > GRUB_BTRFS_MAX_UNCOMPRESSED)
+        end = dno->zcache_start + GRUB_BTRFS_MAX_UNCOMPRESSED;
+    if (dno->zcache_start + dno->zcache_size < end) {
+        ret = btrfs_zlib_inflate (dno->zstrm, dno->zcache + dno->zcache_size,
+                end - dno->zcache_start - dno->zcache_size, &done);
+        if (ret < 0)
+            goto bad;
+        dno->zcache_size += ret;
+    }
+
+    /* At the end of the extent the rest of it is in zcache, and the
+       compressed data isn't needed any more.  */
+    if (done)
+        fsw_btrfs_zstream_free (dno);
+    return FSW_SUCCESS;
+
+bad:
+    fsw_btrfs_zstream_free (dno);
+    dno->zcache_laddr = 0;
+    return FSW_VOLUME_CORRUPTED;
+}
+
 static fsw_status_t fsw_btrfs_get_extent(struct fsw_volume *volg, struct fsw_dnode *dnog,
         struct fsw_extent *extent)
 {
@@ -1718,6 +2434,24 @@ static fsw_status_t fsw_btrfs_get_extent(struct fsw_volume *volg, struct fsw_dno
 
             if (vol->extent->compression == GRUB_BTRFS_COMPRESSION_NONE)
             {
+                uint64_t paddr, plen;
+
+                /* Let the core read straight from the disk where it can,
+                   unless the data has to be checked first.  */
+                if (!(vol->verify_csum && vol->csum_tree) && fsw_btrfs_map_direct (vol,
+                            fsw_u64_le_swap (vol->extent->laddr)
+                            + fsw_u64_le_swap (vol->extent->offset)
+                            + extoff, &paddr, &plen))
+                {
+                    if ((uint64_t) csize > plen)
+                        count = plen >> vol->sectorshift;
+                    extent->log_count = count;
+                    extent->phys_start = paddr >> vol->sectorshift;
+                    extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
+                    return FSW_SUCCESS;
+                }
+
+                /* Otherwise go through a bounce buffer of limited size.  */
                 if( count > 64 ) {
                     count = 64;
                     csize = count << vol->sectorshift;
@@ -1725,10 +2459,10 @@ static fsw_status_t fsw_btrfs_get_extent(struct fsw_volume *volg, struct fsw_dno
                 buf = AllocatePool( count << vol->sectorshift);
                 if(!buf)
                     return FSW_OUT_OF_MEMORY;
-                err = fsw_btrfs_read_logical (vol,
+                err = fsw_btrfs_read_data (vol,
                         fsw_u64_le_swap (vol->extent->laddr)
                         + fsw_u64_le_swap (vol->extent->offset)
-                        + extoff, buf, csize, 0, 0);
+                        + extoff, buf, csize);
                 if (err) {
                     FreePool(buf);
                     return err;
@@ -1739,16 +2473,46 @@ static fsw_status_t fsw_btrfs_get_extent(struct fsw_volume *volg, struct fsw_dno
             if (vol->extent->compression > GRUB_BTRFS_COMPRESSION_MAX)
                     return -FSW_VOLUME_CORRUPTED;
 
+            if (vol->extent->compression == GRUB_BTRFS_COMPRESSION_ZLIB
+                    || fsw_u64_le_swap (vol->extent->size) <= GRUB_BTRFS_MAX_UNCOMPRESSED)
+            {
+                struct fsw_btrfs_dnode *dno = (struct fsw_btrfs_dnode *)dnog;
+                uint64_t zoff = extoff + fsw_u64_le_swap (vol->extent->offset);
+                uint64_t zend;
+
+                err = fsw_btrfs_fill_zcache (vol, dno, zoff, zoff + csize);
+                if (err)
+                    return err;
+                zend = dno->zcache_start + dno->zcache_size;
+                if (zoff < dno->zcache_start || zoff >= zend)
+                    return FSW_VOLUME_CORRUPTED;
+                if (zoff + csize > zend) {
+                    /* Only part of a large extent fits, pass on that much.  */
+                    if (!dno->zstrm || ((zend - zoff) >> vol->sectorshift) == 0)
+                        return FSW_VOLUME_CORRUPTED;
+                    count = (zend - zoff) >> vol->sectorshift;
+                    csize = count << vol->sectorshift;
+                }
+
+                buf = AllocatePool( count << vol->sectorshift);
+                if(!buf)
+                    return FSW_OUT_OF_MEMORY;
+                fsw_memcpy (buf, dno->zcache + (zoff - dno->zcache_start), csize);
+                break;
+            }
+
+            /* Larger than anything the kernel writes, decompress just the part needed.  */
             {
                 char *tmp;
-                uint64_t zsize;
+                uint64_t zsize, zread;
                 fsw_ssize_t ret;
 
                 zsize = fsw_u64_le_swap (vol->extent->compressed_size);
-                tmp = AllocatePool (zsize);
+                zread = (zsize + vol->sectorsize - 1) & ~(uint64_t) (vol->sectorsize - 1);
+                tmp = AllocatePool (zread);
                 if (!tmp)
                     return -FSW_OUT_OF_MEMORY;
-                err = fsw_btrfs_read_logical (vol, fsw_u64_le_swap (vol->extent->laddr), tmp, zsize, 0, 0);
+                err = fsw_btrfs_read_data (vol, fsw_u64_le_swap (vol->extent->laddr), tmp, zread);
                 if (err)
                 {
                     FreePool (tmp);
@@ -1769,7 +2533,7 @@ static fsw_status_t fsw_btrfs_get_extent(struct fsw_volume *volg, struct fsw_dno
                 FreePool (tmp);
 
                 if (ret != (fsw_ssize_t) csize) {
-                    FreePool(tmp);
+                    FreePool(buf);
                     return -FSW_VOLUME_CORRUPTED;
                 }
 
@@ -2050,6 +2814,12 @@ static fsw_status_t fsw_btrfs_get_default_root(struct fsw_btrfs_volume *vol, uin
     return err;
 }
 
+/*
+ * Directory listing walks the DIR_ITEM keys of the directory in hash order.
+ * The tree path of the entry returned last is kept in the dnode, so the
+ * next call for the same position just steps to the following leaf item
+ * instead of searching down from the tree root again.
+ */
 static fsw_status_t fsw_btrfs_dir_read(struct fsw_volume *volg, struct fsw_dnode *dnog,
         struct fsw_shandle *shand, struct fsw_dnode **child_dno_out)
 {
@@ -2062,7 +2832,7 @@ static fsw_status_t fsw_btrfs_dir_read(struct fsw_volume *volg, struct fsw_dnode
     fsw_size_t elemsize;
     fsw_size_t allocated = 0;
     struct btrfs_dir_item *direl = NULL;
-    struct fsw_btrfs_leaf_descriptor desc;
+    struct fsw_btrfs_leaf_descriptor *desc = &dno->dir_desc;
     int r = 0;
     uint64_t tree = dnog->tree_id;
 
@@ -2079,33 +2849,48 @@ static fsw_status_t fsw_btrfs_dir_read(struct fsw_volume *volg, struct fsw_dnode
         return FSW_NOT_FOUND;
     }
 
-    err = lower_bound (vol, &key_in, &key_out, tree, &elemaddr, &elemsize, &desc, 0);
-    if (err) {
-        return err;
-    }
-
-    DPRINT(L"key_in %lx:%x:%lx out %lx:%x:%lx elem %lx+%lx\n",
-            key_in.object_id, key_in.type, key_in.offset,
-            key_out.object_id, key_out.type, key_out.offset,
-            elemaddr, elemsize);
-    if (key_out.type != GRUB_BTRFS_ITEM_TYPE_DIR_ITEM ||
-            key_out.object_id != key_in.object_id)
+    if (desc->data && dno->dir_pos == shand->pos)
     {
-        r = next (vol, &desc, &elemaddr, &elemsize, &key_out);
+        /* continue right after the entry returned last time */
+        r = next (vol, desc, &elemaddr, &elemsize, &key_out);
         if (r <= 0)
             goto out;
-        DPRINT(L"next out %lx:%x:%lx\n",
-                key_out.object_id, key_out.type, key_out.offset, elemaddr, elemsize);
     }
-    if (key_out.type == GRUB_BTRFS_ITEM_TYPE_DIR_ITEM &&
-            key_out.object_id == key_in.object_id &&
-            fsw_u64_le_swap(key_out.offset) <= fsw_u64_le_swap(key_in.offset))
+    else
     {
-        r = next (vol, &desc, &elemaddr, &elemsize, &key_out);
-        if (r <= 0)
-            goto out;
-        DPRINT(L"next out %lx:%x:%lx\n",
-                key_out.object_id, key_out.type, key_out.offset, elemaddr, elemsize);
+        if (desc->data)
+            free_iterator (desc);
+
+        err = lower_bound (vol, &key_in, &key_out, tree, &elemaddr, &elemsize, desc, 0);
+        if (err) {
+            if (desc->data)
+                free_iterator (desc);
+            return err;
+        }
+
+        DPRINT(L"key_in %lx:%x:%lx out %lx:%x:%lx elem %lx+%lx\n",
+                key_in.object_id, key_in.type, key_in.offset,
+                key_out.object_id, key_out.type, key_out.offset,
+                elemaddr, elemsize);
+        if (key_out.type != GRUB_BTRFS_ITEM_TYPE_DIR_ITEM ||
+                key_out.object_id != key_in.object_id)
+        {
+            r = next (vol, desc, &elemaddr, &elemsize, &key_out);
+            if (r <= 0)
+                goto out;
+            DPRINT(L"next out %lx:%x:%lx\n",
+                    key_out.object_id, key_out.type, key_out.offset, elemaddr, elemsize);
+        }
+        if (key_out.type == GRUB_BTRFS_ITEM_TYPE_DIR_ITEM &&
+                key_out.object_id == key_in.object_id &&
+                fsw_u64_le_swap(key_out.offset) <= fsw_u64_le_swap(key_in.offset))
+        {
+            r = next (vol, desc, &elemaddr, &elemsize, &key_out);
+            if (r <= 0)
+                goto out;
+            DPRINT(L"next out %lx:%x:%lx\n",
+                    key_out.object_id, key_out.type, key_out.offset, elemaddr, elemsize);
+        }
     }
 
     do
@@ -2154,12 +2939,12 @@ static fsw_status_t fsw_btrfs_dir_read(struct fsw_volume *volg, struct fsw_dnode
                 err = fsw_btrfs_get_sub_dnode(vol, dno, cdirel, &s, child_dno_out);
                 if(direl)
                     FreePool (direl);
-                free_iterator (&desc);
                 shand->pos = key_out.offset;
+                dno->dir_pos = shand->pos;
                 return FSW_SUCCESS;
             }
         }
-        r = next (vol, &desc, &elemaddr, &elemsize, &key_out);
+        r = next (vol, desc, &elemaddr, &elemsize, &key_out);
         DPRINT(L"next2 out %lx:%x:%lx\n",
                 key_out.object_id, key_out.type, key_out.offset, elemaddr, elemsize);
     }
@@ -2168,7 +2953,7 @@ static fsw_status_t fsw_btrfs_dir_read(struct fsw_volume *volg, struct fsw_dnode
 out:
     if(direl)
         FreePool (direl);
-    free_iterator (&desc);
+    free_iterator (desc);
 
     r = r < 0 ? -r : FSW_NOT_FOUND;
     return r;
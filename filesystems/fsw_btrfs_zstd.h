@@ -13,39 +13,7 @@
 #define uintptr_t unsigned long
 #define sys_memmove fsw_memcpy
 
-static inline uint16_t get_unaligned_le16(const void *s)
-{
-	const unsigned char *p = (const unsigned char *)s;
-	return p[0]+ (p[1]<<8);
-}
-
-static inline uint32_t get_unaligned_le32(const void *s)
-{
-	const unsigned char *p = (const unsigned char *)s;
-	return p[0]+ (p[1]<<8) + (p[2]<<16) + (p[3]<<24);
-}
-
-static inline uint64_t get_unaligned_le64(const void *s)
-{
-	const unsigned char *p = (const unsigned char *)s;
-	uint64_t v0 = get_unaligned_le32(p);
-	uint64_t v1 = get_unaligned_le32(p+4);
-	return v0 + (v1<<32);
-}
-
-static inline void put_unaligned_le16(uint16_t v, void *s)
-{
-	unsigned char *p = (unsigned char *)s;
-	p[0] = v & 0xff;
-	p[1] = v >> 8;
-}
-
-#define UP_U32(a)	(((a)+3) >> 2)
-
-#include "zstd/xxhash64.c"
-#include "zstd/zstd_decompress.c"
-#include "zstd/fse_decompress.c"
-#include "zstd/huf_decompress.c"
+#include "zstd/zstd_lib.h"
 
 #define ZSTD_BTRFS_MAX_WINDOWLOG 17
 #define ZSTD_BTRFS_MAX_INPUT (1 << ZSTD_BTRFS_MAX_WINDOWLOG)
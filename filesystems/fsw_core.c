@@ -38,14 +38,25 @@
  */
 
 #include "fsw_core.h"
+#ifndef HOST_POSIX
 #include "fsw_efi.h"
+#endif
 
 
 // functions
 
+static fsw_status_t fsw_blockcache_init(struct fsw_volume *vol);
+static struct fsw_blockcache *fsw_blockcache_find(struct fsw_volume *vol, fsw_u64 phys_bno);
+static void fsw_blockcache_hash_insert(struct fsw_volume *vol, struct fsw_blockcache *bc);
+static void fsw_blockcache_hash_unlink(struct fsw_volume *vol, struct fsw_blockcache *bc);
+static void fsw_blockcache_lru_append(struct fsw_volume *vol, struct fsw_blockcache *bc);
+static void fsw_blockcache_lru_unlink(struct fsw_volume *vol, struct fsw_blockcache *bc);
 static void fsw_blockcache_free(struct fsw_volume *vol);
-
-#define MAX_CACHE_LEVEL (5)
+static struct fsw_dnode *fsw_dnode_index_find(struct fsw_volume *vol, fsw_u64 tree_id, fsw_u64 dnode_id);
+static void fsw_dnode_index_remove(struct fsw_volume *vol, struct fsw_dnode *dno);
+static fsw_status_t fsw_dnode_dir_lookup(struct fsw_dnode *dno,
+                                         struct fsw_string *lookup_name, struct fsw_dnode **child_dno_out);
+static void fsw_dcache_flush(struct fsw_volume *vol);
 
 /**
  * Mount a volume with a given file system driver. This function is called by the
@@ -108,6 +119,7 @@ errorexit:
 
 void fsw_unmount(struct fsw_volume *vol)
 {
+    fsw_dcache_flush(vol);
     if (vol->root)
         fsw_dnode_release(vol->root);
     // TODO: check that no other dnodes are still around
@@ -115,6 +127,8 @@ void fsw_unmount(struct fsw_volume *vol)
     vol->fstype_table->volume_free(vol);
 
     fsw_blockcache_free(vol);
+    if (vol->dnode_hash != NULL)
+        fsw_free(vol->dnode_hash);
     fsw_strfree(&vol->label);
     fsw_free(vol);
 }
@@ -167,7 +181,8 @@ void fsw_set_blocksize(struct fsw_volume *vol, fsw_u32 phys_blocksize, fsw_u32 l
  * Given a physical block number, it reads the block into memory (or fetches it from the
  * block cache) and returns the address of the memory buffer. The caller should provide
  * an indication of how important the block is in the cache_level parameter. Blocks with
- * a low level are purged first. Some suggestions for cache levels:
+ * a low level are purged first; within a level, the least recently released block goes
+ * first. Some suggestions for cache levels:
  *
  *  - 0: File data
  *  - 1: Directory data, symlink data
@@ -181,83 +196,74 @@ void fsw_set_blocksize(struct fsw_volume *vol, fsw_u32 phys_blocksize, fsw_u32 l
 fsw_status_t fsw_block_get(struct VOLSTRUCTNAME *vol, fsw_u64 phys_bno, fsw_u32 cache_level, void **buffer_out)
 {
     fsw_status_t    status;
-    fsw_u32         i, discard_level, new_bcache_size;
-    struct fsw_blockcache *new_bcache;
+    fsw_u32         level;
+    struct fsw_blockcache *bc;
 
     // TODO: allow the host driver to do its own caching; just call through if
     //  the appropriate function pointers are set
 
-    if (cache_level > MAX_CACHE_LEVEL)
-        cache_level = MAX_CACHE_LEVEL;
+    if (cache_level > FSW_MAX_CACHE_LEVEL)
+        cache_level = FSW_MAX_CACHE_LEVEL;
 
-    // check block cache
-    for (i = 0; i < vol->bcache_size; i++) {
-        if (vol->bcache[i].phys_bno == phys_bno) {
-            // cache hit!
-            if (vol->bcache[i].cache_level < cache_level)
-                vol->bcache[i].cache_level = cache_level;  // promote the entry
-            vol->bcache[i].refcount++;
-            *buffer_out = vol->bcache[i].data;
-            return FSW_SUCCESS;
-        }
+    if (vol->bcache_hash == NULL) {
+        status = fsw_blockcache_init(vol);
+        if (status)
+            return status;
     }
 
-    // find a free entry in the cache table
-    for (i = 0; i < vol->bcache_size; i++) {
-        if (vol->bcache[i].phys_bno == (fsw_u64)FSW_INVALID_BNO)
-            break;
+    // check block cache
+    bc = fsw_blockcache_find(vol, phys_bno);
+    if (bc != NULL) {
+        // cache hit!
+        vol->stats.bcache_hits++;
+        if (bc->refcount == 0)
+            fsw_blockcache_lru_unlink(vol, bc);
+        if (bc->cache_level < cache_level)
+            bc->cache_level = cache_level;  // promote the entry
+        bc->refcount++;
+        *buffer_out = bc->data;
+        return FSW_SUCCESS;
     }
-    if (i >= vol->bcache_size) {
-        for (discard_level = 0; discard_level <= MAX_CACHE_LEVEL; discard_level++) {
-            for (i = 0; i < vol->bcache_size; i++) {
-                if (vol->bcache[i].refcount == 0 && vol->bcache[i].cache_level <= discard_level)
-                    break;
-            }
-            if (i < vol->bcache_size)
+
+    // get an entry: a new one while within budget, otherwise the least recently
+    //  used unreferenced entry from the lowest populated level
+    bc = NULL;
+    if (vol->bcache_size >= vol->bcache_max) {
+        for (level = 0; level <= FSW_MAX_CACHE_LEVEL; level++) {
+            bc = vol->bcache_lru_head[level];
+            if (bc != NULL)
                 break;
         }
     }
-    if (i >= vol->bcache_size) {
-        // enlarge / create the cache
-        if (vol->bcache_size < 16)
-            new_bcache_size = 16;
-        else
-            new_bcache_size = vol->bcache_size << 1;
-        status = fsw_alloc(new_bcache_size * sizeof(struct fsw_blockcache), &new_bcache);
+    vol->stats.bcache_misses++;
+    if (bc != NULL) {
+        fsw_blockcache_lru_unlink(vol, bc);
+        fsw_blockcache_hash_unlink(vol, bc);
+        vol->stats.bcache_evictions++;
+    } else {
+        // all entries are in use (or we are below budget), allocate a new one
+        status = fsw_alloc_zero(sizeof(struct fsw_blockcache) + vol->phys_blocksize, (void **)&bc);
         if (status)
             return status;
-        if (vol->bcache_size > 0)
-            fsw_memcpy(new_bcache, vol->bcache, vol->bcache_size * sizeof(struct fsw_blockcache));
-        for (i = vol->bcache_size; i < new_bcache_size; i++) {
-            new_bcache[i].refcount = 0;
-            new_bcache[i].cache_level = 0;
-            new_bcache[i].phys_bno = (fsw_u64)FSW_INVALID_BNO;
-            new_bcache[i].data = NULL;
-        }
-        i = vol->bcache_size;
-
-        // switch caches
-        if (vol->bcache != NULL)
-            fsw_free(vol->bcache);
-        vol->bcache = new_bcache;
-        vol->bcache_size = new_bcache_size;
+        bc->data = bc + 1;
+        vol->bcache_size++;
     }
-    vol->bcache[i].phys_bno = (fsw_u64)FSW_INVALID_BNO;
 
     // read the data
-    if (vol->bcache[i].data == NULL) {
-        status = fsw_alloc(vol->phys_blocksize, &vol->bcache[i].data);
-        if (status)
-            return status;
-    }
-    status = vol->host_table->read_block(vol, phys_bno, vol->bcache[i].data);
-    if (status)
+    vol->stats.read_calls++;
+    status = vol->host_table->read_block(vol, phys_bno, bc->data);
+    if (status) {
+        fsw_free(bc);
+        vol->bcache_size--;
         return status;
+    }
+    vol->stats.read_bytes += vol->phys_blocksize;
 
-    vol->bcache[i].phys_bno = phys_bno;
-    vol->bcache[i].cache_level = cache_level;
-    vol->bcache[i].refcount = 1;
-    *buffer_out = vol->bcache[i].data;
+    bc->phys_bno = phys_bno;
+    bc->cache_level = cache_level;
+    bc->refcount = 1;
+    fsw_blockcache_hash_insert(vol, bc);
+    *buffer_out = bc->data;
     return FSW_SUCCESS;
 }
 
@@ -268,16 +274,123 @@ fsw_status_t fsw_block_get(struct VOLSTRUCTNAME *vol, fsw_u64 phys_bno, fsw_u32
 
 void fsw_block_release(struct VOLSTRUCTNAME *vol, fsw_u64 phys_bno, void *buffer)
 {
-    fsw_u32 i;
+    struct fsw_blockcache *bc;
 
     // TODO: allow the host driver to do its own caching; just call through if
     //  the appropriate function pointers are set
 
     // update block cache
-    for (i = 0; i < vol->bcache_size; i++) {
-        if (vol->bcache[i].phys_bno == phys_bno && vol->bcache[i].refcount > 0)
-            vol->bcache[i].refcount--;
+    if (vol->bcache_hash == NULL)
+        return;
+    bc = fsw_blockcache_find(vol, phys_bno);
+    if (bc != NULL && bc->refcount > 0) {
+        bc->refcount--;
+        if (bc->refcount == 0)
+            fsw_blockcache_lru_append(vol, bc);
+    }
+}
+
+/**
+ * Set up the block cache hash table. Called on the first fsw_block_get after mounting
+ * or changing block sizes. The number of entries is derived from FSW_BCACHE_MAX_BYTES
+ * and the physical block size; the hash table is sized to the next power of 2.
+ */
+
+static fsw_status_t fsw_blockcache_init(struct fsw_volume *vol)
+{
+    fsw_status_t    status;
+    fsw_u32         max_entries, bits;
+
+    max_entries = FSW_BCACHE_MAX_BYTES / vol->phys_blocksize;
+    if (max_entries < FSW_BCACHE_MIN_ENTRIES)
+        max_entries = FSW_BCACHE_MIN_ENTRIES;
+    for (bits = 4; ((fsw_u32)1 << bits) < max_entries; bits++)
+        ;
+
+    status = fsw_alloc_zero(sizeof(struct fsw_blockcache *) << bits, (void **)&vol->bcache_hash);
+    if (status)
+        return status;
+    vol->bcache_hash_bits = bits;
+    vol->bcache_max = max_entries;
+    vol->bcache_size = 0;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Map a physical block number to a hash table index. Multiplicative hashing spreads
+ * runs of consecutive block numbers over the whole table.
+ */
+
+static fsw_u32 fsw_blockcache_hash(struct fsw_volume *vol, fsw_u64 phys_bno)
+{
+    fsw_u32 h;
+
+    h = (fsw_u32)phys_bno ^ (fsw_u32)FSW_U64_SHR(phys_bno, 32);
+    h *= 0x9E3779B1;
+    return h >> (32 - vol->bcache_hash_bits);
+}
+
+static struct fsw_blockcache *fsw_blockcache_find(struct fsw_volume *vol, fsw_u64 phys_bno)
+{
+    struct fsw_blockcache *bc;
+
+    for (bc = vol->bcache_hash[fsw_blockcache_hash(vol, phys_bno)]; bc; bc = bc->hash_next) {
+        if (bc->phys_bno == phys_bno)
+            return bc;
+    }
+    return NULL;
+}
+
+static void fsw_blockcache_hash_insert(struct fsw_volume *vol, struct fsw_blockcache *bc)
+{
+    fsw_u32 h = fsw_blockcache_hash(vol, bc->phys_bno);
+
+    bc->hash_next = vol->bcache_hash[h];
+    vol->bcache_hash[h] = bc;
+}
+
+static void fsw_blockcache_hash_unlink(struct fsw_volume *vol, struct fsw_blockcache *bc)
+{
+    struct fsw_blockcache **link;
+
+    for (link = &vol->bcache_hash[fsw_blockcache_hash(vol, bc->phys_bno)]; *link; link = &(*link)->hash_next) {
+        if (*link == bc) {
+            *link = bc->hash_next;
+            break;
+        }
     }
+    bc->hash_next = NULL;
+    bc->phys_bno = (fsw_u64)FSW_INVALID_BNO;
+}
+
+/**
+ * Put an unreferenced entry at the most recently used end of its level's LRU list.
+ * Only entries with a reference count of zero are kept on the LRU lists.
+ */
+
+static void fsw_blockcache_lru_append(struct fsw_volume *vol, struct fsw_blockcache *bc)
+{
+    bc->lru_next = NULL;
+    bc->lru_prev = vol->bcache_lru_tail[bc->cache_level];
+    if (bc->lru_prev != NULL)
+        bc->lru_prev->lru_next = bc;
+    else
+        vol->bcache_lru_head[bc->cache_level] = bc;
+    vol->bcache_lru_tail[bc->cache_level] = bc;
+}
+
+static void fsw_blockcache_lru_unlink(struct fsw_volume *vol, struct fsw_blockcache *bc)
+{
+    if (bc->lru_prev != NULL)
+        bc->lru_prev->lru_next = bc->lru_next;
+    else
+        vol->bcache_lru_head[bc->cache_level] = bc->lru_next;
+    if (bc->lru_next != NULL)
+        bc->lru_next->lru_prev = bc->lru_prev;
+    else
+        vol->bcache_lru_tail[bc->cache_level] = bc->lru_prev;
+    bc->lru_prev = NULL;
+    bc->lru_next = NULL;
 }
 
 /**
@@ -287,33 +400,155 @@ void fsw_block_release(struct VOLSTRUCTNAME *vol, fsw_u64 phys_bno, void *buffer
 
 static void fsw_blockcache_free(struct fsw_volume *vol)
 {
-    fsw_u32 i;
-
-    for (i = 0; i < vol->bcache_size; i++) {
-        if (vol->bcache[i].data != NULL)
-            fsw_free(vol->bcache[i].data);
+    fsw_u32 i, level;
+    struct fsw_blockcache *bc, *next;
+
+    if (vol->bcache_hash != NULL) {
+        for (i = 0; i < ((fsw_u32)1 << vol->bcache_hash_bits); i++) {
+            for (bc = vol->bcache_hash[i]; bc; bc = next) {
+                next = bc->hash_next;
+                fsw_free(bc);
+            }
+        }
+        fsw_free(vol->bcache_hash);
+        vol->bcache_hash = NULL;
     }
-    if (vol->bcache != NULL) {
-        fsw_free(vol->bcache);
-        vol->bcache = NULL;
+    for (level = 0; level <= FSW_MAX_CACHE_LEVEL; level++) {
+        vol->bcache_lru_head[level] = NULL;
+        vol->bcache_lru_tail[level] = NULL;
     }
+    vol->bcache_hash_bits = 0;
     vol->bcache_size = 0;
-    fsw_efi_clear_cache();
+    vol->bcache_max = 0;
+#ifndef HOST_POSIX
+    fsw_efi_clear_cache(vol);
+#endif
+}
+
+/**
+ * Compute the hash of a dnode's identity for the dnode hash index.
+ */
+
+static fsw_u32 fsw_dnode_hash(fsw_u64 tree_id, fsw_u64 dnode_id)
+{
+    fsw_u32 h;
+
+    h = (fsw_u32)dnode_id ^ (fsw_u32)FSW_U64_SHR(dnode_id, 32);
+    h ^= ((fsw_u32)tree_id ^ (fsw_u32)FSW_U64_SHR(tree_id, 32)) * 0x85EBCA6B;
+    h *= 0x9E3779B1;
+    return h ^ (h >> 16);
+}
+
+/**
+ * Find a live dnode by id in the volume's hash index. Returns NULL if there is none.
+ */
+
+static struct fsw_dnode *fsw_dnode_index_find(struct fsw_volume *vol, fsw_u64 tree_id, fsw_u64 dnode_id)
+{
+    fsw_u32 i, mask;
+    struct fsw_dnode *dno;
+
+    if (vol->dnode_hash == NULL)
+        return NULL;
+    mask = vol->dnode_hash_size - 1;
+    for (i = fsw_dnode_hash(tree_id, dnode_id) & mask; (dno = vol->dnode_hash[i]) != NULL; i = (i + 1) & mask) {
+        if (dno->dnode_id == dnode_id && dno->tree_id == tree_id)
+            return dno;
+    }
+    return NULL;
+}
+
+/**
+ * Enter a dnode into the hash index, using linear probing. The table is doubled
+ * whenever it would become more than half full.
+ */
+
+static fsw_status_t fsw_dnode_index_insert(struct fsw_volume *vol, struct fsw_dnode *dno)
+{
+    fsw_status_t    status;
+    fsw_u32         i, mask, old_size, new_size;
+    struct fsw_dnode **old_hash, **new_hash;
+
+    if ((vol->dnode_count + 1) * 2 > vol->dnode_hash_size) {
+        old_size = vol->dnode_hash_size;
+        old_hash = vol->dnode_hash;
+        new_size = (old_size < FSW_DNODE_HASH_MIN_SIZE) ? FSW_DNODE_HASH_MIN_SIZE : old_size << 1;
+        status = fsw_alloc_zero(new_size * sizeof(struct fsw_dnode *), (void **)&new_hash);
+        if (status)
+            return status;
+
+        // rehash all live entries into the new table
+        vol->dnode_hash = new_hash;
+        vol->dnode_hash_size = new_size;
+        vol->dnode_count = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old_hash[i] != NULL)
+                fsw_dnode_index_insert(vol, old_hash[i]);   // cannot fail, table is large enough
+        }
+        if (old_hash != NULL)
+            fsw_free(old_hash);
+    }
+
+    mask = vol->dnode_hash_size - 1;
+    for (i = fsw_dnode_hash(dno->tree_id, dno->dnode_id) & mask; vol->dnode_hash[i] != NULL; i = (i + 1) & mask)
+        ;
+    vol->dnode_hash[i] = dno;
+    vol->dnode_count++;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Remove a dnode from the hash index. Entries following it in the same probe
+ * sequence are shifted back, so that no tombstones are needed.
+ */
+
+static void fsw_dnode_index_remove(struct fsw_volume *vol, struct fsw_dnode *dno)
+{
+    fsw_u32 i, j, home, mask;
+    struct fsw_dnode *cur;
+
+    if (vol->dnode_hash == NULL)
+        return;
+    mask = vol->dnode_hash_size - 1;
+    for (i = fsw_dnode_hash(dno->tree_id, dno->dnode_id) & mask; vol->dnode_hash[i] != dno; i = (i + 1) & mask) {
+        if (vol->dnode_hash[i] == NULL)
+            return;     // not indexed
+    }
+    vol->dnode_hash[i] = NULL;
+    vol->dnode_count--;
+
+    for (j = (i + 1) & mask; (cur = vol->dnode_hash[j]) != NULL; j = (j + 1) & mask) {
+        home = fsw_dnode_hash(cur->tree_id, cur->dnode_id) & mask;
+        // leave the entry alone if its home slot lies cyclically within (i, j]
+        if ((i <= j) ? (home > i && home <= j) : (home > i || home <= j))
+            continue;
+        vol->dnode_hash[i] = cur;
+        vol->dnode_hash[j] = NULL;
+        i = j;
+    }
 }
 
 /**
  * Add a new dnode to the list of known dnodes. This internal function is used when a
- * dnode is created to add it to the dnode list that is used to search for existing
- * dnodes by id.
+ * dnode is created to add it to the dnode list and to the hash index that is used to
+ * search for existing dnodes by id.
  */
 
-static void fsw_dnode_register(struct fsw_volume *vol, struct fsw_dnode *dno)
+static fsw_status_t fsw_dnode_register(struct fsw_volume *vol, struct fsw_dnode *dno)
 {
+    fsw_status_t    status;
+
+    status = fsw_dnode_index_insert(vol, dno);
+    if (status)
+        return status;
+
     dno->next = vol->dnode_head;
     if (vol->dnode_head != NULL)
         vol->dnode_head->prev = dno;
     dno->prev = NULL;
     vol->dnode_head = dno;
+    vol->stats.dnode_creates++;
+    return FSW_SUCCESS;
 }
 
 /**
@@ -343,7 +578,11 @@ fsw_status_t fsw_dnode_create_root_with_tree(struct fsw_volume *vol, fsw_u64 tre
     dno->name.type = FSW_STRING_TYPE_EMPTY;
     // TODO: instead, call a function to create an empty string in the native string type
 
-    fsw_dnode_register(vol, dno);
+    status = fsw_dnode_register(vol, dno);
+    if (status) {
+        fsw_free(dno);
+        return status;
+    }
 
     *dno_out = dno;
     return FSW_SUCCESS;
@@ -379,12 +618,11 @@ fsw_status_t fsw_dnode_create_with_tree(struct fsw_dnode *parent_dno, fsw_u64 tr
     struct fsw_dnode *dno;
 
     // check if we already have a dnode with the same id
-    for (dno = vol->dnode_head; dno; dno = dno->next) {
-        if (dno->dnode_id == dnode_id && dno->tree_id == tree_id) {
-            fsw_dnode_retain(dno);
-            *dno_out = dno;
-            return FSW_SUCCESS;
-        }
+    dno = fsw_dnode_index_find(vol, tree_id, dnode_id);
+    if (dno != NULL) {
+        fsw_dnode_retain(dno);
+        *dno_out = dno;
+        return FSW_SUCCESS;
     }
 
     // allocate memory for the structure
@@ -395,7 +633,6 @@ fsw_status_t fsw_dnode_create_with_tree(struct fsw_dnode *parent_dno, fsw_u64 tr
     // fill the structure
     dno->vol = vol;
     dno->parent = parent_dno;
-    fsw_dnode_retain(dno->parent);
     dno->tree_id = tree_id;
     dno->dnode_id = dnode_id;
     dno->type = type;
@@ -406,7 +643,13 @@ fsw_status_t fsw_dnode_create_with_tree(struct fsw_dnode *parent_dno, fsw_u64 tr
         return status;
     }
 
-    fsw_dnode_register(vol, dno);
+    status = fsw_dnode_register(vol, dno);
+    if (status) {
+        fsw_strfree(&dno->name);
+        fsw_free(dno);
+        return status;
+    }
+    fsw_dnode_retain(dno->parent);
 
     *dno_out = dno;
     return FSW_SUCCESS;
@@ -446,7 +689,8 @@ void fsw_dnode_release(struct fsw_dnode *dno)
     if (dno->refcount == 0) {
         parent_dno = dno->parent;
 
-        // de-register from volume's list
+        // de-register from volume's list and hash index
+        fsw_dnode_index_remove(vol, dno);
         if (dno->next)
             dno->next->prev = dno->prev;
         if (dno->prev)
@@ -532,7 +776,174 @@ fsw_status_t fsw_dnode_lookup(struct fsw_dnode *dno,
     if (dno->type != FSW_DNODE_TYPE_DIR)
         return FSW_UNSUPPORTED;
 
-    return dno->vol->fstype_table->dir_lookup(dno->vol, dno, lookup_name, child_dno_out);
+    return fsw_dnode_dir_lookup(dno, lookup_name, child_dno_out);
+}
+
+/**
+ * Compute the directory entry cache hash of a lookup.
+ */
+
+static fsw_u32 fsw_dcache_hash(struct fsw_dnode *dno, struct fsw_string *name)
+{
+    fsw_u32 h;
+    int     i;
+
+    h = fsw_dnode_hash(dno->tree_id, dno->dnode_id);
+    for (i = 0; i < name->size; i++) {
+        h ^= ((fsw_u8 *)name->data)[i];
+        h *= 0x01000193;    // FNV-1a
+    }
+    return h;
+}
+
+static void fsw_dcache_lru_unlink(struct fsw_volume *vol, struct fsw_dentry *de)
+{
+    if (de->lru_prev != NULL)
+        de->lru_prev->lru_next = de->lru_next;
+    else
+        vol->dcache_lru_head = de->lru_next;
+    if (de->lru_next != NULL)
+        de->lru_next->lru_prev = de->lru_prev;
+    else
+        vol->dcache_lru_tail = de->lru_prev;
+}
+
+static void fsw_dcache_lru_append(struct fsw_volume *vol, struct fsw_dentry *de)
+{
+    de->lru_next = NULL;
+    de->lru_prev = vol->dcache_lru_tail;
+    if (de->lru_prev != NULL)
+        de->lru_prev->lru_next = de;
+    else
+        vol->dcache_lru_head = de;
+    vol->dcache_lru_tail = de;
+}
+
+/**
+ * Remove an entry from the directory entry cache and free it.
+ */
+
+static void fsw_dcache_remove(struct fsw_volume *vol, struct fsw_dentry *de)
+{
+    struct fsw_dentry **link;
+
+    for (link = &vol->dcache_hash[de->hash & (FSW_DCACHE_HASH_SIZE - 1)]; *link; link = &(*link)->hash_next) {
+        if (*link == de) {
+            *link = de->hash_next;
+            break;
+        }
+    }
+    fsw_dcache_lru_unlink(vol, de);
+    vol->dcache_count--;
+    vol->dcache_bytes -= sizeof(struct fsw_dentry) + de->name.size;
+
+    fsw_strfree(&de->name);
+    fsw_free(de);
+}
+
+/**
+ * Drop all entries of the directory entry cache. Called when unmounting the volume.
+ */
+
+static void fsw_dcache_flush(struct fsw_volume *vol)
+{
+    while (vol->dcache_lru_head != NULL)
+        fsw_dcache_remove(vol, vol->dcache_lru_head);
+    if (vol->dcache_hash != NULL) {
+        fsw_free(vol->dcache_hash);
+        vol->dcache_hash = NULL;
+    }
+}
+
+/**
+ * Look up a directory entry through the volume's directory entry cache. Both found
+ * and missing names are remembered, so that repeated opens and existence checks in
+ * the same directory do not have to search the directory again. The cache is bounded
+ * by FSW_DCACHE_MAX_ENTRIES and FSW_DCACHE_MAX_BYTES and evicts the least recently
+ * used entries.
+ *
+ * Entries only record dnode ids. A positive entry is answered from the cache while
+ * its dnode is still in memory; once the dnode has been freed, the name is looked up
+ * through the file system driver again.
+ *
+ * Only lookup names in the host's string type are cached; others are passed through
+ * to the file system driver.
+ */
+
+static fsw_status_t fsw_dnode_dir_lookup(struct fsw_dnode *dno,
+                                         struct fsw_string *lookup_name, struct fsw_dnode **child_dno_out)
+{
+    fsw_status_t    status;
+    struct fsw_volume *vol = dno->vol;
+    struct fsw_dentry *de;
+    struct fsw_dnode *child;
+    fsw_u32         hash, size;
+
+    if (lookup_name->type != vol->host_string_type)
+        return vol->fstype_table->dir_lookup(vol, dno, lookup_name, child_dno_out);
+
+    hash = fsw_dcache_hash(dno, lookup_name);
+    if (vol->dcache_hash != NULL) {
+        for (de = vol->dcache_hash[hash & (FSW_DCACHE_HASH_SIZE - 1)]; de; de = de->hash_next) {
+            if (de->hash == hash && de->parent_id == dno->dnode_id && de->parent_tree_id == dno->tree_id &&
+                fsw_streq(&de->name, lookup_name)) {
+                child = NULL;
+                if (de->found) {
+                    child = fsw_dnode_index_find(vol, de->child_tree_id, de->child_id);
+                    if (child == NULL) {
+                        // the dnode is gone, let the driver recreate it
+                        fsw_dcache_remove(vol, de);
+                        break;
+                    }
+                }
+                // cache hit, make it the most recently used entry
+                vol->stats.dcache_hits++;
+                fsw_dcache_lru_unlink(vol, de);
+                fsw_dcache_lru_append(vol, de);
+                if (child == NULL)
+                    return FSW_NOT_FOUND;
+                fsw_dnode_retain(child);
+                *child_dno_out = child;
+                return FSW_SUCCESS;
+            }
+        }
+    }
+
+    vol->stats.dcache_misses++;
+    status = vol->fstype_table->dir_lookup(vol, dno, lookup_name, child_dno_out);
+    if (status != FSW_SUCCESS && status != FSW_NOT_FOUND)
+        return status;
+
+    // remember the result; failing to do so is not an error
+    if (vol->dcache_hash == NULL &&
+        fsw_alloc_zero(FSW_DCACHE_HASH_SIZE * sizeof(struct fsw_dentry *), (void **)&vol->dcache_hash))
+        return status;
+    if (fsw_alloc_zero(sizeof(struct fsw_dentry), (void **)&de))
+        return status;
+    if (fsw_strdup_coerce(&de->name, vol->host_string_type, lookup_name)) {
+        fsw_free(de);
+        return status;
+    }
+    size = sizeof(struct fsw_dentry) + de->name.size;
+    while (vol->dcache_lru_head != NULL &&
+           (vol->dcache_count >= FSW_DCACHE_MAX_ENTRIES || vol->dcache_bytes + size > FSW_DCACHE_MAX_BYTES))
+        fsw_dcache_remove(vol, vol->dcache_lru_head);
+
+    de->hash = hash;
+    de->parent_tree_id = dno->tree_id;
+    de->parent_id = dno->dnode_id;
+    if (status == FSW_SUCCESS) {
+        de->found = 1;
+        de->child_tree_id = (*child_dno_out)->tree_id;
+        de->child_id = (*child_dno_out)->dnode_id;
+    }
+    de->hash_next = vol->dcache_hash[hash & (FSW_DCACHE_HASH_SIZE - 1)];
+    vol->dcache_hash[hash & (FSW_DCACHE_HASH_SIZE - 1)] = de;
+    fsw_dcache_lru_append(vol, de);
+    vol->dcache_count++;
+    vol->dcache_bytes += size;
+
+    return status;
 }
 
 /**
@@ -624,7 +1035,7 @@ fsw_status_t fsw_dnode_lookup_path(struct fsw_dnode *dno,
 
             } else {
                 // do an actual lookup
-                status = vol->fstype_table->dir_lookup(vol, dno, &lookup_name, &child_dno);
+                status = fsw_dnode_dir_lookup(dno, &lookup_name, &child_dno);
                 if (status)
                     goto errorexit;
             }
@@ -855,7 +1266,12 @@ void fsw_shandle_close(struct fsw_shandle *shand)
 
 /**
  * Read data from a shandle (storage handle for a dnode). This function is called by the
- * host driver or internally when data is read from a file. TODO: more
+ * host driver or internally when data is read from a file.
+ *
+ * For regular files, block-aligned runs within a physical extent are read in one go
+ * into the caller's buffer through the host's read_blocks function, if it provides
+ * one. Only partial blocks at the start and end of a read pass through the block
+ * cache. Directory and symlink data always goes through the block cache.
  */
 
 fsw_status_t fsw_shandle_read(struct fsw_shandle *shand, fsw_u32 *buffer_size_inout, void *buffer_in)
@@ -865,8 +1281,8 @@ fsw_status_t fsw_shandle_read(struct fsw_shandle *shand, fsw_u32 *buffer_size_in
     struct fsw_volume *vol = dno->vol;
     fsw_u8          *buffer, *block_buffer;
     fsw_u64         buflen, copylen, pos;
-    fsw_u64         log_bno, pos_in_extent, phys_bno, pos_in_physblock;
-    fsw_u32         cache_level;
+    fsw_u64         log_bno, pos_in_extent, phys_bno, pos_in_physblock, extent_left;
+    fsw_u32         cache_level, phys_count;
 
     if (shand->pos >= dno->size) {   // already at EOF
         *buffer_size_inout = 0;
@@ -894,6 +1310,7 @@ fsw_status_t fsw_shandle_read(struct fsw_shandle *shand, fsw_u32 *buffer_size_in
 
             // ask the file system for the proper extent
             shand->extent.log_start = log_bno;
+            vol->stats.get_extent_calls++;
             status = vol->fstype_table->get_extent(vol, dno, &shand->extent);
             if (status) {
                 shand->extent.type = FSW_EXTENT_TYPE_INVALID;
@@ -908,18 +1325,37 @@ fsw_status_t fsw_shandle_read(struct fsw_shandle *shand, fsw_u32 *buffer_size_in
             // convert to physical block number and offset
             phys_bno = shand->extent.phys_start + FSW_U64_DIV(pos_in_extent, vol->phys_blocksize);
             pos_in_physblock = pos_in_extent & (vol->phys_blocksize - 1);
-            copylen = vol->phys_blocksize - pos_in_physblock;
-            if (copylen > buflen)
-                copylen = buflen;
 
-            // get one physical block
-            status = fsw_block_get(vol, phys_bno, cache_level, (void **)&block_buffer);
-            if (status)
-                return status;
+            if (pos_in_physblock == 0 && buflen >= vol->phys_blocksize &&
+                cache_level == 0 && vol->host_table->read_blocks != NULL) {
+                // read whole blocks straight into the caller's buffer, up to the end of the extent
+                phys_count = (fsw_u32)FSW_U64_DIV(buflen, vol->phys_blocksize);
+                extent_left = FSW_U64_DIV((fsw_u64)shand->extent.log_count * vol->log_blocksize - pos_in_extent,
+                                          vol->phys_blocksize);
+                if (phys_count > extent_left)
+                    phys_count = (fsw_u32)extent_left;
+                copylen = (fsw_u64)phys_count * vol->phys_blocksize;
+
+                vol->stats.read_calls++;
+                status = vol->host_table->read_blocks(vol, phys_bno, phys_count, buffer);
+                if (status)
+                    return status;
+                vol->stats.read_bytes += copylen;
+
+            } else {
+                copylen = vol->phys_blocksize - pos_in_physblock;
+                if (copylen > buflen)
+                    copylen = buflen;
 
-            // copy data from it
-            fsw_memcpy(buffer, block_buffer + pos_in_physblock, copylen);
-            fsw_block_release(vol, phys_bno, block_buffer);
+                // get one physical block
+                status = fsw_block_get(vol, phys_bno, cache_level, (void **)&block_buffer);
+                if (status)
+                    return status;
+
+                // copy data from it
+                fsw_memcpy(buffer, block_buffer + pos_in_physblock, copylen);
+                fsw_block_release(vol, phys_bno, block_buffer);
+            }
 
         } else if (shand->extent.type == FSW_EXTENT_TYPE_BUFFER) {
             copylen = shand->extent.log_count * vol->log_blocksize - pos_in_extent;
@@ -56,6 +56,21 @@
 /** Indicates that the block cache entry is empty. */
 #define FSW_INVALID_BNO 0xFFFFFFFFFFFFFFFF
 
+/** Highest cache level accepted by fsw_block_get. */
+#define FSW_MAX_CACHE_LEVEL (5)
+/** Memory budget for the block cache of one volume, in bytes. */
+#define FSW_BCACHE_MAX_BYTES (4 * 1024 * 1024)
+/** Minimum number of entries in the block cache, regardless of block size. */
+#define FSW_BCACHE_MIN_ENTRIES (16)
+/** Initial number of slots in the dnode hash index. */
+#define FSW_DNODE_HASH_MIN_SIZE (64)
+/** Number of buckets in the directory entry cache, a power of 2. */
+#define FSW_DCACHE_HASH_SIZE (256)
+/** Maximum number of entries in the directory entry cache. */
+#define FSW_DCACHE_MAX_ENTRIES (512)
+/** Memory budget for the directory entry cache of one volume, in bytes. */
+#define FSW_DCACHE_MAX_BYTES (32 * 1024)
+
 
 //
 // Byte-swapping macros
@@ -213,6 +228,47 @@ struct fsw_blockcache {
     fsw_u32     cache_level;        //!< Level of importance of this block
     fsw_u64     phys_bno;           //!< Physical block number
     void        *data;              //!< Block data buffer
+
+    struct fsw_blockcache *hash_next;   //!< Next entry in the same hash bucket
+    struct fsw_blockcache *lru_prev;    //!< LRU list of unreferenced entries: less recently used
+    struct fsw_blockcache *lru_next;    //!< LRU list of unreferenced entries: more recently used
+};
+
+/**
+ * Core: A cached result of a directory lookup. A positive entry records the id of the
+ * child dnode that was found, a negative entry records that the name does not exist.
+ * Entries identify dnodes by id and hold no references, so they don't keep dnodes
+ * (and the caches hanging off them) alive.
+ */
+
+struct fsw_dentry {
+    fsw_u64     parent_tree_id;     //!< Tree id of the directory the lookup was done in
+    fsw_u64     parent_id;          //!< Dnode id of the directory the lookup was done in
+    fsw_u64     child_tree_id;      //!< Tree id of the dnode that was found
+    fsw_u64     child_id;           //!< Dnode id of the dnode that was found
+    int         found;              //!< Zero if the name was not found
+    struct fsw_string name;         //!< Name that was looked up, in the host's string type
+    fsw_u32     hash;               //!< Hash of parent and name
+
+    struct fsw_dentry *hash_next;   //!< Next entry in the same hash bucket
+    struct fsw_dentry *lru_prev;    //!< LRU list: less recently used entry
+    struct fsw_dentry *lru_next;    //!< LRU list: more recently used entry
+};
+
+/**
+ * Core: I/O statistics of a volume, maintained by the core.
+ */
+
+struct fsw_volume_stats {
+    fsw_u64     bcache_hits;        //!< fsw_block_get calls served from the block cache
+    fsw_u64     bcache_misses;      //!< fsw_block_get calls that had to read the block
+    fsw_u64     bcache_evictions;   //!< Block cache entries reused for a different block
+    fsw_u64     read_calls;         //!< Calls to the host's read_block and read_blocks functions
+    fsw_u64     read_bytes;         //!< Bytes read through the host's read functions
+    fsw_u64     get_extent_calls;   //!< Calls to the file system driver's get_extent function
+    fsw_u64     dnode_creates;      //!< Dnodes created
+    fsw_u64     dcache_hits;        //!< Directory lookups answered by the lookup cache
+    fsw_u64     dcache_misses;      //!< Directory lookups passed on to the file system driver
 };
 
 /**
@@ -227,9 +283,24 @@ struct fsw_volume {
     struct fsw_string label;        //!< Volume label
 
     struct fsw_dnode *dnode_head;   //!< List of all dnodes allocated for this volume
+    struct fsw_dnode **dnode_hash;  //!< Open-addressed hash index of all dnodes by (tree_id, dnode_id)
+    fsw_u32     dnode_hash_size;    //!< Number of slots in dnode_hash, a power of 2
+    fsw_u32     dnode_count;        //!< Number of dnodes in dnode_hash
+
+    struct fsw_dentry **dcache_hash;    //!< Hash table of cached directory lookups
+    struct fsw_dentry *dcache_lru_head; //!< Least recently used cached lookup
+    struct fsw_dentry *dcache_lru_tail; //!< Most recently used cached lookup
+    fsw_u32     dcache_count;       //!< Number of cached directory lookups
+    fsw_u32     dcache_bytes;       //!< Memory used by the cached directory lookups
+
+    struct fsw_blockcache **bcache_hash;    //!< Hash table of block cache entries, keyed by phys_bno
+    fsw_u32     bcache_hash_bits;   //!< Number of bits in a hash table index
+    fsw_u32     bcache_size;        //!< Number of allocated block cache entries
+    fsw_u32     bcache_max;         //!< Number of entries allowed by the memory budget
+    struct fsw_blockcache *bcache_lru_head[FSW_MAX_CACHE_LEVEL + 1];  //!< Least recently used entry per level
+    struct fsw_blockcache *bcache_lru_tail[FSW_MAX_CACHE_LEVEL + 1];  //!< Most recently used entry per level
 
-    struct fsw_blockcache *bcache;  //!< Array of block cache entries
-    fsw_u32     bcache_size;        //!< Number of entries in the block cache array
+    struct fsw_volume_stats stats;  //!< I/O statistics
 
     void        *host_data;         //!< Hook for a host-specific data structure
     struct fsw_host_table *host_table;      //!< Dispatch table for host-specific functions
@@ -343,6 +414,8 @@ struct fsw_host_table
                                      fsw_u32 old_phys_blocksize, fsw_u32 old_log_blocksize,
                                      fsw_u32 new_phys_blocksize, fsw_u32 new_log_blocksize);
     fsw_status_t EFIAPI (*read_block)(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer);
+    /** Reads count consecutive blocks without caching. Optional, may be NULL. */
+    fsw_status_t EFIAPI (*read_blocks)(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer);
 };
 
 /**
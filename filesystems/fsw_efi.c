@@ -72,6 +72,7 @@ EFI_GUID gMyEfiBlockIoProtocolGuid = REFIND_EFI_BLOCK_IO_PROTOCOL_GUID;
 EFI_GUID gMyEfiFileInfoGuid = EFI_FILE_INFO_ID;
 EFI_GUID gMyEfiFileSystemInfoGuid = EFI_FILE_SYSTEM_INFO_ID;
 EFI_GUID gMyEfiFileSystemVolumeLabelInfoIdGuid = EFI_FILE_SYSTEM_VOLUME_LABEL_INFO_ID;
+EFI_GUID gRefindFswStatsProtocolGuid = REFIND_FSW_STATS_PROTOCOL_GUID;
 
 /** Helper macro for stringification. */
 #define FSW_EFI_STRINGIFY(x) #x
@@ -104,11 +105,15 @@ void EFIAPI fsw_efi_change_blocksize(struct fsw_volume *vol,
                               fsw_u32 old_phys_blocksize, fsw_u32 old_log_blocksize,
                               fsw_u32 new_phys_blocksize, fsw_u32 new_log_blocksize);
 fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer);
+fsw_status_t EFIAPI fsw_efi_read_blocks(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer);
 
 EFI_STATUS fsw_efi_map_status(fsw_status_t fsw_status, FSW_VOLUME_DATA *Volume);
 
 EFI_STATUS EFIAPI fsw_efi_FileSystem_OpenVolume(IN EFI_FILE_IO_INTERFACE *This,
                                                 OUT EFI_FILE_PROTOCOL **Root);
+EFI_STATUS EFIAPI fsw_efi_Stats_GetStats(IN REFIND_FSW_STATS_PROTOCOL *This,
+                                         IN OUT UINTN *StatsSize,
+                                         OUT REFIND_FSW_STATS *Stats);
 EFI_STATUS fsw_efi_dnode_to_FileHandle(IN struct fsw_dnode *dno,
                                        OUT EFI_FILE_PROTOCOL **NewFileHandle);
 
@@ -144,17 +149,23 @@ EFI_STATUS fsw_efi_dnode_fill_FileInfo(IN FSW_VOLUME_DATA *Volume,
  * Structure for holding disk cache data.
  */
 
-#define CACHE_SIZE 131072 /* 128KiB */
+#define CACHE_SIZE 131072 /* 128KiB: read-ahead window for random access */
+#define CACHE_MAX_SIZE 2097152 /* 2MiB: largest window for sequential access */
 struct cache_data {
    fsw_u8            *Cache;
    fsw_u64           CacheStart;
+   UINTN             CacheSize;   // bytes of valid data
+   UINTN             BufferSize;  // bytes allocated for Cache
    BOOLEAN           CacheValid;
+   UINT64            LastUsed;    // value of CacheClock at the last hit, for LRU replacement
    FSW_VOLUME_DATA   *Volume; // NOTE: Do not deallocate; copied here to ID volume
 };
 
-#define NUM_CACHES 2 /* Don't increase without modifying fsw_efi_read_block() */
+#ifndef NUM_CACHES
+#define NUM_CACHES 8
+#endif
 static struct cache_data    Caches[NUM_CACHES];
-static int LastRead = -1;
+static UINT64 CacheClock = 0;
 
 /**
  * Interface structure for the EFI Driver Binding protocol.
@@ -187,26 +198,38 @@ struct fsw_host_table   fsw_efi_host_table = {
     FSW_STRING_TYPE_UTF16,
 
     fsw_efi_change_blocksize,
-    fsw_efi_read_block
+    fsw_efi_read_block,
+    fsw_efi_read_blocks
 };
 
 extern struct fsw_fstype_table   FSW_FSTYPE_TABLE_NAME(FSTYPE);
 
 
-VOID EFIAPI fsw_efi_clear_cache(VOID) {
+/**
+ * Drop the disk caches belonging to a volume, or all disk caches if vol is NULL.
+ * Called by the core whenever its own block cache is dropped, and when a volume
+ * is (re)opened or stopped.
+ */
+
+VOID EFIAPI fsw_efi_clear_cache(struct fsw_volume *vol) {
    int i;
+   FSW_VOLUME_DATA *Volume = (vol != NULL) ? (FSW_VOLUME_DATA *)vol->host_data : NULL;
 
    // clear the cache
    for (i = 0; i < NUM_CACHES; i++) {
+      if (Volume != NULL && Caches[i].Volume != Volume)
+         continue;
       if (Caches[i].Cache != NULL) {
          FreePool(Caches[i].Cache);
          Caches[i].Cache = NULL;
       } // if
-            Caches[i].CacheStart = 0;
-            Caches[i].CacheValid = FALSE;
-            Caches[i].Volume = NULL;
+      Caches[i].CacheStart = 0;
+      Caches[i].CacheSize = 0;
+      Caches[i].BufferSize = 0;
+      Caches[i].CacheValid = FALSE;
+      Caches[i].LastUsed = 0;
+      Caches[i].Volume = NULL;
    }
-   LastRead = -1;
 } // VOID EFIAPI fsw_efi_clear_cache();
 
 /**
@@ -359,6 +382,7 @@ EFI_STATUS EFIAPI fsw_efi_DriverBinding_Start(IN REFIND_EFI_DRIVER_BINDING_PROTO
     Volume->DiskIo          = DiskIo;
     Volume->MediaId         = BlockIo->Media->MediaId;
     Volume->LastIOStatus    = EFI_SUCCESS;
+    Volume->DiskSize        = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
 
     // mount the filesystem
     Status = fsw_efi_map_status(fsw_mount(Volume, &fsw_efi_host_table,
@@ -368,9 +392,13 @@ EFI_STATUS EFIAPI fsw_efi_DriverBinding_Start(IN REFIND_EFI_DRIVER_BINDING_PROTO
         // register the SimpleFileSystem protocol
         Volume->FileSystem.Revision     = EFI_FILE_IO_INTERFACE_REVISION;
         Volume->FileSystem.OpenVolume   = fsw_efi_FileSystem_OpenVolume;
-        Status = refit_call4_wrapper(BS->InstallMultipleProtocolInterfaces, &ControllerHandle,
+        Volume->Stats.Revision          = REFIND_FSW_STATS_PROTOCOL_REVISION;
+        Volume->Stats.GetStats          = fsw_efi_Stats_GetStats;
+        Status = refit_call6_wrapper(BS->InstallMultipleProtocolInterfaces, &ControllerHandle,
                                                        &gMyEfiSimpleFileSystemProtocolGuid,
                                                        &Volume->FileSystem,
+                                                       &gRefindFswStatsProtocolGuid,
+                                                       &Volume->Stats,
                                                        NULL);
         if (EFI_ERROR(Status)) {
 //            Print(L"Fsw ERROR: InstallMultipleProtocolInterfaces returned %x\n", Status);
@@ -428,8 +456,9 @@ EFI_STATUS EFIAPI fsw_efi_DriverBinding_Stop(IN  REFIND_EFI_DRIVER_BINDING_PROTO
     Volume = FSW_VOLUME_FROM_FILE_SYSTEM(FileSystem);
 
     // uninstall Simple File System protocol
-    Status = refit_call4_wrapper(BS->UninstallMultipleProtocolInterfaces, ControllerHandle,
+    Status = refit_call6_wrapper(BS->UninstallMultipleProtocolInterfaces, ControllerHandle,
                                                      &gMyEfiSimpleFileSystemProtocolGuid, &Volume->FileSystem,
+                                                     &gRefindFswStatsProtocolGuid, &Volume->Stats,
                                                      NULL);
     if (EFI_ERROR(Status)) {
  //       Print(L"Fsw ERROR: UninstallMultipleProtocolInterfaces returned %x\n", Status);
@@ -439,7 +468,7 @@ EFI_STATUS EFIAPI fsw_efi_DriverBinding_Stop(IN  REFIND_EFI_DRIVER_BINDING_PROTO
     Print(L"fsw_efi_DriverBinding_Stop: protocol uninstalled successfully\n");
 #endif
 
-    // release private data structure
+    // release private data structure (this also clears the volume's disk cache)
     if (Volume->vol != NULL)
         fsw_unmount(Volume->vol);
     FreePool(Volume);
@@ -450,9 +479,6 @@ EFI_STATUS EFIAPI fsw_efi_DriverBinding_Stop(IN  REFIND_EFI_DRIVER_BINDING_PROTO
                                This->DriverBindingHandle,
                                ControllerHandle);
 
-    // clear the cache
-    fsw_efi_clear_cache();
-
     return Status;
 }
 
@@ -505,12 +531,18 @@ void EFIAPI fsw_efi_change_blocksize(struct fsw_volume *vol,
 /**
  * FSW interface function to read data blocks. This function is called by the FSW core
  * to read a block of data from the device. The buffer is allocated by the core code.
- * Two caches are maintained, so as to improve performance on some systems. (VirtualBox
+ * Several caches are maintained, so as to improve performance on some systems. (VirtualBox
  * is particularly susceptible to performance problems with an uncached driver -- the
  * ext2 driver can take 200 seconds to load a Linux kernel under VirtualBox, whereas
- * the time is more like 3 seconds with a cache!) Two independent caches are maintained
- * because the ext2fs driver tends to alternate between accessing two parts of the
- * disk.
+ * the time is more like 3 seconds with a cache!) Multiple independent caches are
+ * maintained because drivers tend to alternate between accessing several parts of
+ * the disk, and because more than one volume may be in use at a time. Caches are
+ * tagged with their volume and replaced in least-recently-used order.
+ *
+ * A miss that lands just past the previous read-ahead window of the same volume is
+ * taken as sequential access, and doubles the window (up to CACHE_MAX_SIZE), so that
+ * large files are read with a few big disk reads. Any other miss resets the window
+ * to CACHE_SIZE.
  */
 
 fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer) {
@@ -519,35 +551,61 @@ fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno,
    EFI_STATUS       Status = EFI_SUCCESS;
    BOOLEAN          ReadOneBlock = FALSE;
    UINT64           StartRead = (UINT64) phys_bno * (UINT64) vol->phys_blocksize;
+   UINTN            ReadSize;
 
    if (buffer == NULL)
       return (fsw_status_t) EFI_BAD_BUFFER_SIZE;
 
-   // Initialize static data structures, if necessary....
-   if (LastRead < 0) {
-      fsw_efi_clear_cache();
-   } // if
-
    // Look for a cache hit on the current query....
-   i = 0;
-   do {
+   for (i = 0; (i < NUM_CACHES) && (ReadCache < 0); i++) {
       if ((Caches[i].Volume == Volume) &&
           (Caches[i].CacheValid == TRUE) &&
           (StartRead >= Caches[i].CacheStart) &&
-          ((StartRead + vol->phys_blocksize) <= (Caches[i].CacheStart + CACHE_SIZE))) {
+          ((StartRead + vol->phys_blocksize) <= (Caches[i].CacheStart + Caches[i].CacheSize))) {
          ReadCache = i;
       }
-      i++;
-   } while ((i < NUM_CACHES) && (ReadCache < 0));
+   }
+   if (ReadCache >= 0)
+      Volume->DiskCacheHits++;
 
    // No cache hit found; load new cache and pass it on....
    if (ReadCache < 0) {
-      if (LastRead == -1)
-         LastRead = 1;
-      ReadCache = 1 - LastRead; // NOTE: If NUM_CACHES > 2, this must become more complex
+      // Size the read-ahead window....
+      if ((Volume->ReadAheadSize > 0) && (StartRead >= Volume->ReadAheadNext) &&
+          (StartRead < Volume->ReadAheadNext + CACHE_SIZE)) {
+         ReadSize = Volume->ReadAheadSize * 2;
+         if (ReadSize > CACHE_MAX_SIZE)
+            ReadSize = CACHE_MAX_SIZE;
+      } else {
+         ReadSize = CACHE_SIZE;
+      }
+      if ((Volume->DiskSize > 0) && (StartRead + ReadSize > Volume->DiskSize)) {
+         ReadSize = (Volume->DiskSize > StartRead) ? (UINTN) (Volume->DiskSize - StartRead) : 0;
+      }
+      if (ReadSize < vol->phys_blocksize)
+         ReadSize = vol->phys_blocksize;
+
+      // Pick an unused cache, or else the least recently used one....
+      ReadCache = 0;
+      for (i = 0; i < NUM_CACHES; i++) {
+         if (Caches[i].CacheValid == FALSE) {
+            ReadCache = i;
+            break;
+         }
+         if (Caches[i].LastUsed < Caches[ReadCache].LastUsed)
+            ReadCache = i;
+      }
+
       Caches[ReadCache].CacheValid = FALSE;
-      if (Caches[ReadCache].Cache == NULL)
-         Caches[ReadCache].Cache = AllocatePool(CACHE_SIZE);
+      Caches[ReadCache].Volume = NULL;
+      if ((Caches[ReadCache].Cache != NULL) && (Caches[ReadCache].BufferSize < ReadSize)) {
+         FreePool(Caches[ReadCache].Cache);
+         Caches[ReadCache].Cache = NULL;
+      }
+      if (Caches[ReadCache].Cache == NULL) {
+         Caches[ReadCache].Cache = AllocatePool(ReadSize);
+         Caches[ReadCache].BufferSize = (Caches[ReadCache].Cache != NULL) ? ReadSize : 0;
+      }
       if (Caches[ReadCache].Cache != NULL) {
          // TODO: Below call hangs on my 32-bit Mac Mini when compiled with GNU-EFI.
          // The same binary is fine under VirtualBox, and the same call is fine when
@@ -559,14 +617,19 @@ fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno,
          // ReadDisk() call, suggests that when it fails, the program is executing
          // code starting mid-function, so there seems to be something messed up in
          // the way the function is being called. FIGURE THIS OUT!
+         Volume->DiskReads++;
+         Volume->DiskReadBytes += ReadSize;
          Status = refit_call5_wrapper(Volume->DiskIo->ReadDisk, Volume->DiskIo, Volume->MediaId,
-                                      StartRead, (UINTN) CACHE_SIZE, (VOID*) Caches[ReadCache].Cache);
+                                      StartRead, ReadSize, (VOID*) Caches[ReadCache].Cache);
          if (!EFI_ERROR(Status)) {
             Caches[ReadCache].CacheStart = StartRead;
+            Caches[ReadCache].CacheSize = ReadSize;
             Caches[ReadCache].CacheValid = TRUE;
             Caches[ReadCache].Volume = Volume;
-            LastRead = ReadCache;
+            Volume->ReadAheadNext = StartRead + ReadSize;
+            Volume->ReadAheadSize = ReadSize;
          } else {
+            Volume->ReadAheadSize = 0;
             ReadOneBlock = TRUE;
          }
       } else {
@@ -576,11 +639,14 @@ fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno,
 
    if (Caches[ReadCache].Cache != NULL && Caches[ReadCache].CacheValid == TRUE && vol->phys_blocksize > 0) {
       CopyMem(buffer, &Caches[ReadCache].Cache[StartRead - Caches[ReadCache].CacheStart], vol->phys_blocksize);
+      Caches[ReadCache].LastUsed = ++CacheClock;
    } else {
       ReadOneBlock = TRUE;
    }
 
    if (ReadOneBlock) { // Something's failed, so try a simple disk read of one block....
+      Volume->DiskReads++;
+      Volume->DiskReadBytes += vol->phys_blocksize;
       Status = refit_call5_wrapper(Volume->DiskIo->ReadDisk, Volume->DiskIo, Volume->MediaId,
                                    phys_bno * vol->phys_blocksize,
                                    (UINTN) vol->phys_blocksize,
@@ -591,6 +657,31 @@ fsw_status_t EFIAPI fsw_efi_read_block(struct fsw_volume *vol, fsw_u64 phys_bno,
    return Status;
 } // fsw_status_t *fsw_efi_read_block()
 
+/**
+ * FSW interface function to read a run of consecutive data blocks. This function is
+ * called by the FSW core to read file data directly into the caller's buffer. It
+ * bypasses the disk caches, since bulk file data is rarely read twice and would only
+ * push metadata out of them.
+ */
+
+fsw_status_t EFIAPI fsw_efi_read_blocks(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer) {
+   FSW_VOLUME_DATA  *Volume = (FSW_VOLUME_DATA *)vol->host_data;
+   EFI_STATUS       Status;
+
+   if (buffer == NULL)
+      return (fsw_status_t) EFI_BAD_BUFFER_SIZE;
+
+   Volume->DiskReads++;
+   Volume->DiskReadBytes += (UINT64) count * vol->phys_blocksize;
+   Status = refit_call5_wrapper(Volume->DiskIo->ReadDisk, Volume->DiskIo, Volume->MediaId,
+                                phys_bno * vol->phys_blocksize,
+                                (UINTN) count * vol->phys_blocksize,
+                                (VOID*) buffer);
+   Volume->LastIOStatus = Status;
+
+   return Status;
+} // fsw_status_t *fsw_efi_read_blocks()
+
 /**
  * Map FSW status codes to EFI status codes. The FSW_IO_ERROR code is only produced
  * by fsw_efi_read_block, so we map it back to the EFI status code remembered from
@@ -634,12 +725,51 @@ EFI_STATUS EFIAPI fsw_efi_FileSystem_OpenVolume(IN EFI_FILE_IO_INTERFACE *This,
     Print(L"fsw_efi_FileSystem_OpenVolume\n");
 #endif
 
-    fsw_efi_clear_cache();
+    fsw_efi_clear_cache(Volume->vol);
     Status = fsw_efi_dnode_to_FileHandle(Volume->vol->root, Root);
 
     return Status;
 }
 
+/**
+ * rEFInd statistics protocol, GetStats function. Reports the I/O counters kept
+ * by the FSW core and by this host for the volume.
+ */
+
+EFI_STATUS EFIAPI fsw_efi_Stats_GetStats(IN REFIND_FSW_STATS_PROTOCOL *This,
+                                         IN OUT UINTN *StatsSize,
+                                         OUT REFIND_FSW_STATS *Stats)
+{
+    FSW_VOLUME_DATA     *Volume = FSW_VOLUME_FROM_STATS(This);
+    struct fsw_volume   *vol = Volume->vol;
+    REFIND_FSW_STATS    Current;
+    int                 i;
+
+    if (StatsSize == NULL || Stats == NULL)
+        return EFI_INVALID_PARAMETER;
+
+    ZeroMem(&Current, sizeof(Current));
+    for (i = 0; i < vol->fstype_table->name.len && i < 15; i++)
+        Current.FsName[i] = ((fsw_u8 *)vol->fstype_table->name.data)[i];
+    Current.BlockCacheHits      = vol->stats.bcache_hits;
+    Current.BlockCacheMisses    = vol->stats.bcache_misses;
+    Current.BlockCacheEvictions = vol->stats.bcache_evictions;
+    Current.ReadCalls           = vol->stats.read_calls;
+    Current.ReadBytes           = vol->stats.read_bytes;
+    Current.GetExtentCalls      = vol->stats.get_extent_calls;
+    Current.DnodeCreates        = vol->stats.dnode_creates;
+    Current.LookupCacheHits     = vol->stats.dcache_hits;
+    Current.LookupCacheMisses   = vol->stats.dcache_misses;
+    Current.DiskCacheHits       = Volume->DiskCacheHits;
+    Current.DiskReads           = Volume->DiskReads;
+    Current.DiskReadBytes       = Volume->DiskReadBytes;
+
+    if (*StatsSize > sizeof(Current))
+        *StatsSize = sizeof(Current);
+    CopyMem(Stats, &Current, *StatsSize);
+    return EFI_SUCCESS;
+}
+
 /**
  * File Handle EFI protocol, Open function. Dispatches the call
  * based on the kind of file handle.
@@ -39,6 +39,7 @@
 #define _FSW_EFI_H_
 
 #include "fsw_core.h"
+#include "../include/FswStats.h"
 
 #ifdef __MAKEWITH_GNUEFI
 #define CompareGuid(a, b) CompareGuid(a, b)==0
@@ -67,6 +68,14 @@ typedef struct {
     EFI_DISK_IO                 *DiskIo;        //!< The Disk I/O protocol we use for disk access
     UINT32                      MediaId;        //!< The media ID from the Block I/O protocol
     EFI_STATUS                  LastIOStatus;   //!< Last status from Disk I/O
+    UINT64                      DiskSize;       //!< Size of the medium in bytes (0 if unknown)
+    UINT64                      ReadAheadNext;  //!< Disk offset just past the last read-ahead window
+    UINTN                       ReadAheadSize;  //!< Size of the last read-ahead window
+
+    REFIND_FSW_STATS_PROTOCOL   Stats;          //!< Published statistics protocol interface structure
+    UINT64                      DiskCacheHits;  //!< Block reads served from the disk caches
+    UINT64                      DiskReads;      //!< Calls to DiskIo->ReadDisk
+    UINT64                      DiskReadBytes;  //!< Bytes read from the disk
 
     struct fsw_volume           *vol;           //!< FSW volume structure
 
@@ -76,6 +85,8 @@ typedef struct {
 #define FSW_VOLUME_DATA_SIGNATURE  EFI_SIGNATURE_32 ('f', 's', 'w', 'V')
 /** Access macro for the volume structure. */
 #define FSW_VOLUME_FROM_FILE_SYSTEM(a)  CR (a, FSW_VOLUME_DATA, FileSystem, FSW_VOLUME_DATA_SIGNATURE)
+/** Access macro for the volume structure from the statistics protocol. */
+#define FSW_VOLUME_FROM_STATS(a)  CR (a, FSW_VOLUME_DATA, Stats, FSW_VOLUME_DATA_SIGNATURE)
 
 /**
  * EFI Host: Private structure for a EFI_FILE_PROTOCOL interface.
@@ -110,6 +121,6 @@ VOID fsw_efi_decode_time(OUT EFI_TIME *EfiTime, IN UINT32 UnixTime);
 
 UINTN fsw_efi_strsize(struct fsw_string *s);
 VOID fsw_efi_strcpy(CHAR16 *Dest, struct fsw_string *src);
-VOID EFIAPI fsw_efi_clear_cache(VOID);
+VOID EFIAPI fsw_efi_clear_cache(struct fsw_volume *vol);
 
 #endif
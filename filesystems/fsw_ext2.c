@@ -36,6 +36,8 @@ static fsw_status_t fsw_ext2_dnode_stat(struct fsw_ext2_volume *vol, struct fsw_
                                         struct fsw_dnode_stat *sb);
 static fsw_status_t fsw_ext2_get_extent(struct fsw_ext2_volume *vol, struct fsw_ext2_dnode *dno,
                                         struct fsw_extent *extent);
+static fsw_status_t fsw_ext2_get_ind_block(struct fsw_ext2_volume *vol, struct fsw_ext2_dnode *dno,
+                                          int level, fsw_u32 phys_bno, fsw_u32 **ptrs);
 
 static fsw_status_t fsw_ext2_dir_lookup(struct fsw_ext2_volume *vol, struct fsw_ext2_dnode *dno,
                                         struct fsw_string *lookup_name, struct fsw_ext2_dnode **child_dno);
@@ -242,8 +244,14 @@ static fsw_status_t fsw_ext2_dnode_fill(struct fsw_ext2_volume *vol, struct fsw_
 
 static void fsw_ext2_dnode_free(struct fsw_ext2_volume *vol, struct fsw_ext2_dnode *dno)
 {
+    int             i;
+
     if (dno->raw)
         fsw_free(dno->raw);
+    for (i = 0; i < 3; i++) {
+        if (dno->ind_cache[i])
+            fsw_free(dno->ind_cache[i]);
+    }
 }
 
 /**
@@ -282,9 +290,10 @@ static fsw_status_t fsw_ext2_get_extent(struct fsw_ext2_volume *vol, struct fsw_
                                         struct fsw_extent *extent)
 {
     fsw_status_t    status;
-    fsw_u32         bno, release_bno, buf_bcnt, file_bcnt;
+    fsw_u32         bno, buf_bcnt, file_bcnt;
+    fsw_u64         span, offset;
     fsw_u32         *buffer;
-    int             path[5], i;
+    int             path[5], i, j;
 
     // Preconditions: The caller has checked that the requested logical block
     //  is within the file's size. The dnode has complete information, i.e.
@@ -328,33 +337,45 @@ static fsw_status_t fsw_ext2_get_extent(struct fsw_ext2_volume *vol, struct fsw_
         }
     }
 
-    // follow the indirection path
+    // follow the indirection path, using the dnode's copies of the indirect blocks
     buffer = dno->raw->i_block;
     buf_bcnt = EXT2_NDIR_BLOCKS;
-    release_bno = 0;
+    file_bcnt = (fsw_u32)FSW_U64_DIV(dno->g.size + vol->g.log_blocksize - 1, vol->g.log_blocksize);
     for (i = 0; ; i++) {
         bno = buffer[path[i]];
         if (bno == 0) {
             extent->type = FSW_EXTENT_TYPE_SPARSE;
-            if (release_bno)
-                fsw_block_release(vol, release_bno, buffer);
+            if (path[i+1] < 0) {
+                // a run of missing block pointers
+                while (path[i]           + extent->log_count < buf_bcnt &&
+                       extent->log_start + extent->log_count < file_bcnt &&
+                       buffer[path[i] + extent->log_count] == 0)
+                    extent->log_count++;
+            } else {
+                // a missing indirect block, the rest of its subtree is sparse
+                span = 1;
+                offset = 0;
+                for (j = i + 1; path[j] >= 0; j++) {
+                    span *= vol->ind_bcnt;
+                    offset = offset * vol->ind_bcnt + path[j];
+                }
+                if (extent->log_start + (span - offset) > file_bcnt)
+                    span = offset + (file_bcnt > extent->log_start ? file_bcnt - extent->log_start : 1);
+                extent->log_count = (fsw_u32)(span - offset);
+            }
             return FSW_SUCCESS;
         }
         if (path[i+1] < 0)
             break;
 
-        if (release_bno)
-            fsw_block_release(vol, release_bno, buffer);
-        status = fsw_block_get(vol, bno, 1, (void **)&buffer);
+        status = fsw_ext2_get_ind_block(vol, dno, i, bno, &buffer);
         if (status)
             return status;
-        release_bno = bno;
         buf_bcnt = vol->ind_bcnt;
     }
     extent->phys_start = bno;
 
-    // check if the following blocks can be aggregated into one extent
-    file_bcnt = (fsw_u32)((dno->g.size + vol->g.log_blocksize - 1) & (vol->g.log_blocksize - 1));
+    // aggregate the following blocks of this pointer array into one extent
     while (path[i]           + extent->log_count < buf_bcnt &&    // indirect block has more block pointers
            extent->log_start + extent->log_count < file_bcnt) {   // file has more blocks
         if (buffer[path[i] + extent->log_count] == buffer[path[i] + extent->log_count - 1] + 1)
@@ -363,8 +384,40 @@ static fsw_status_t fsw_ext2_get_extent(struct fsw_ext2_volume *vol, struct fsw_
             break;
     }
 
-    if (release_bno)
-        fsw_block_release(vol, release_bno, buffer);
+    return FSW_SUCCESS;
+}
+
+/**
+ * Get the block pointer array of an indirect block. The dnode keeps a copy of the
+ * last block used at each indirection level, so sequential reads decode each
+ * indirect block only once and never hold on to cache blocks between calls.
+ */
+
+static fsw_status_t fsw_ext2_get_ind_block(struct fsw_ext2_volume *vol, struct fsw_ext2_dnode *dno,
+                                          int level, fsw_u32 phys_bno, fsw_u32 **ptrs)
+{
+    fsw_status_t    status;
+    void            *buffer;
+
+    if (dno->ind_cache[level] == NULL) {
+        status = fsw_alloc(vol->ind_bcnt * sizeof(fsw_u32), &dno->ind_cache[level]);
+        if (status)
+            return status;
+        dno->ind_cache_bno[level] = 0;
+    }
+
+    if (dno->ind_cache_bno[level] != phys_bno) {
+        status = fsw_block_get(vol, phys_bno, 1, &buffer);
+        if (status) {
+            dno->ind_cache_bno[level] = 0;
+            return status;
+        }
+        fsw_memcpy(dno->ind_cache[level], buffer, vol->ind_bcnt * sizeof(fsw_u32));
+        fsw_block_release(vol, phys_bno, buffer);
+        dno->ind_cache_bno[level] = phys_bno;
+    }
+
+    *ptrs = dno->ind_cache[level];
     return FSW_SUCCESS;
 }
 
@@ -59,6 +59,9 @@ struct fsw_ext2_dnode {
     struct fsw_dnode g;             //!< Generic dnode structure
     
     struct ext2_inode *raw;         //!< Full raw inode structure
+
+    fsw_u32     *ind_cache[3];      //!< Copies of the last indirect blocks used, per indirection level
+    fsw_u32     ind_cache_bno[3];   //!< Physical block numbers of the cached indirect blocks
 };
 
 
@@ -39,6 +39,8 @@ static fsw_status_t fsw_ext4_get_extent(struct fsw_ext4_volume *vol, struct fsw_
                                         struct fsw_extent *extent);
 static fsw_status_t fsw_ext4_get_by_blkaddr(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
                                         struct fsw_extent *extent);
+static fsw_status_t fsw_ext4_get_ind_block(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                          int level, fsw_u32 phys_bno, fsw_u32 **ptrs);
 static fsw_status_t fsw_ext4_get_by_extent(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
                                         struct fsw_extent *extent);
 
@@ -47,6 +49,8 @@ static fsw_status_t fsw_ext4_dir_lookup(struct fsw_ext4_volume *vol, struct fsw_
 static fsw_status_t fsw_ext4_dir_read(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
                                       struct fsw_shandle *shand, struct fsw_ext4_dnode **child_dno);
 static fsw_status_t fsw_ext4_read_dentry(struct fsw_shandle *shand, struct ext4_dir_entry *entry);
+static fsw_status_t fsw_ext4_dx_lookup(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                       struct fsw_string *lookup_name, struct fsw_ext4_dnode **child_dno);
 
 static fsw_status_t fsw_ext4_readlink(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
                                       struct fsw_string *link);
@@ -334,8 +338,16 @@ static fsw_status_t fsw_ext4_dnode_fill(struct fsw_ext4_volume *vol, struct fsw_
 
 static void fsw_ext4_dnode_free(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno)
 {
+    int             i;
+
     if (dno->raw)
         fsw_free(dno->raw);
+    for (i = 0; i < 3; i++) {
+        if (dno->ind_cache[i])
+            fsw_free(dno->ind_cache[i]);
+    }
+    if (dno->extents)
+        fsw_free(dno->extents);
 }
 
 /**
@@ -393,76 +405,149 @@ static fsw_status_t fsw_ext4_get_extent(struct fsw_ext4_volume *vol, struct fsw_
 }
 
 /**
- * New ext4 extents...
+ * Append one leaf extent to the dnode's extent map, growing the array as needed.
  */
-static fsw_status_t fsw_ext4_get_by_extent(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
-                                        struct fsw_extent *extent)
+
+static fsw_status_t fsw_ext4_extent_map_add(struct fsw_ext4_dnode *dno, struct ext4_extent *ext4_extent)
+{
+    fsw_status_t    status;
+    struct fsw_ext4_extent_run *new_extents, *run;
+    fsw_u32         len = ext4_extent->ee_len;
+
+    if (dno->extent_count >= dno->extent_alloc) {
+        status = fsw_alloc(dno->extent_alloc * 2 * sizeof(struct fsw_ext4_extent_run), &new_extents);
+        if (status)
+            return status;
+        fsw_memcpy(new_extents, dno->extents, dno->extent_count * sizeof(struct fsw_ext4_extent_run));
+        fsw_free(dno->extents);
+        dno->extents = new_extents;
+        dno->extent_alloc *= 2;
+    }
+
+    run = &dno->extents[dno->extent_count++];
+    run->log_start = ext4_extent->ee_block;
+    if (len > EXT4_INIT_MAX_LEN) {
+        // unwritten extent, reads as zeros
+        run->log_count = len - EXT4_INIT_MAX_LEN;
+        run->phys_start = 0;
+    } else {
+        run->log_count = len;
+        run->phys_start = ((fsw_u64)ext4_extent->ee_start_hi << 32) | ext4_extent->ee_start_lo;
+    }
+    return FSW_SUCCESS;
+}
+
+/**
+ * Walk one node of the extent tree and everything below it, adding all leaf extents
+ * to the dnode's extent map in order. Index blocks are released as soon as they
+ * have been walked.
+ */
+
+static fsw_status_t fsw_ext4_extent_map_walk(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                             struct ext4_extent_header *ext4_extent_header, fsw_u32 size,
+                                             int max_depth)
 {
     fsw_status_t  status;
-    fsw_u32       bno, buf_offset;
     int           ext_cnt;
+    fsw_u64       phys_bno;
     void          *buffer;
+    struct ext4_extent_idx *ext4_extent_idx;
 
-    struct ext4_extent_header  *ext4_extent_header;
-    struct ext4_extent_idx     *ext4_extent_idx;
-    struct ext4_extent         *ext4_extent;
+    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ext4_extent_map_walk: extent header with %d entries\n"),
+                  ext4_extent_header->eh_entries));
+    if (ext4_extent_header->eh_magic != EXT4_EXT_MAGIC ||
+        ext4_extent_header->eh_depth > max_depth ||
+        sizeof(struct ext4_extent_header) + ext4_extent_header->eh_entries * sizeof(struct ext4_extent) > size)
+        return FSW_VOLUME_CORRUPTED;
 
-    // Logical block requested by core...
-    bno = extent->log_start;
+    for (ext_cnt = 0; ext_cnt < ext4_extent_header->eh_entries; ext_cnt++) {
+        if (ext4_extent_header->eh_depth == 0) {
+            // leaf node, the header is followed by actual extents
+            status = fsw_ext4_extent_map_add(dno, (struct ext4_extent *)(ext4_extent_header + 1) + ext_cnt);
+            if (status)
+                return status;
+        } else {
+            // index node, follow each child in turn
+            ext4_extent_idx = (struct ext4_extent_idx *)(ext4_extent_header + 1) + ext_cnt;
+            phys_bno = ((fsw_u64)ext4_extent_idx->ei_leaf_hi << 32) | ext4_extent_idx->ei_leaf_lo;
+            status = fsw_block_get(vol, phys_bno, 1, &buffer);
+            if (status)
+                return status;
+            status = fsw_ext4_extent_map_walk(vol, dno, (struct ext4_extent_header *)buffer, vol->g.phys_blocksize,
+                                              ext4_extent_header->eh_depth - 1);
+            fsw_block_release(vol, phys_bno, buffer);
+            if (status)
+                return status;
+        }
+    }
+    return FSW_SUCCESS;
+}
 
-    // First buffer is the i_block field from inode...
-    buffer = (void *)dno->raw->i_block;
-    buf_offset = 0;
-    while(1) {
-        ext4_extent_header = (struct ext4_extent_header *)((char *)buffer + buf_offset);
-        buf_offset += sizeof(struct ext4_extent_header);
-        FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ext4_get_by_extent: extent header with %d entries\n"),
-                      ext4_extent_header->eh_entries));
-        if(ext4_extent_header->eh_magic != EXT4_EXT_MAGIC)
-            return FSW_VOLUME_CORRUPTED;
+/**
+ * New ext4 extents... The whole extent tree is read into a sorted array of runs on
+ * first access, which is then binary-searched for each request. Holes between
+ * extents and unwritten extents are returned as sparse extents.
+ */
+static fsw_status_t fsw_ext4_get_by_extent(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                        struct fsw_extent *extent)
+{
+    fsw_status_t  status;
+    fsw_u32       bno, file_bcnt, lo, hi, mid;
+    struct fsw_ext4_extent_run *run;
 
-        for(ext_cnt = 0;ext_cnt < ext4_extent_header->eh_entries;ext_cnt++)
-        {
-            if(ext4_extent_header->eh_depth == 0)
-            {
-                // Leaf node, the header follows actual extents
-                ext4_extent = (struct ext4_extent *)((char *)buffer + buf_offset);
-                buf_offset += sizeof(struct ext4_extent);
-                FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ext4_get_by_extent: extent node cover %d...\n"), ext4_extent->ee_block));
-
-                // Is the requested block in this extent?
-                if(bno >= ext4_extent->ee_block && bno < ext4_extent->ee_block + ext4_extent->ee_len)
-                {
-                    extent->phys_start = ((fsw_u64)ext4_extent->ee_start_hi << 32) | ext4_extent->ee_start_lo;
-                    extent->phys_start += (bno - ext4_extent->ee_block);
-                    extent->log_count = ext4_extent->ee_len - (bno - ext4_extent->ee_block);
-                    return FSW_SUCCESS;
-                }
-            }
-            else
-            {
-                FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ext4_get_by_extent: index extents, depth %d\n"),
-                          ext4_extent_header->eh_depth));
-                ext4_extent_idx = (struct ext4_extent_idx *)((char *)buffer + buf_offset);
-                buf_offset += sizeof(struct ext4_extent_idx);
-
-                FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ext4_get_by_extent: index node covers block %d...\n"),
-                          ext4_extent_idx->ei_block));
-                if(bno >= ext4_extent_idx->ei_block)
-                {
-                    // Follow extent tree...
-                    fsw_u64 phys_bno = ((fsw_u64)ext4_extent_idx->ei_leaf_hi << 32) | ext4_extent_idx->ei_leaf_lo;
-                    status = fsw_block_get(vol, phys_bno, 1, (void **)&buffer);
-                    if (status)
-                        return status;
-                    buf_offset = 0;
-                    break;
-                }
+    // read the extent tree on first use; the root lives in the inode's i_block field
+    if (dno->extents == NULL) {
+        status = fsw_alloc(16 * sizeof(struct fsw_ext4_extent_run), &dno->extents);
+        if (status)
+            return status;
+        dno->extent_alloc = 16;
+        dno->extent_count = 0;
+        status = fsw_ext4_extent_map_walk(vol, dno, (struct ext4_extent_header *)dno->raw->i_block,
+                                          sizeof(dno->raw->i_block), EXT4_MAX_EXTENT_DEPTH);
+        if (status) {
+            fsw_free(dno->extents);
+            dno->extents = NULL;
+            return status;
+        }
+    }
+
+    // Logical block requested by core...
+    bno = (fsw_u32)extent->log_start;
+
+    // find the last run starting at or before bno
+    lo = 0;
+    hi = dno->extent_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (dno->extents[mid].log_start <= bno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0) {
+        run = &dno->extents[lo - 1];
+        if (bno < run->log_start + run->log_count) {
+            extent->log_count = run->log_count - (bno - run->log_start);
+            if (run->phys_start == 0) {
+                extent->type = FSW_EXTENT_TYPE_SPARSE;
+            } else {
+                extent->phys_start = run->phys_start + (bno - run->log_start);
             }
+            return FSW_SUCCESS;
         }
     }
 
-    return FSW_NOT_FOUND;
+    // in a hole: sparse up to the next run or the end of the file
+    file_bcnt = (fsw_u32)FSW_U64_DIV(dno->g.size + vol->g.log_blocksize - 1, vol->g.log_blocksize);
+    extent->type = FSW_EXTENT_TYPE_SPARSE;
+    if (lo < dno->extent_count)
+        extent->log_count = dno->extents[lo].log_start - bno;
+    else if (file_bcnt > bno)
+        extent->log_count = file_bcnt - bno;
+    else
+        extent->log_count = 1;
+    return FSW_SUCCESS;
 }
 
 /**
@@ -475,8 +560,9 @@ static fsw_status_t fsw_ext4_get_by_blkaddr(struct fsw_ext4_volume *vol, struct
                                         struct fsw_extent *extent)
 {
     fsw_status_t    status;
-    fsw_u32         bno, release_bno, buf_bcnt, file_bcnt;
-    int             path[5], i;
+    fsw_u32         bno, buf_bcnt, file_bcnt;
+    fsw_u64         span, offset;
+    int             path[5], i, j;
     fsw_u32         *buffer;
     bno = extent->log_start;
 
@@ -514,33 +600,45 @@ static fsw_status_t fsw_ext4_get_by_blkaddr(struct fsw_ext4_volume *vol, struct
         }
     }
     
-    // follow the indirection path
+    // follow the indirection path, using the dnode's copies of the indirect blocks
     buffer = dno->raw->i_block;
     buf_bcnt = EXT4_NDIR_BLOCKS;
-    release_bno = 0;
+    file_bcnt = (fsw_u32)FSW_U64_DIV(dno->g.size + vol->g.log_blocksize - 1, vol->g.log_blocksize);
     for (i = 0; ; i++) {
         bno = buffer[path[i]];
         if (bno == 0) {
             extent->type = FSW_EXTENT_TYPE_SPARSE;
-            if (release_bno)
-                fsw_block_release(vol, release_bno, buffer);
+            if (path[i+1] < 0) {
+                // a run of missing block pointers
+                while (path[i]           + extent->log_count < buf_bcnt &&
+                       extent->log_start + extent->log_count < file_bcnt &&
+                       buffer[path[i] + extent->log_count] == 0)
+                    extent->log_count++;
+            } else {
+                // a missing indirect block, the rest of its subtree is sparse
+                span = 1;
+                offset = 0;
+                for (j = i + 1; path[j] >= 0; j++) {
+                    span *= vol->ind_bcnt;
+                    offset = offset * vol->ind_bcnt + path[j];
+                }
+                if (extent->log_start + (span - offset) > file_bcnt)
+                    span = offset + (file_bcnt > extent->log_start ? file_bcnt - extent->log_start : 1);
+                extent->log_count = (fsw_u32)(span - offset);
+            }
             return FSW_SUCCESS;
         }
         if (path[i+1] < 0)
             break;
 
-        if (release_bno)
-            fsw_block_release(vol, release_bno, buffer);
-        status = fsw_block_get(vol, bno, 1, (void **)&buffer);
+        status = fsw_ext4_get_ind_block(vol, dno, i, bno, &buffer);
         if (status)
             return status;
-        release_bno = bno;
         buf_bcnt = vol->ind_bcnt;
     }
     extent->phys_start = bno;
 
-    // check if the following blocks can be aggregated into one extent
-    file_bcnt = (fsw_u32)((dno->g.size + vol->g.log_blocksize - 1) & (vol->g.log_blocksize - 1));
+    // aggregate the following blocks of this pointer array into one extent
     while (path[i]           + extent->log_count < buf_bcnt &&    // indirect block has more block pointers
            extent->log_start + extent->log_count < file_bcnt) {   // file has more blocks
         if (buffer[path[i] + extent->log_count] == buffer[path[i] + extent->log_count - 1] + 1)
@@ -549,8 +647,40 @@ static fsw_status_t fsw_ext4_get_by_blkaddr(struct fsw_ext4_volume *vol, struct
             break;
     }
 
-    if (release_bno)
-        fsw_block_release(vol, release_bno, buffer);
+    return FSW_SUCCESS;
+}
+
+/**
+ * Get the block pointer array of an indirect block. The dnode keeps a copy of the
+ * last block used at each indirection level, so sequential reads decode each
+ * indirect block only once and never hold on to cache blocks between calls.
+ */
+
+static fsw_status_t fsw_ext4_get_ind_block(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                          int level, fsw_u32 phys_bno, fsw_u32 **ptrs)
+{
+    fsw_status_t    status;
+    void            *buffer;
+
+    if (dno->ind_cache[level] == NULL) {
+        status = fsw_alloc(vol->ind_bcnt * sizeof(fsw_u32), &dno->ind_cache[level]);
+        if (status)
+            return status;
+        dno->ind_cache_bno[level] = 0;
+    }
+
+    if (dno->ind_cache_bno[level] != phys_bno) {
+        status = fsw_block_get(vol, phys_bno, 1, &buffer);
+        if (status) {
+            dno->ind_cache_bno[level] = 0;
+            return status;
+        }
+        fsw_memcpy(dno->ind_cache[level], buffer, vol->ind_bcnt * sizeof(fsw_u32));
+        fsw_block_release(vol, phys_bno, buffer);
+        dno->ind_cache_bno[level] = phys_bno;
+    }
+
+    *ptrs = dno->ind_cache[level];
     return FSW_SUCCESS;
 }
 
@@ -572,6 +702,16 @@ static fsw_status_t fsw_ext4_dir_lookup(struct fsw_ext4_volume *vol, struct fsw_
 
     // Preconditions: The caller has checked that dno is a directory node.
 
+    // use the hash tree if the directory has one
+    if ((dno->raw->i_flags & EXT4_INDEX_FL) &&
+        !(dno->raw->i_flags & (EXT4_ENCRYPT_FL | EXT4_CASEFOLD_FL)) &&
+        (vol->sb->s_feature_compat & EXT4_FEATURE_COMPAT_DIR_INDEX)) {
+        status = fsw_ext4_dx_lookup(vol, dno, lookup_name, child_dno_out);
+        if (status != FSW_UNSUPPORTED)
+            return status;
+        // unknown hash or an index we can't follow, fall back to a linear scan
+    }
+
     entry_name.type = FSW_STRING_TYPE_ISO88591;
 
     // setup handle to read the directory
@@ -609,6 +749,351 @@ errorexit:
     return status;
 }
 
+//
+// Directory hash functions, from the Linux kernel (fs/ext4/hash.c)
+//
+
+#define DX_ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = DX_ROL32(a, s))
+#define DX_K1 0
+#define DX_K2 013240474631UL
+#define DX_K3 015666365641UL
+
+static void fsw_ext4_half_md4_transform(fsw_u32 buf[4], const fsw_u32 in[8])
+{
+    fsw_u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    // Round 1
+    DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+    DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+    DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+    DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+    DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+    // Round 2
+    DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+    // Round 3
+    DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void fsw_ext4_tea_transform(fsw_u32 buf[4], const fsw_u32 in[4])
+{
+    fsw_u32 sum = 0;
+    fsw_u32 b0 = buf[0], b1 = buf[1];
+    fsw_u32 a = in[0], b = in[1], c = in[2], d = in[3];
+    int     n = 16;
+
+    do {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+static fsw_u32 fsw_ext4_dx_hack_hash(const fsw_u8 *name, int len, int is_unsigned)
+{
+    fsw_u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int     c;
+
+    while (len--) {
+        c = is_unsigned ? (int)*name : (int)(fsw_s8)*name;
+        name++;
+        hash = hash1 + (hash0 ^ (fsw_u32)(c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void fsw_ext4_str2hashbuf(const fsw_u8 *msg, int len, fsw_u32 *buf, int num, int is_unsigned)
+{
+    fsw_u32 pad, val;
+    int     i, c;
+
+    pad = (fsw_u32)len | ((fsw_u32)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (i = 0; i < len; i++) {
+        c = is_unsigned ? (int)msg[i] : (int)(fsw_s8)msg[i];
+        val = (fsw_u32)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/**
+ * Compute the major hash of a file name the way the kernel does for hash-indexed
+ * directories, using the hash seed from the superblock.
+ */
+
+static fsw_u32 fsw_ext4_dirhash(struct fsw_ext4_volume *vol, fsw_u32 hash_version, const fsw_u8 *name, int len)
+{
+    fsw_u32 hash, buf[4], in[8];
+    int     i, is_unsigned;
+
+    // default seed, unless the superblock has one
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+    for (i = 0; i < 4; i++) {
+        if (vol->sb->s_hash_seed[i] != 0) {
+            fsw_memcpy(buf, vol->sb->s_hash_seed, sizeof(buf));
+            break;
+        }
+    }
+
+    is_unsigned = (hash_version >= DX_HASH_LEGACY_UNSIGNED);
+    switch (hash_version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = fsw_ext4_dx_hack_hash(name, len, is_unsigned);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for (; len > 0; len -= 32, name += 32) {
+                fsw_ext4_str2hashbuf(name, len, in, 8, is_unsigned);
+                fsw_ext4_half_md4_transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        default:    // DX_HASH_TEA, DX_HASH_TEA_UNSIGNED
+            for (; len > 0; len -= 16, name += 16) {
+                fsw_ext4_str2hashbuf(name, len, in, 4, is_unsigned);
+                fsw_ext4_tea_transform(buf, in);
+            }
+            hash = buf[0];
+            break;
+    }
+
+    hash &= ~1;
+    if (hash == (EXT4_HTREE_EOF_32BIT << 1))
+        hash = (EXT4_HTREE_EOF_32BIT - 1) << 1;
+    return hash;
+}
+
+/**
+ * Read one logical block of a directory into a buffer of the volume's block size.
+ */
+
+static fsw_status_t fsw_ext4_read_dir_block(struct fsw_shandle *shand, fsw_u32 lblk, fsw_u8 *buffer)
+{
+    fsw_status_t    status;
+    fsw_u32         blocksize = shand->dnode->vol->g.log_blocksize;
+    fsw_u32         buffer_size;
+
+    shand->pos = (fsw_u64)lblk * blocksize;
+    buffer_size = blocksize;
+    status = fsw_shandle_read(shand, &buffer_size, buffer);
+    if (status)
+        return status;
+    if (buffer_size != blocksize)
+        return FSW_VOLUME_CORRUPTED;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Check the count and limit of an index node's entry array and return the count,
+ * or 0 if the node is corrupt.
+ */
+
+static fsw_u32 fsw_ext4_dx_count(struct dx_entry *entries, fsw_u8 *nodebuf, fsw_u32 blocksize)
+{
+    struct dx_countlimit *countlimit = (struct dx_countlimit *)entries;
+
+    if (countlimit->count == 0 || countlimit->count > countlimit->limit ||
+        (fsw_u8 *)(entries + countlimit->limit) > nodebuf + blocksize)
+        return 0;
+    return countlimit->count;
+}
+
+/**
+ * Lookup a directory entry through the directory's hash tree (dir_index). The hash
+ * of the name selects one path from the dx_root block through the dx_node blocks
+ * (binary search at each level) to the leaf block that holds the name. If hash
+ * collisions spill over into the next leaf blocks, those are searched as well,
+ * moving on through the parent index nodes when a run crosses into the next index
+ * node, like ext4_htree_next_block does.
+ *
+ * Returns FSW_UNSUPPORTED if the index uses an unknown format, in which case the
+ * caller should scan the directory linearly.
+ */
+
+static fsw_status_t fsw_ext4_dx_lookup(struct fsw_ext4_volume *vol, struct fsw_ext4_dnode *dno,
+                                       struct fsw_string *lookup_name, struct fsw_ext4_dnode **child_dno_out)
+{
+    fsw_status_t    status;
+    struct fsw_shandle shand;
+    struct fsw_string name, entry_name;
+    fsw_u8          *nodebuf = NULL, *leafbuf = NULL;
+    struct dx_root_info *info;
+    struct dx_entry *entries[EXT4_HTREE_LEVEL], *at[EXT4_HTREE_LEVEL], *p, *q, *m;
+    fsw_u32         count[EXT4_HTREE_LEVEL];
+    struct ext4_dir_entry *entry;
+    fsw_u32         blocksize = vol->g.log_blocksize;
+    fsw_u32         hash_version, levels, level, hash, off;
+
+    status = fsw_strdup_coerce(&name, FSW_STRING_TYPE_ISO88591, lookup_name);
+    if (status)
+        return status;
+    // one buffer per index level
+    status = fsw_alloc(EXT4_HTREE_LEVEL * blocksize, &nodebuf);
+    if (status)
+        goto freename;
+    status = fsw_alloc(blocksize, &leafbuf);
+    if (status)
+        goto freebufs;
+    status = fsw_shandle_open(dno, &shand);
+    if (status)
+        goto freebufs;
+
+    // read and check the dx_root block
+    status = fsw_ext4_read_dir_block(&shand, 0, nodebuf);
+    if (status)
+        goto errorexit;
+    info = (struct dx_root_info *)(nodebuf + 24);   // after the "." and ".." entries
+    status = FSW_UNSUPPORTED;
+    if (info->reserved_zero != 0 || info->info_length < 8 || info->indirect_levels >= EXT4_HTREE_LEVEL)
+        goto errorexit;
+    hash_version = info->hash_version;
+    if (hash_version > DX_HASH_TEA)
+        goto errorexit;
+    if (vol->sb->s_flags & EXT4_FLAGS_UNSIGNED_HASH)
+        hash_version += DX_HASH_LEGACY_UNSIGNED;
+    hash = fsw_ext4_dirhash(vol, hash_version, (fsw_u8 *)name.data, name.len);
+    levels = info->indirect_levels;
+    entries[0] = (struct dx_entry *)((fsw_u8 *)info + info->info_length);
+
+    // walk down the index
+    for (level = 0; ; level++) {
+        count[level] = fsw_ext4_dx_count(entries[level], nodebuf + level * blocksize, blocksize);
+        if (count[level] == 0)
+            goto errorexit;
+
+        // find the last entry whose hash is not above ours; entry 0 covers everything below entry 1
+        p = entries[level] + 1;
+        q = entries[level] + count[level] - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (m->hash > hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+        at[level] = p - 1;
+        if (level == levels)
+            break;
+
+        status = fsw_ext4_read_dir_block(&shand, at[level]->block & 0x0fffffff, nodebuf + (level + 1) * blocksize);
+        if (status)
+            goto errorexit;
+        status = FSW_UNSUPPORTED;
+        entries[level + 1] = (struct dx_entry *)(nodebuf + (level + 1) * blocksize + 8);   // after the fake empty directory entry
+    }
+
+    // search the leaf block, and any following ones that continue a hash collision
+    entry_name.type = FSW_STRING_TYPE_ISO88591;
+    while (1) {
+        status = fsw_ext4_read_dir_block(&shand, at[levels]->block & 0x0fffffff, leafbuf);
+        if (status)
+            goto errorexit;
+
+        for (off = 0; off + 8 <= blocksize; off += entry->rec_len) {
+            entry = (struct ext4_dir_entry *)(leafbuf + off);
+            if (entry->rec_len < 8 || off + entry->rec_len > blocksize ||
+                (entry->inode != 0 && 8 + entry->name_len > entry->rec_len)) {
+                status = FSW_VOLUME_CORRUPTED;
+                goto errorexit;
+            }
+            if (entry->inode == 0)
+                continue;
+
+            entry_name.len = entry_name.size = entry->name_len;
+            entry_name.data = entry->name;
+            if (fsw_streq(lookup_name, &entry_name)) {
+                status = fsw_dnode_create(dno, entry->inode, FSW_DNODE_TYPE_UNKNOWN, &entry_name, child_dno_out);
+                goto errorexit;
+            }
+        }
+
+        // move to the next index entry, going up as far as needed
+        status = FSW_NOT_FOUND;
+        for (level = levels; ++at[level] >= entries[level] + count[level]; level--) {
+            if (level == 0)
+                goto errorexit;     // end of the whole index
+        }
+        // the run of collisions continues only if the next leaf starts with our hash
+        if ((at[level]->hash & ~1) != hash)
+            goto errorexit;
+
+        // and down again to the leftmost leaf below that entry
+        for (; level < levels; level++) {
+            status = fsw_ext4_read_dir_block(&shand, at[level]->block & 0x0fffffff, nodebuf + (level + 1) * blocksize);
+            if (status)
+                goto errorexit;
+            entries[level + 1] = (struct dx_entry *)(nodebuf + (level + 1) * blocksize + 8);
+            count[level + 1] = fsw_ext4_dx_count(entries[level + 1], nodebuf + (level + 1) * blocksize, blocksize);
+            if (count[level + 1] == 0) {
+                status = FSW_VOLUME_CORRUPTED;
+                goto errorexit;
+            }
+            at[level + 1] = entries[level + 1];
+        }
+    }
+
+errorexit:
+    fsw_shandle_close(&shand);
+freebufs:
+    if (leafbuf != NULL)
+        fsw_free(leafbuf);
+    if (nodebuf != NULL)
+        fsw_free(nodebuf);
+freename:
+    fsw_strfree(&name);
+    return status;
+}
+
 /**
  * Get the next directory entry when reading a directory. This function is called during
  * directory iteration to retrieve the next directory entry. A dnode is constructed for
@@ -52,6 +52,16 @@ struct fsw_ext4_volume {
     fsw_u32     inode_size;         //!< Size of inode structure in bytes
 };
 
+/**
+ * ext4: One run of the extent map of a dnode.
+ */
+
+struct fsw_ext4_extent_run {
+    fsw_u32     log_start;          //!< First logical block covered
+    fsw_u32     log_count;          //!< Number of blocks covered
+    fsw_u64     phys_start;         //!< First physical block, 0 for an unwritten (preallocated) extent
+};
+
 /**
  * ext2: Dnode structure with ext2-specific data.
  */
@@ -60,6 +70,13 @@ struct fsw_ext4_dnode {
     struct fsw_dnode g;             //!< Generic dnode structure
     
     struct ext4_inode *raw;         //!< Full raw inode structure
+
+    fsw_u32     *ind_cache[3];      //!< Copies of the last indirect blocks used, per indirection level
+    fsw_u32     ind_cache_bno[3];   //!< Physical block numbers of the cached indirect blocks
+
+    struct fsw_ext4_extent_run *extents;    //!< Sorted extent map, NULL until first needed
+    fsw_u32     extent_count;       //!< Number of runs in the extent map
+    fsw_u32     extent_alloc;       //!< Number of runs allocated for the extent map
 };
 
 
@@ -153,6 +153,8 @@ struct ext4_group_desc
 #define EXT4_EXTENTS_FL                 0x00080000 /* Inode uses extents */
 #define EXT4_EA_INODE_FL                0x00200000 /* Inode used for large EA */
 #define EXT4_EOFBLOCKS_FL               0x00400000 /* Blocks allocated beyond EOF */
+#define EXT4_ENCRYPT_FL                 0x00000800 /* encrypted inode (reuses ECOMPR) */
+#define EXT4_CASEFOLD_FL                0x40000000 /* Casefolded directory */
 #define EXT4_RESERVED_FL                0x80000000 /* reserved for ext4 lib */
 
 #define EXT4_FL_USER_VISIBLE		0x004BDFFF /* User visible flags */
@@ -384,6 +386,14 @@ struct ext4_super_block {
 /*
  * Feature set definitions (only the once we need for read support)
  */
+#define EXT4_FEATURE_COMPAT_DIR_INDEX           0x0020
+
+/*
+ * Misc. superblock flags (s_flags)
+ */
+#define EXT4_FLAGS_SIGNED_HASH          0x0001  /* Signed dirhash in use */
+#define EXT4_FLAGS_UNSIGNED_HASH        0x0002  /* Unsigned dirhash in use */
+
 #define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER     0x0001
 
 #define EXT4_FEATURE_INCOMPAT_COMPRESSION	0x0001
@@ -441,6 +451,41 @@ enum {
     EXT4_FT_MAX
 };
 
+/*
+ * Hashed directory (htree) structures. Block 0 of an indexed directory holds
+ * the "." and ".." entries followed by dx_root_info and an array of dx_entry.
+ * Interior nodes hold a fake empty directory entry followed by the dx_entry
+ * array. In both cases, the first dx_entry's hash field is replaced by a
+ * dx_countlimit structure.
+ */
+struct dx_root_info {
+    __le32  reserved_zero;
+    __u8    hash_version;
+    __u8    info_length;            /* 8 */
+    __u8    indirect_levels;
+    __u8    unused_flags;
+};
+
+struct dx_entry {
+    __le32  hash;
+    __le32  block;
+};
+
+struct dx_countlimit {
+    __le16  limit;
+    __le16  count;
+};
+
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
+#define EXT4_HTREE_LEVEL            3       /* maximum depth with the largedir feature */
+#define EXT4_HTREE_EOF_32BIT        0x7fffffffU
+
 /*
  * ext4_inode has i_block array (60 bytes total).
  * The first 12 bytes store ext4_extent_header;
@@ -497,5 +542,8 @@ struct ext4_extent_header {
 
 #define EXT4_EXT_MAGIC		(0xf30a)
 
+#define EXT4_INIT_MAX_LEN	(1UL << 15)	/* longer ee_len marks an unwritten extent */
+#define EXT4_MAX_EXTENT_DEPTH	5
+
 
 #endif
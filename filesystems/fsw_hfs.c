@@ -24,6 +24,8 @@
  */
 
 #include "fsw_hfs.h"
+#include "fsw_zlib.h"
+#include "lzvn.c"
 
 #ifdef HOST_POSIX
 #define DPRINT(x) printf(x)
@@ -60,6 +62,9 @@ static fsw_status_t fsw_hfs_dnode_stat(struct fsw_hfs_volume *vol, struct fsw_hf
                                            struct fsw_dnode_stat *sb);
 static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno,
                                            struct fsw_extent *extent);
+static fsw_status_t fsw_hfs_map_fork(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno,
+                                     fsw_u8 fork_type, struct fsw_extent *extent);
+static fsw_status_t fsw_hfs_decmpfs_open(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno);
 
 static fsw_status_t fsw_hfs_dir_lookup(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno,
                                            struct fsw_string *lookup_name, struct fsw_hfs_dnode **child_dno);
@@ -124,6 +129,7 @@ static fsw_u16 fsw_to_lower(fsw_u16 ch)
 
 static fsw_s32
 fsw_hfs_read_block (struct fsw_hfs_dnode    * dno,
+                    fsw_u8                    fork_type,
                     fsw_u32                   log_bno,
                     fsw_u32                   off,
                     fsw_s32                   len,
@@ -135,7 +141,7 @@ fsw_hfs_read_block (struct fsw_hfs_dnode    * dno,
     fsw_u8*                 buffer;
 
     extent.log_start = log_bno;
-    status = fsw_hfs_get_extent(dno->g.vol, dno, &extent);
+    status = fsw_hfs_map_fork(dno->g.vol, dno, fork_type, &extent);
     if (status)
         return status;
 
@@ -153,9 +159,10 @@ fsw_hfs_read_block (struct fsw_hfs_dnode    * dno,
 
 }
 
-/* Read data from HFS file. */
+/* Read data from one fork of an HFS file. */
 static fsw_s32
 fsw_hfs_read_file (struct fsw_hfs_dnode    * dno,
+                   fsw_u8                    fork_type,
                    fsw_u64                   pos,
                    fsw_s32                   len,
                    fsw_u8                  * buf)
@@ -176,9 +183,9 @@ fsw_hfs_read_file (struct fsw_hfs_dnode    * dno,
         log_bno = (fsw_u32)RShiftU64(pos, block_size_bits);
 
         if (   next_len >= 0
-            && (fsw_u32)next_len >  block_size)
-            next_len = block_size;
-        status = fsw_hfs_read_block(dno, log_bno, off, next_len, buf);
+            && (fsw_u32)next_len >  block_size - off)
+            next_len = block_size - off;
+        status = fsw_hfs_read_block(dno, fork_type, log_bno, off, next_len, buf);
         if (status)
             return -1;
         buf  += next_len;
@@ -359,7 +366,7 @@ static fsw_status_t fsw_hfs_volume_mount(struct fsw_hfs_volume *vol)
          * Read catalog file, we know that first record is in the first node, right after
          * the node descriptor.
          */
-        r = fsw_hfs_read_file(vol->catalog_tree.file,
+        r = fsw_hfs_read_file(vol->catalog_tree.file, HFS_DATA_FORK,
                               sizeof (BTNodeDescriptor),
                               sizeof (BTHeaderRec), (fsw_u8 *) &tree_header);
         if (r <= 0)
@@ -378,7 +385,7 @@ static fsw_status_t fsw_hfs_volume_mount(struct fsw_hfs_volume *vol)
         firstLeafNum = be32_to_cpu(tree_header.firstLeafNode);
         catfOffset = firstLeafNum * vol->catalog_tree.node_size;
 
-        r = fsw_hfs_read_file(vol->catalog_tree.file, catfOffset, sizeof (cbuff), cbuff);
+        r = fsw_hfs_read_file(vol->catalog_tree.file, HFS_DATA_FORK, catfOffset, sizeof (cbuff), cbuff);
 
         if (r == sizeof (cbuff))
         {
@@ -402,7 +409,7 @@ static fsw_status_t fsw_hfs_volume_mount(struct fsw_hfs_volume *vol)
         } // if
 
         /* Read extents overflow file */
-        r = fsw_hfs_read_file(vol->extents_tree.file,
+        r = fsw_hfs_read_file(vol->extents_tree.file, HFS_DATA_FORK,
                               sizeof (BTNodeDescriptor),
                               sizeof (BTHeaderRec), (fsw_u8 *) &tree_header);
         if (r <= 0)
@@ -414,6 +421,30 @@ static fsw_status_t fsw_hfs_volume_mount(struct fsw_hfs_volume *vol)
         vol->extents_tree.root_node = be32_to_cpu (tree_header.rootNode);
         vol->extents_tree.node_size = be16_to_cpu (tree_header.nodeSize);
 
+        /* Attributes file is optional, compressed files keep their decmpfs header there */
+        if (vol->primary_voldesc->attributesFile.logicalSize != 0)
+        {
+            status = fsw_dnode_create_root(vol, kHFSAttributesFileID, &vol->attributes_tree.file);
+            CHECK(status);
+            fsw_memcpy (vol->attributes_tree.file->extents,
+                        vol->primary_voldesc->attributesFile.extents,
+                        sizeof vol->attributes_tree.file->extents);
+            vol->attributes_tree.file->g.size =
+                    be64_to_cpu(vol->primary_voldesc->attributesFile.logicalSize);
+
+            r = fsw_hfs_read_file(vol->attributes_tree.file, HFS_DATA_FORK,
+                                  sizeof (BTNodeDescriptor),
+                                  sizeof (BTHeaderRec), (fsw_u8 *) &tree_header);
+            if (r <= 0)
+            {
+                status = FSW_VOLUME_CORRUPTED;
+                break;
+            }
+
+            vol->attributes_tree.root_node = be32_to_cpu (tree_header.rootNode);
+            vol->attributes_tree.node_size = be16_to_cpu (tree_header.nodeSize);
+        }
+
         rv = FSW_SUCCESS;
     } while (0);
 
@@ -472,8 +503,33 @@ str[strMaxLen] = '\0';
  * part of the volume structure.
  */
 
+static void fsw_hfs_btree_free(struct fsw_hfs_btree *btree)
+{
+    int i;
+
+    for (i = 0; i < HFS_NODE_CACHE_SIZE; i++)
+    {
+        if (btree->cache[i].buf)
+        {
+            fsw_free(btree->cache[i].buf);
+            btree->cache[i].buf = NULL;
+        }
+        btree->cache[i].stamp = 0;
+    }
+}
+
 static void fsw_hfs_volume_free(struct fsw_hfs_volume *vol)
 {
+    fsw_hfs_btree_free(&vol->catalog_tree);
+    fsw_hfs_btree_free(&vol->extents_tree);
+    fsw_hfs_btree_free(&vol->attributes_tree);
+
+    if (vol->zlib_workspace)
+    {
+        fsw_free(vol->zlib_workspace);
+        vol->zlib_workspace = NULL;
+    }
+
     if (vol->primary_voldesc)
     {
         fsw_free(vol->primary_voldesc);
@@ -500,6 +556,10 @@ static fsw_status_t fsw_hfs_volume_stat(struct fsw_hfs_volume *vol, struct fsw_v
 
 static fsw_status_t fsw_hfs_dnode_fill(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno)
 {
+    /* The real size of a compressed file is in its decmpfs header */
+    if (dno->compressed && dno->cmp_type == 0)
+        return fsw_hfs_decmpfs_open(vol, dno);
+
     return FSW_SUCCESS;
 }
 
@@ -511,6 +571,15 @@ static fsw_status_t fsw_hfs_dnode_fill(struct fsw_hfs_volume *vol, struct fsw_hf
 
 static void fsw_hfs_dnode_free(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno)
 {
+    if (dno->cmp_chunks)
+        fsw_free(dno->cmp_chunks);
+    if (dno->cmp_inline)
+        fsw_free(dno->cmp_inline);
+    if (dno->chunk_buf)
+        fsw_free(dno->chunk_buf);
+    dno->cmp_chunks = NULL;
+    dno->cmp_inline = NULL;
+    dno->chunk_buf = NULL;
 }
 
 static fsw_u32 mac_to_posix(fsw_u32 mac_time)
@@ -539,10 +608,17 @@ static fsw_status_t fsw_hfs_dnode_stat(struct fsw_hfs_volume *vol,
   return FSW_SUCCESS;
 }
 
+/*
+ * Map a logical block through one extent record. On success, *pbno is the
+ * physical block and *count the number of blocks left in its extent,
+ * counting from *lbno. Otherwise *lbno is reduced by the blocks the record
+ * covers, so the search can go on with the next record.
+ */
 static int
 fsw_hfs_find_block(HFSPlusExtentRecord * exts,
                    fsw_u32             * lbno,
-                   fsw_u32             * pbno)
+                   fsw_u32             * pbno,
+                   fsw_u32             * count_out)
 {
     int i;
     fsw_u32 cur_lbno = *lbno;
@@ -555,6 +631,7 @@ fsw_hfs_find_block(HFSPlusExtentRecord * exts,
         if (cur_lbno < count)
         {
             *pbno = start + cur_lbno;
+            *count_out = count - cur_lbno;
             return 1;
         }
 
@@ -591,6 +668,63 @@ fsw_hfs_btree_rec (struct fsw_hfs_btree   * btree,
 }
 
 
+/*
+ * B-tree nodes are kept in a small per-tree LRU cache, so that the index
+ * nodes near the root stay in memory across lookups. The returned pointer
+ * is owned by the cache and stays valid until the next call for the same
+ * tree.
+ */
+static fsw_status_t
+fsw_hfs_btree_get_node (struct fsw_hfs_btree * btree,
+                        fsw_u32                nodenum,
+                        BTNodeDescriptor    ** result)
+{
+    struct fsw_hfs_node_slot *slot, *victim;
+    fsw_status_t status;
+    int i;
+
+    victim = &btree->cache[0];
+    for (i = 0; i < HFS_NODE_CACHE_SIZE; i++)
+    {
+        slot = &btree->cache[i];
+        if (slot->stamp && slot->node == nodenum)
+        {
+            slot->stamp = ++btree->stamp;
+            *result = (BTNodeDescriptor*)slot->buf;
+            return FSW_SUCCESS;
+        }
+        if (slot->stamp < victim->stamp)
+            victim = slot;
+    }
+
+    if (victim->buf == NULL)
+    {
+        status = fsw_alloc(btree->node_size, &victim->buf);
+        if (status)
+            return status;
+    }
+    victim->stamp = 0;
+
+    if (fsw_hfs_read_file (btree->file, HFS_DATA_FORK,
+                           (fsw_u64)nodenum * btree->node_size,
+                           btree->node_size, victim->buf) <= 0)
+        return FSW_VOLUME_CORRUPTED;
+
+    if (be16_to_cpu(*(fsw_u16*)(victim->buf + btree->node_size - 2)) != sizeof(BTNodeDescriptor))
+        BP("corrupted node\n");
+
+    victim->node = nodenum;
+    victim->stamp = ++btree->stamp;
+    *result = (BTNodeDescriptor*)victim->buf;
+    return FSW_SUCCESS;
+}
+
+/*
+ * Search the B-tree for an exact key. Records inside a node are sorted, so
+ * each node is binary searched for the last record not greater than the key.
+ * On success, *result points to the leaf node in the node cache and
+ * *key_offset is the record's index in it.
+ */
 static fsw_status_t
 fsw_hfs_btree_search (struct fsw_hfs_btree * btree,
                       BTreeKey             * key,
@@ -600,144 +734,69 @@ fsw_hfs_btree_search (struct fsw_hfs_btree * btree,
 {
     BTNodeDescriptor* node;
     fsw_u32 currnode;
-    fsw_u32 rec;
     fsw_status_t status;
-    fsw_u8* buffer = NULL;
 
     currnode = btree->root_node;
-    status = fsw_alloc(btree->node_size, &buffer);
-    if (status)
-        return status;
-    node = (BTNodeDescriptor*)buffer;
 
     while (1)
     {
-        int cmp = 0;
-        int match;
         fsw_u32 count;
+        fsw_u32 lower, upper;
+        BTreeKey *currkey;
 
-    readnode:
-        match = 0;
-        /* Read a node.  */
-        if (fsw_hfs_read_file (btree->file,
-                               (fsw_u64)currnode * btree->node_size,
-                               btree->node_size, buffer) <= 0)
-        {
-            status = FSW_VOLUME_CORRUPTED;
-            break;
-        }
-
-        if (be16_to_cpu(*(fsw_u16*)(buffer + btree->node_size - 2)) != sizeof(BTNodeDescriptor))
-            BP("corrupted node\n");
+        status = fsw_hfs_btree_get_node (btree, currnode, &node);
+        if (status)
+            return status;
 
         count = be16_to_cpu (node->numRecords);
 
-#if 1
-        for (rec = 0; rec < count; rec++)
+        /* Find the first record greater than the key */
+        lower = 0;
+        upper = count;
+        while (lower < upper)
         {
-             BTreeKey *currkey;
-
-             currkey = fsw_hfs_btree_rec (btree, node, rec);
-             cmp = compare_keys (currkey, key);
-             //fprintf(stderr, "rec=%d cmp=%d kind=%d \n", rec, cmp, node->kind);
-
-             /* Leaf node. */
-             if (node->kind == kBTLeafNode)
-             {
-               if (cmp == 0)
-               {
-                 /* Found!  */
-                 *result = node;
-                 *key_offset = rec;
-
-                 status = FSW_SUCCESS;
-                 goto done;
-               }
-             }
-             else if (node->kind == kBTIndexNode)
-             {
-                 fsw_u32 *pointer;
-
-                 if (cmp > 0)
-                     break;
-
-                 pointer = (fsw_u32 *) ((char *) currkey
-                                        + be16_to_cpu (currkey->length16)
-                                        + 2);
-                 currnode = be32_to_cpu (*pointer);
-                 match = 1;
-             }
+            fsw_u32 index = (lower + upper) / 2;
+
+            if (compare_keys (fsw_hfs_btree_rec (btree, node, index), key) <= 0)
+                lower = index + 1;
+            else
+                upper = index;
         }
 
-        if (node->kind == kBTLeafNode && cmp < 0 && node->fLink)
+        if (node->kind == kBTLeafNode)
         {
-            currnode = be32_to_cpu(node->fLink);
-            goto readnode;
+            if (lower > 0
+                && compare_keys (fsw_hfs_btree_rec (btree, node, lower - 1), key) == 0)
+            {
+                /* Found!  */
+                *result = node;
+                *key_offset = lower - 1;
+                return FSW_SUCCESS;
+            }
+
+            /* All records are smaller, the key may start the next leaf */
+            if (lower == count && count > 0 && node->fLink)
+            {
+                currnode = be32_to_cpu(node->fLink);
+                continue;
+            }
+            return FSW_NOT_FOUND;
         }
-        else if (!match)
+        else if (node->kind == kBTIndexNode && lower > 0)
         {
-            status = FSW_NOT_FOUND;
-            break;
+            fsw_u32 *pointer;
+
+            currkey = fsw_hfs_btree_rec (btree, node, lower - 1);
+            pointer = (fsw_u32 *) ((char *) currkey
+                                   + be16_to_cpu (currkey->length16)
+                                   + 2);
+            currnode = be32_to_cpu (*pointer);
+        }
+        else
+        {
+            return FSW_NOT_FOUND;
         }
-#else
-         /* Perform binary search */
-         fsw_u32 lower = 0;
-         fsw_u32 upper = count - 1;
-         fsw_s32 cmp = -1;
-         BTreeKey *currkey = NULL;
-
-         if (count == 0)
-         {
-             status = FSW_NOT_FOUND;
-             goto done;
-         }
-
-         while (lower <= upper)
-         {
-             fsw_u32 index = (lower + upper) / 2;
-
-             currkey = fsw_hfs_btree_rec (btree, node, index);
-
-             cmp = compare_keys (currkey, key);
-             if (cmp < 0)  upper = index - 1;
-             if (cmp > 0)  lower = index + 1;
-             if (cmp == 0)
-             {
-                 /* Found!  */
-                 *result = node;
-                 *key_offset = rec;
-
-                 status = FSW_SUCCESS;
-                 goto done;
-             }
-         }
-
-         if (cmp < 0)
-             currkey = fsw_hfs_btree_rec (btree, node, upper);
-
-         if (node->kind == kBTIndexNode && currkey)
-         {
-             fsw_u32 *pointer;
-
-             pointer = (fsw_u32 *) ((char *) currkey
-                                    + be16_to_cpu (currkey->length16)
-                                    + 2);
-             currnode = be32_to_cpu (*pointer);
-         }
-         else
-         {
-             status = FSW_NOT_FOUND;
-             break;
-         }
-#endif
     }
-
-
-  done:
-    if (buffer != NULL && status != FSW_SUCCESS)
-        fsw_free(buffer);
-
-    return status;
 }
 typedef struct
 {
@@ -749,6 +808,9 @@ typedef struct
     fsw_u32                 ctime;
     fsw_u32                 mtime;
     HFSPlusExtentRecord     extents;
+    int                     compressed;
+    fsw_u64                 rsrc_size;
+    HFSPlusExtentRecord     rsrc_extents;
 } file_info_t;
 
 typedef struct
@@ -807,6 +869,10 @@ fsw_hfs_btree_visit_node(BTreeKey *record, void* param)
             vp->file_info.mtime = be32_to_cpu(file_info->contentModDate);
             fsw_memcpy(&vp->file_info.extents, &file_info->dataFork.extents,
                        sizeof vp->file_info.extents);
+            vp->file_info.compressed = (file_info->bsdInfo.ownerFlags & UF_COMPRESSED) != 0;
+            vp->file_info.rsrc_size = be64_to_cpu(file_info->resourceFork.logicalSize);
+            fsw_memcpy(&vp->file_info.rsrc_extents, &file_info->resourceFork.extents,
+                       sizeof vp->file_info.rsrc_extents);
             break;
         }
         case kHFSPlusFolderThreadRecord:
@@ -846,13 +912,7 @@ fsw_hfs_btree_iterate_node (struct fsw_hfs_btree * btree,
                             void                  * param)
 {
   fsw_status_t status;
-  /* We modify node, so make a copy */
   BTNodeDescriptor*     node = first_node;
-  fsw_u8* buffer = NULL;
-
-  status = fsw_alloc(btree->node_size, &buffer);
-  if (status)
-      return status;
 
   while (1)
   {
@@ -868,11 +928,9 @@ fsw_hfs_btree_iterate_node (struct fsw_hfs_btree * btree,
           switch (rv)
           {
               case 1:
-                  status = FSW_SUCCESS;
-                  goto done;
+                  return FSW_SUCCESS;
               case -1:
-                  status = FSW_NOT_FOUND;
-                  goto done;
+                  return FSW_NOT_FOUND;
           }
           /* if callback returned 0 - continue */
       }
@@ -880,27 +938,15 @@ fsw_hfs_btree_iterate_node (struct fsw_hfs_btree * btree,
       next_node = be32_to_cpu(node->fLink);
 
       if (!next_node)
-      {
-          status = FSW_NOT_FOUND;
-          break;
-      }
+          return FSW_NOT_FOUND;
 
-      if (fsw_hfs_read_file (btree->file,
-                             next_node * btree->node_size,
-                             btree->node_size, buffer) <= 0)
-      {
-          status = FSW_VOLUME_CORRUPTED;
-          return 1;
-      }
+      /* node belongs to the cache and may be reused from here on */
+      status = fsw_hfs_btree_get_node (btree, next_node, &node);
+      if (status)
+          return status;
 
-      node = (BTNodeDescriptor*)buffer;
       first_rec = 0;
   }
- done:
-  if (buffer)
-      fsw_free(buffer);
-
-  return status;
 }
 
 #if 0
@@ -1034,17 +1080,16 @@ fsw_hfs_cmpi_catkey (BTreeKey *key1, BTreeKey *key2)
   }
 }
 
-/**
- * Retrieve file data mapping information. This function is called by the core when
- * fsw_shandle_read needs to know where on the disk the required piece of the file's
- * data can be found. The core makes sure that fsw_hfs_dnode_fill has been called
- * on the dnode before. Our task here is to get the physical disk block number for
- * the requested logical block number.
+/*
+ * Map a logical block of one fork of a file to its physical block, returning
+ * the rest of the extent the block lies in. Extents past the eight kept in
+ * the catalog record are looked up in the extents overflow tree.
  */
 
-static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
-                                       struct fsw_hfs_dnode  * dno,
-                                       struct fsw_extent     * extent)
+static fsw_status_t fsw_hfs_map_fork(struct fsw_hfs_volume * vol,
+                                     struct fsw_hfs_dnode  * dno,
+                                     fsw_u8                  fork_type,
+                                     struct fsw_extent     * extent)
 {
     fsw_status_t         status;
     fsw_u32              lbno;
@@ -1052,11 +1097,9 @@ static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
     BTNodeDescriptor     *node = NULL;
 
     extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
-    extent->log_count = 1;
     lbno = extent->log_start;
 
-    /* we only care about data forks atm, do we? */
-    exts = &dno->extents;
+    exts = (fork_type == HFS_RSRC_FORK) ? &dno->rsrc_extents : &dno->extents;
 
     while (1)
     {
@@ -1064,10 +1107,13 @@ static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
         struct HFSPlusExtentKey  overflowkey;
         fsw_u32                  ptr;
         fsw_u32                  phys_bno;
+        fsw_u32                  count;
 
-        if (fsw_hfs_find_block(exts, &lbno, &phys_bno))
+        if (fsw_hfs_find_block(exts, &lbno, &phys_bno, &count))
         {
+            /* Hand the rest of the extent to the core in one go */
             extent->phys_start = phys_bno + vol->emb_block_off;
+            extent->log_count = count;
             status = FSW_SUCCESS;
             break;
         }
@@ -1075,14 +1121,9 @@ static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
 
         /* Find appropriate overflow record */
         overflowkey.fileID = dno->g.dnode_id;
+        overflowkey.forkType = fork_type;
         overflowkey.startBlock = extent->log_start - lbno;
 
-        if (node != NULL)
-        {
-            fsw_free(node);
-            node = NULL;
-        }
-
         status = fsw_hfs_btree_search (&vol->extents_tree,
                                        (BTreeKey*)&overflowkey,
                                        fsw_hfs_cmp_extkey,
@@ -1095,12 +1136,450 @@ static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
         exts = (HFSPlusExtentRecord*) (key + 1);
     }
 
-    if (node != NULL)
-        fsw_free(node);
+    return status;
+}
+
+static int
+fsw_hfs_cmp_attrkey(BTreeKey* key1, BTreeKey* key2)
+{
+    HFSPlusAttrKey* akey1 = (HFSPlusAttrKey*)key1;
+    HFSPlusAttrKey* akey2 = (HFSPlusAttrKey*)key2;
+    fsw_u32 id1, start1;
+    fsw_u16 len1, i;
+
+    /* First key is read from the FS data, second is in-memory in CPU endianess */
+    id1 = be32_to_cpu(akey1->fileID);
+    if (id1 != akey2->fileID)
+        return id1 > akey2->fileID ? 1 : -1;
+
+    /* Attribute names compare as plain UTF-16 */
+    len1 = be16_to_cpu(akey1->attrNameLen);
+    if (len1 > kHFSMaxAttrNameLen)
+        len1 = kHFSMaxAttrNameLen;
+    for (i = 0; i < len1 && i < akey2->attrNameLen; i++)
+    {
+        fsw_u16 c1 = be16_to_cpu(akey1->attrName[i]);
+
+        if (c1 != akey2->attrName[i])
+            return c1 > akey2->attrName[i] ? 1 : -1;
+    }
+    if (len1 != akey2->attrNameLen)
+        return len1 > akey2->attrNameLen ? 1 : -1;
+
+    start1 = be32_to_cpu(akey1->startBlock);
+    if (start1 != akey2->startBlock)
+        return start1 > akey2->startBlock ? 1 : -1;
+    return 0;
+}
+
+/*
+ * Read the decmpfs header of a compressed file, which gives its real size,
+ * and find out where its compressed chunks are. Compression types we can't
+ * decode (e.g. LZFSE) leave the file alone, it then reads as its (empty)
+ * data fork.
+ */
 
+static fsw_status_t fsw_hfs_decmpfs_open(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno)
+{
+    fsw_status_t          status;
+    HFSPlusAttrKey        attrkey;
+    HFSPlusAttrKey       *key;
+    HFSPlusAttrData      *rec;
+    BTNodeDescriptor     *node;
+    struct decmpfs_header hdr;
+    fsw_u32               ptr, attr_size, type, count, i;
+    fsw_u32              *table = NULL;
+    struct fsw_hfs_chunk *chunks = NULL;
+    fsw_u8               *inline_data = NULL;
+    fsw_u32               rsrc_hdr[4];
+    fsw_u64               data_off;
+
+    if (vol->attributes_tree.file == NULL)
+    {
+        dno->compressed = 0;
+        return FSW_SUCCESS;
+    }
+
+    fsw_memzero(&attrkey, sizeof attrkey);
+    attrkey.fileID = dno->g.dnode_id;
+    attrkey.attrNameLen = sizeof (DECMPFS_XATTR_NAME) - 1;
+    for (i = 0; i < attrkey.attrNameLen; i++)
+        attrkey.attrName[i] = DECMPFS_XATTR_NAME[i];
+
+    status = fsw_hfs_btree_search (&vol->attributes_tree,
+                                   (BTreeKey*)&attrkey,
+                                   fsw_hfs_cmp_attrkey,
+                                   &node, &ptr);
+    if (status == FSW_NOT_FOUND)
+    {
+        dno->compressed = 0;
+        return FSW_SUCCESS;
+    }
+    if (status)
+        return status;
+
+    key = (HFSPlusAttrKey *)fsw_hfs_btree_rec (&vol->attributes_tree, node, ptr);
+    rec = (HFSPlusAttrData *)((fsw_u8 *)key + be16_to_cpu(key->keyLength) + 2);
+    attr_size = be32_to_cpu(rec->attrSize);
+    if (be32_to_cpu(rec->recordType) != kHFSPlusAttrInlineData
+        || attr_size < sizeof (hdr)
+        || rec->attrData + attr_size > (fsw_u8 *)node + vol->attributes_tree.node_size)
+        return FSW_VOLUME_CORRUPTED;
+
+    fsw_memcpy(&hdr, rec->attrData, sizeof (hdr));
+    type = fsw_u32_le_swap(hdr.type);
+    if (fsw_u32_le_swap(hdr.magic) != DECMPFS_MAGIC)
+        return FSW_VOLUME_CORRUPTED;
+
+    /* Build the chunk list in locals, the dnode only gets it once it's complete */
+    switch (type)
+    {
+        case DECMPFS_TYPE_UNCOMPRESSED_ATTR:
+        case DECMPFS_TYPE_ZLIB_ATTR:
+        case DECMPFS_TYPE_LZVN_ATTR:
+            /* The whole file is one chunk, stored right after the header */
+            if (fsw_u64_le_swap(hdr.size) > 0x7fffffff)
+                return FSW_VOLUME_CORRUPTED;
+            count = 1;
+            status = fsw_alloc(sizeof (struct fsw_hfs_chunk), &chunks);
+            if (status)
+                return status;
+            chunks[0].offset = 0;
+            chunks[0].length = attr_size - sizeof (hdr);
+            status = fsw_memdup((void **)&inline_data, rec->attrData + sizeof (hdr),
+                                attr_size - sizeof (hdr));
+            if (status)
+                goto fail;
+            break;
+
+        case DECMPFS_TYPE_ZLIB_RSRC:
+            /* Resource fork header, then the chunk table at the start of the data */
+            if (fsw_hfs_read_file(dno, HFS_RSRC_FORK, 0, sizeof (rsrc_hdr),
+                                  (fsw_u8 *)rsrc_hdr) != sizeof (rsrc_hdr))
+                return FSW_VOLUME_CORRUPTED;
+            data_off = be32_to_cpu(rsrc_hdr[0]) + 4;
+            if (fsw_hfs_read_file(dno, HFS_RSRC_FORK, data_off, 4, (fsw_u8 *)&count) != 4)
+                return FSW_VOLUME_CORRUPTED;
+            count = fsw_u32_le_swap(count);
+            if (count == 0 || count > dno->rsrc_size / 8)
+                return FSW_VOLUME_CORRUPTED;
+
+            status = fsw_alloc(count * 8, &table);
+            if (status)
+                return status;
+            status = fsw_alloc(count * sizeof (struct fsw_hfs_chunk), &chunks);
+            if (status == FSW_SUCCESS
+                && fsw_hfs_read_file(dno, HFS_RSRC_FORK, data_off + 4, count * 8,
+                                     (fsw_u8 *)table) != (fsw_s32)(count * 8))
+                status = FSW_VOLUME_CORRUPTED;
+            for (i = 0; status == FSW_SUCCESS && i < count; i++)
+            {
+                chunks[i].offset = data_off + fsw_u32_le_swap(table[2 * i]);
+                chunks[i].length = fsw_u32_le_swap(table[2 * i + 1]);
+            }
+            fsw_free(table);
+            if (status)
+                goto fail;
+            break;
+
+        case DECMPFS_TYPE_LZVN_RSRC:
+            /* The fork starts with count + 1 chunk offsets */
+            if (fsw_hfs_read_file(dno, HFS_RSRC_FORK, 0, 4, (fsw_u8 *)&count) != 4)
+                return FSW_VOLUME_CORRUPTED;
+            count = fsw_u32_le_swap(count) / 4;
+            if (count < 2 || count > dno->rsrc_size / 4)
+                return FSW_VOLUME_CORRUPTED;
+            count--;
+
+            status = fsw_alloc((count + 1) * 4, &table);
+            if (status)
+                return status;
+            status = fsw_alloc(count * sizeof (struct fsw_hfs_chunk), &chunks);
+            if (status == FSW_SUCCESS
+                && fsw_hfs_read_file(dno, HFS_RSRC_FORK, 0, (count + 1) * 4,
+                                     (fsw_u8 *)table) != (fsw_s32)((count + 1) * 4))
+                status = FSW_VOLUME_CORRUPTED;
+            for (i = 0; status == FSW_SUCCESS && i < count; i++)
+            {
+                fsw_u32 start = fsw_u32_le_swap(table[i]);
+                fsw_u32 end = fsw_u32_le_swap(table[i + 1]);
+
+                if (end < start)
+                    status = FSW_VOLUME_CORRUPTED;
+                chunks[i].offset = start;
+                chunks[i].length = end - start;
+            }
+            fsw_free(table);
+            if (status)
+                goto fail;
+            break;
+
+        default:
+            FSW_MSG_DEBUG((FSW_MSGSTR("fsw_hfs_decmpfs_open: file %d uses compression type %d, not supported\n"),
+                           (int)dno->g.dnode_id, (int)type));
+            dno->compressed = 0;
+            return FSW_SUCCESS;
+    }
+
+    /* Resource fork chunks hold 64 KiB each, the last one less */
+    if (type == DECMPFS_TYPE_ZLIB_RSRC || type == DECMPFS_TYPE_LZVN_RSRC)
+    {
+        if (RShiftU64(fsw_u64_le_swap(hdr.size) + (1 << DECMPFS_CHUNK_SHIFT) - 1,
+                      DECMPFS_CHUNK_SHIFT) > count)
+        {
+            status = FSW_VOLUME_CORRUPTED;
+            goto fail;
+        }
+    }
+
+    dno->cmp_chunks = chunks;
+    dno->cmp_inline = inline_data;
+    dno->cmp_count = count;
+    dno->cmp_type = type;
+    dno->chunk_len = 0;
+    dno->g.size = fsw_u64_le_swap(hdr.size);
+    return FSW_SUCCESS;
+
+fail:
+    if (chunks)
+        fsw_free(chunks);
+    if (inline_data)
+        fsw_free(inline_data);
     return status;
 }
 
+static fsw_status_t
+fsw_hfs_inflate(struct fsw_hfs_volume *vol, fsw_u8 *src, fsw_u32 src_len, fsw_u8 *dst, fsw_u32 dst_len)
+{
+    fsw_status_t status;
+    z_stream     strm;
+    int          rc;
+
+    if (vol->zlib_workspace == NULL)
+    {
+        status = fsw_alloc(zlib_inflate_workspacesize(), &vol->zlib_workspace);
+        if (status)
+            return status;
+    }
+
+    fsw_memzero(&strm, sizeof strm);
+    strm.workspace = vol->zlib_workspace;
+    /* zlib wrapper, so the Adler-32 of the data gets checked too */
+    if (zlib_inflateInit2(&strm, MAX_WBITS) != Z_OK)
+        return FSW_VOLUME_CORRUPTED;
+
+    strm.next_in = src;
+    strm.avail_in = src_len;
+    strm.next_out = dst;
+    strm.avail_out = dst_len;
+    rc = zlib_inflate(&strm, Z_FINISH);
+    zlib_inflateEnd(&strm);
+
+    if (rc != Z_STREAM_END || strm.total_out != dst_len)
+        return FSW_VOLUME_CORRUPTED;
+    return FSW_SUCCESS;
+}
+
+/*
+ * Make chunk index the one held in dno->chunk_buf. The last chunk decoded is
+ * kept, so reading a file in small pieces decompresses each chunk just once.
+ */
+
+static fsw_status_t fsw_hfs_decmpfs_load(struct fsw_hfs_volume *vol, struct fsw_hfs_dnode *dno,
+                                         fsw_u32 index)
+{
+    fsw_status_t          status;
+    struct fsw_hfs_chunk *chunk;
+    fsw_u8               *src, *cbuf = NULL;
+    fsw_u32               want, len;
+    fsw_u64               left;
+
+    if (dno->chunk_len != 0 && dno->chunk_index == index)
+        return FSW_SUCCESS;
+    if (index >= dno->cmp_count)
+        return FSW_VOLUME_CORRUPTED;
+    chunk = &dno->cmp_chunks[index];
+    len = chunk->length;
+
+    /* Size of the chunk once decompressed */
+    if (dno->cmp_inline)
+    {
+        want = (fsw_u32)dno->g.size;
+    }
+    else
+    {
+        left = dno->g.size - LShiftU64(index, DECMPFS_CHUNK_SHIFT);
+        want = (left < (1 << DECMPFS_CHUNK_SHIFT)) ? (fsw_u32)left : (1 << DECMPFS_CHUNK_SHIFT);
+    }
+
+    if (dno->chunk_buf == NULL)
+    {
+        status = fsw_alloc(dno->cmp_inline ? want : (1 << DECMPFS_CHUNK_SHIFT), &dno->chunk_buf);
+        if (status)
+            return status;
+    }
+    dno->chunk_len = 0;
+
+    if (dno->cmp_inline)
+    {
+        src = dno->cmp_inline;
+    }
+    else
+    {
+        /* Chunks don't grow by more than a marker byte and some zlib framing */
+        if (len > 2 * (1 << DECMPFS_CHUNK_SHIFT) || chunk->offset + len > dno->rsrc_size)
+            return FSW_VOLUME_CORRUPTED;
+        status = fsw_alloc(len, &cbuf);
+        if (status)
+            return status;
+        if (fsw_hfs_read_file(dno, HFS_RSRC_FORK, chunk->offset, len, cbuf) != (fsw_s32)len)
+        {
+            fsw_free(cbuf);
+            return FSW_VOLUME_CORRUPTED;
+        }
+        src = cbuf;
+    }
+
+    status = FSW_VOLUME_CORRUPTED;
+    if (dno->cmp_type == DECMPFS_TYPE_UNCOMPRESSED_ATTR)
+    {
+        if (len >= want)
+        {
+            fsw_memcpy(dno->chunk_buf, src, want);
+            status = FSW_SUCCESS;
+        }
+    }
+    else if (len == 0)
+    {
+        /* corrupted */
+    }
+    else if (dno->cmp_type == DECMPFS_TYPE_ZLIB_ATTR || dno->cmp_type == DECMPFS_TYPE_ZLIB_RSRC)
+    {
+        /* 0xff instead of a zlib header marks data stored as is */
+        if ((src[0] & 0x0f) == 0x0f)
+        {
+            if (len - 1 >= want)
+            {
+                fsw_memcpy(dno->chunk_buf, src + 1, want);
+                status = FSW_SUCCESS;
+            }
+        }
+        else
+        {
+            status = fsw_hfs_inflate(vol, src, len, dno->chunk_buf, want);
+        }
+    }
+    else
+    {
+        /* An eos opcode first marks data stored as is */
+        if (src[0] == 0x06)
+        {
+            if (len - 1 >= want)
+            {
+                fsw_memcpy(dno->chunk_buf, src + 1, want);
+                status = FSW_SUCCESS;
+            }
+        }
+        else if (lzvn_decode(src, len, dno->chunk_buf, want) == (fsw_s32)want)
+        {
+            status = FSW_SUCCESS;
+        }
+    }
+
+    if (cbuf)
+        fsw_free(cbuf);
+    if (status)
+        return status;
+
+    dno->chunk_index = index;
+    dno->chunk_len = want;
+    return FSW_SUCCESS;
+}
+
+/*
+ * Data of a compressed file is handed to the core as buffer extents of
+ * 64 KiB (at least one block), lined up with the resource fork chunks.
+ */
+
+static fsw_status_t fsw_hfs_decmpfs_extent(struct fsw_hfs_volume * vol,
+                                           struct fsw_hfs_dnode  * dno,
+                                           struct fsw_extent     * extent)
+{
+    fsw_status_t  status;
+    fsw_u32       shift = vol->block_size_shift;
+    fsw_u32       count, index, off, copy;
+    fsw_u64       pos, left;
+    fsw_u8       *buffer, *p;
+
+    count = (1 << DECMPFS_CHUNK_SHIFT) >> shift;
+    if (count == 0)
+        count = 1;
+    extent->log_start &= ~(count - 1);
+
+    pos = LShiftU64(extent->log_start, shift);
+    if (pos >= dno->g.size)
+        return FSW_NOT_FOUND;
+    left = dno->g.size - pos;
+    if (left < LShiftU64(count, shift))
+        count = (fsw_u32)RShiftU64(left + (1 << shift) - 1, shift);
+
+    status = fsw_alloc_zero(count << shift, (void **)&buffer);
+    if (status)
+        return status;
+
+    for (p = buffer; left > 0 && p < buffer + (count << shift); p += copy, left -= copy)
+    {
+        if (dno->cmp_inline)
+        {
+            index = 0;
+            off = (fsw_u32)pos;
+        }
+        else
+        {
+            index = (fsw_u32)RShiftU64(pos, DECMPFS_CHUNK_SHIFT);
+            off = (fsw_u32)pos & ((1 << DECMPFS_CHUNK_SHIFT) - 1);
+        }
+
+        status = fsw_hfs_decmpfs_load(vol, dno, index);
+        if (status == FSW_SUCCESS && off >= dno->chunk_len)
+            status = FSW_VOLUME_CORRUPTED;
+        if (status)
+        {
+            fsw_free(buffer);
+            return status;
+        }
+
+        copy = dno->chunk_len - off;
+        if (copy > buffer + (count << shift) - p)
+            copy = (fsw_u32)(buffer + (count << shift) - p);
+        fsw_memcpy(p, dno->chunk_buf + off, copy);
+        pos += copy;
+    }
+
+    extent->type = FSW_EXTENT_TYPE_BUFFER;
+    extent->log_count = count;
+    extent->buffer = buffer;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Retrieve file data mapping information. This function is called by the core when
+ * fsw_shandle_read needs to know where on the disk the required piece of the file's
+ * data can be found. The core makes sure that fsw_hfs_dnode_fill has been called
+ * on the dnode before. Our task here is to get the physical disk block number for
+ * the requested logical block number, or the decompressed data of a compressed file.
+ */
+
+static fsw_status_t fsw_hfs_get_extent(struct fsw_hfs_volume * vol,
+                                       struct fsw_hfs_dnode  * dno,
+                                       struct fsw_extent     * extent)
+{
+    if (dno->cmp_type != 0)
+        return fsw_hfs_decmpfs_extent(vol, dno, extent);
+
+    return fsw_hfs_map_fork(vol, dno, HFS_DATA_FORK, extent);
+}
+
 static const fsw_u16* g_blacklist[] =
 {
     //L"AppleIntelCPUPowerManagement.kext",
@@ -1141,16 +1620,21 @@ create_hfs_dnode(struct fsw_hfs_dnode  * dno,
     if (status)
         return status;
 
-    baby->g.size = file_info->size;
+    /* A compressed file we already know got its size from the decmpfs header */
+    if (baby->cmp_type == 0)
+        baby->g.size = file_info->size;
     baby->used_bytes = file_info->used;
     baby->ctime = file_info->ctime;
     baby->mtime = file_info->mtime;
 
 
     /* Fill-in extents info */
-    if (file_info->type == FSW_DNODE_TYPE_FILE)
+    if (file_info->type == FSW_DNODE_TYPE_FILE && baby->cmp_type == 0)
     {
         fsw_memcpy(baby->extents, &file_info->extents, sizeof file_info->extents);
+        fsw_memcpy(baby->rsrc_extents, &file_info->rsrc_extents, sizeof file_info->rsrc_extents);
+        baby->rsrc_size = file_info->rsrc_size;
+        baby->compressed = file_info->compressed;
     }
 
     *child_dno_out = baby;
@@ -1270,6 +1754,10 @@ static fsw_status_t fsw_hfs_dir_lookup(struct fsw_hfs_volume * vol,
             file_info.mtime = be32_to_cpu(info->contentModDate);
             fsw_memcpy(&file_info.extents, &info->dataFork.extents,
                        sizeof file_info.extents);
+            file_info.compressed = (info->bsdInfo.ownerFlags & UF_COMPRESSED) != 0;
+            file_info.rsrc_size = be64_to_cpu(info->resourceFork.logicalSize);
+            fsw_memcpy(&file_info.rsrc_extents, &info->resourceFork.extents,
+                       sizeof file_info.rsrc_extents);
             break;
         }
         default:
@@ -1287,9 +1775,6 @@ create:
 
 done:
 
-    if (node != NULL)
-        fsw_free(node);
-
     if (free_data)
         fsw_strfree(&rec_name);
 
@@ -88,6 +88,44 @@ typedef enum {
     FSW_HFS_PLUS_EMB
 } fsw_hfs_kind;
 
+/* Fork types, as used in extents overflow keys */
+#define HFS_DATA_FORK           0x00
+#define HFS_RSRC_FORK           0xFF
+
+/* File flag of transparently compressed files, kept in bsdInfo.ownerFlags */
+#ifndef UF_COMPRESSED
+#define UF_COMPRESSED 0x20
+#endif
+
+/* decmpfs, the header of the com.apple.decmpfs attribute (little endian) */
+#define DECMPFS_MAGIC           0x636d7066  /* 'fpmc' */
+#define DECMPFS_XATTR_NAME      "com.apple.decmpfs"
+#define DECMPFS_CHUNK_SHIFT     16          /* resource fork chunks hold 64 KiB */
+
+enum {
+    DECMPFS_TYPE_UNCOMPRESSED_ATTR  = 1,    /* data follows the header */
+    DECMPFS_TYPE_ZLIB_ATTR          = 3,    /* zlib stream follows the header */
+    DECMPFS_TYPE_ZLIB_RSRC          = 4,    /* zlib chunks in the resource fork */
+    DECMPFS_TYPE_LZVN_ATTR          = 7,    /* LZVN stream follows the header */
+    DECMPFS_TYPE_LZVN_RSRC          = 8     /* LZVN chunks in the resource fork */
+};
+
+struct decmpfs_header {
+    fsw_u32                 magic;
+    fsw_u32                 type;
+    fsw_u64                 size;           /* uncompressed file size */
+};
+
+/**
+ * HFS: Location of one compressed chunk, in the resource fork or in the
+ * decmpfs attribute.
+ */
+struct fsw_hfs_chunk
+{
+    fsw_u64                  offset;
+    fsw_u32                  length;
+};
+
 /**
  * HFS: Dnode structure with HFS-specific data.
  */
@@ -99,6 +137,28 @@ struct fsw_hfs_dnode
   fsw_u32                   ctime;
   fsw_u32                   mtime;
   fsw_u64                   used_bytes;
+  HFSPlusExtentRecord       rsrc_extents;   //!< Resource fork, holds the data of some compressed files
+  fsw_u64                   rsrc_size;
+  int                       compressed;     //!< UF_COMPRESSED is set, data comes from decmpfs
+  fsw_u32                   cmp_type;       //!< decmpfs compression type, 0 until dnode_fill read it
+  fsw_u32                   cmp_count;      //!< Number of compressed chunks
+  struct fsw_hfs_chunk     *cmp_chunks;     //!< Where the chunks are stored
+  fsw_u8                   *cmp_inline;     //!< Compressed data kept in the decmpfs attribute itself
+  fsw_u8                   *chunk_buf;      //!< Last decompressed chunk
+  fsw_u32                   chunk_index;    //!< Its number
+  fsw_u32                   chunk_len;      //!< Its length, 0 if chunk_buf holds nothing
+};
+
+#define HFS_NODE_CACHE_SIZE 16   /* B-tree nodes cached per tree */
+
+/**
+ * HFS: Cached B-tree node.
+ */
+struct fsw_hfs_node_slot
+{
+    fsw_u32                  node;      //!< Node number
+    fsw_u32                  stamp;     //!< Time of last use, 0 if the slot is empty
+    fsw_u8                  *buf;       //!< Node data, node_size bytes
 };
 
 /**
@@ -109,6 +169,8 @@ struct fsw_hfs_btree
     fsw_u32                  root_node;
     fsw_u32                  node_size;
     struct fsw_hfs_dnode*    file;
+    struct fsw_hfs_node_slot cache[HFS_NODE_CACHE_SIZE];
+    fsw_u32                  stamp;     //!< LRU clock of cache
 };
 
 
@@ -123,6 +185,8 @@ struct fsw_hfs_volume
     struct HFSPlusVolumeHeader   *primary_voldesc;  //!< Volume Descriptor
     struct fsw_hfs_btree          catalog_tree;     // Catalog tree
     struct fsw_hfs_btree          extents_tree;     // Extents overflow tree
+    struct fsw_hfs_btree          attributes_tree;  // Attributes tree, file is NULL if there is none
+    void                         *zlib_workspace;   // Inflate state for compressed files
     struct fsw_hfs_dnode          root_file;
     int                           case_sensitive;
     fsw_u32                       block_size_shift;
@@ -4,7 +4,6 @@
  *
  * Current limitations:
  *  - Files must be in one extent (i.e. Level 2)
- *  - No Joliet or Rock Ridge extensions
  *  - No interleaving
  *  - inode number generation strategy fails on volumes > 2 GB
  *  - No blocksizes != 2048
@@ -96,11 +95,12 @@ static fsw_status_t fsw_iso9660_dir_lookup(struct fsw_iso9660_volume *vol, struc
 static fsw_status_t fsw_iso9660_dir_read(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno,
                                          struct fsw_shandle *shand, struct fsw_iso9660_dnode **child_dno);
 static fsw_status_t fsw_iso9660_read_dirrec(struct fsw_iso9660_volume *vol, struct fsw_shandle *shand, struct iso9660_dirrec_buffer *dirrec_buffer);
+static fsw_status_t fsw_iso9660_decode_name(struct fsw_iso9660_volume *vol, struct iso9660_dirrec *dirrec, struct fsw_string *name);
+static fsw_status_t fsw_iso9660_dir_index(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno);
 
 static fsw_status_t fsw_iso9660_readlink(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno,
                                          struct fsw_string *link);
 
-static fsw_status_t rr_find_sp(struct iso9660_dirrec *dirrec, struct fsw_rock_ridge_susp_sp **psp);
 static fsw_status_t rr_find_nm(struct fsw_iso9660_volume *vol, struct iso9660_dirrec *dirrec, int off, struct fsw_string *str);
 static fsw_status_t rr_read_ce(struct fsw_iso9660_volume *vol, union fsw_rock_ridge_susp_ce *ce, fsw_u8 *begin);
 //static void dump_dirrec(struct iso9660_dirrec *dirrec);
@@ -125,116 +125,108 @@ struct fsw_fstype_table   FSW_FSTYPE_TABLE_NAME(iso9660) = {
     fsw_iso9660_readlink,
 };
 
-static fsw_status_t rr_find_sp(struct iso9660_dirrec *dirrec, struct fsw_rock_ridge_susp_sp **psp)
-{
-    fsw_u8 *r;
-    int off = 0;
-    struct fsw_rock_ridge_susp_sp *sp;
-    r = (fsw_u8 *)((fsw_u8 *)dirrec + sizeof(*dirrec) + dirrec->file_identifier_length);
-    off = (int)(r - (fsw_u8 *)dirrec);
-    while(off < dirrec->dirrec_length)
-    {
-        if (*r == 'S')
-        {
-            sp = (struct fsw_rock_ridge_susp_sp *)r;
-            if(    sp->e.sig[0] == 'S'
-                && sp->e.sig[1] == 'P'
-                && sp->magic[0] == 0xbe
-                && sp->magic[1] == 0xef)
-            {
-                *psp = sp;
-                return FSW_SUCCESS;
-            }
-        }
-        r++;
-        off = (int)(r - (fsw_u8 *)dirrec);
-    }
-    *psp = NULL;
-    return FSW_NOT_FOUND;
-}
+/*
+ * Find the Rock Ridge NM (alternate name) entry of a directory record and
+ * return the name in a newly allocated string. off is the start of the System
+ * Use Area; the entries there are walked by their length fields and CE
+ * continuation areas are followed, up to RR_MAX_CE_HOPS of them.
+ */
 
 static fsw_status_t rr_find_nm(struct fsw_iso9660_volume *vol, struct iso9660_dirrec *dirrec, int off, struct fsw_string *str)
 {
-    fsw_u8 *r, *begin;
-    int fCe = 0;
+    fsw_status_t rc = FSW_NOT_FOUND;
+    fsw_u8 *r, *begin, *ce_buf = NULL;
     struct fsw_rock_ridge_susp_nm *nm;
     int limit = dirrec->dirrec_length;
+    int hops = 0;
     begin = (fsw_u8 *)dirrec;
-    r = (fsw_u8 *)dirrec + off;
     str->data = NULL;
     str->len = 0;
     str->size = 0;
     str->type = 0;
-    while(off < limit)
+    while (off + 4 <= limit)
     {
+        r = begin + off;
+        if (r[2] < 4 || off + r[2] > limit)
+            break;
         if (r[0] == 'C' && r[1] == 'E' && r[2] == 28)
         {
-            int rc;
-            int ce_off;
-            union fsw_rock_ridge_susp_ce *ce;
-            if (fCe == 0)
-                fsw_alloc_zero(ISO9660_BLOCKSIZE, (void *)&begin);
-            fCe = 1;
-        //    DEBUG((DEBUG_WARN, "%a:%d we found CE before NM or its continuation\n", __FILE__, __LINE__));
-            ce = (union fsw_rock_ridge_susp_ce *)r;
-            limit = ISOINT(ce->X.len);
-            ce_off = ISOINT(ce->X.offset);
-            rc = rr_read_ce(vol, ce, begin);
-            if (rc != FSW_SUCCESS)
+            union fsw_rock_ridge_susp_ce *ce = (union fsw_rock_ridge_susp_ce *)r;
+            fsw_u32 ce_off = ISOINT(ce->X.offset);
+            fsw_u32 ce_len = ISOINT(ce->X.len);
+            // a crafted image can chain continuation areas into a loop
+            if (ce_off >= ISO9660_BLOCKSIZE || ce_len > ISO9660_BLOCKSIZE - ce_off ||
+                ++hops > RR_MAX_CE_HOPS)
+            {
+                rc = FSW_VOLUME_CORRUPTED;
+                break;
+            }
+            if (ce_buf == NULL)
             {
-                fsw_free(begin);
-                return rc;
+                rc = fsw_alloc(ISO9660_BLOCKSIZE, (void **)&ce_buf);
+                if (rc != FSW_SUCCESS)
+                    break;
             }
-            begin += ce_off;
-            r = begin;
+            // the continuation area may itself end in another CE entry
+            rc = rr_read_ce(vol, ce, ce_buf);
+            if (rc != FSW_SUCCESS)
+                break;
+            rc = FSW_NOT_FOUND;
+            begin = ce_buf;
+            off = (int)ce_off;
+            limit = (int)(ce_off + ce_len);
+            continue;
         }
-        if (r[0] == 'N' && r[1] == 'M')
+        if (r[0] == 'N' && r[1] == 'M' && r[2] >= 5)
         {
+            int len;
+            fsw_u8 *tmp = NULL;
             nm = (struct fsw_rock_ridge_susp_nm *)r;
-            if(    nm->e.sig[0] == 'N'
-                && nm->e.sig[1] == 'M')
+            if (nm->flags & (RR_NM_CURR | RR_NM_PARE))
             {
-                int len = 0;
-                fsw_u8 *tmp = NULL;
-                if (nm->flags & RR_NM_CURR)
-                {
-                     fsw_memdup(str->data, ".", 1);
-                     str->len = 1;
-                     goto done;
-                }
-                if (nm->flags & RR_NM_PARE)
-                {
-                     fsw_memdup(str->data, "..", 2);
-                     str->len = 2;
-                     goto done;
-                }
-                len = nm->e.len - sizeof(struct fsw_rock_ridge_susp_nm) + 1;
-                fsw_alloc_zero(str->len + len, (void **)&tmp);
+                len = (nm->flags & RR_NM_CURR) ? 1 : 2;
                 if (str->data != NULL)
-                {
-                    fsw_memcpy(tmp, str->data, str->len);
                     fsw_free(str->data);
-                }
-           //     DEBUG((DEBUG_INFO, "dst:%p src:%p len:%d\n", tmp + str->len, &nm->name[0], len));
-                fsw_memcpy(tmp + str->len, &nm->name[0], len);
-                str->data = tmp;
-                str->len += len;
+                rc = fsw_memdup(&str->data, "..", len);
+                str->len = rc == FSW_SUCCESS ? len : 0;
+                break;
+            }
+            len = nm->e.len - sizeof(struct fsw_rock_ridge_susp_nm) + 1;
+            rc = fsw_alloc(str->len + len, (void **)&tmp);
+            if (rc != FSW_SUCCESS)
+                break;
+            if (str->data != NULL)
+            {
+                fsw_memcpy(tmp, str->data, str->len);
+                fsw_free(str->data);
+            }
+            fsw_memcpy(tmp + str->len, &nm->name[0], len);
+            str->data = tmp;
+            str->len += len;
+            rc = FSW_NOT_FOUND;
 
-                if ((nm->flags & RR_NM_CONT) == 0)
-                    goto done;
+            if ((nm->flags & RR_NM_CONT) == 0)
+            {
+                rc = FSW_SUCCESS;
+                break;
             }
         }
-        r++;
-        off = (int)(r - (fsw_u8 *)begin);
+        if (r[0] == 'S' && r[1] == 'T')
+            break;
+        off += r[2];
+    }
+    if (ce_buf != NULL)
+        fsw_free(ce_buf);
+    if (rc != FSW_SUCCESS)
+    {
+        if (str->data != NULL)
+            fsw_free(str->data);
+        str->data = NULL;
+        str->len = 0;
+        return rc;
     }
-    if(fCe == 1)
-        fsw_free(begin);
-    return FSW_NOT_FOUND;
-done:
     str->type = FSW_STRING_TYPE_ISO88591;
     str->size = str->len;
-    if(fCe == 1)
-        fsw_free(begin);
     return FSW_SUCCESS;
 }
 
@@ -306,6 +298,16 @@ static fsw_status_t fsw_iso9660_volume_mount(struct fsw_iso9660_volume *vol)
                     vol->primary_voldesc = NULL;
                 }
                 status = fsw_memdup((void **)&vol->primary_voldesc, voldesc, ISO9660_BLOCKSIZE);
+            } else if (voldesc_type == 2 && voldesc->volume_descriptor_version == 1 &&
+                       vol->joliet_voldesc == NULL) {
+                // Supplementary Volume Descriptor, Joliet if it names a UCS-2 escape sequence
+                pvoldesc = (struct iso9660_primary_volume_descriptor *)buffer;
+                if (   pvoldesc->escape[0] == 0x25
+                    && pvoldesc->escape[1] == 0x2f
+                    && (   pvoldesc->escape[2] == 0x40
+                        || pvoldesc->escape[2] == 0x43
+                        || pvoldesc->escape[2] == 0x45))
+                    status = fsw_memdup((void **)&vol->joliet_voldesc, voldesc, ISO9660_BLOCKSIZE);
             }
         } else if (!fsw_memeq(voldesc->standard_identifier, "CD", 2)) {
             // completely alien standard identifier, stop reading
@@ -342,18 +344,6 @@ static fsw_status_t fsw_iso9660_volume_mount(struct fsw_iso9660_volume *vol)
         return status;
     fsw_memcpy(&vol->g.root->dirrec, &pvoldesc->root_directory, sizeof(struct iso9660_dirrec));
 
-    if (   pvoldesc->escape[0] == 0x25
-        && pvoldesc->escape[1] == 0x2f
-        && (   pvoldesc->escape[2] == 0x40
-            || pvoldesc->escape[2] == 0x43
-            || pvoldesc->escape[2] == 0x45))
-    {
- //       FSW_MSG_DEBUG((FSW_MSGSTR("fsw_iso9660_volume_mount: success (joliet!!!)\n")));
-//      DBG("fsw_iso9660_volume_mount: success (joliet!!!)\n");
-        vol->fJoliet = 1;
-    }
-
-
     rootdir = pvoldesc->root_directory;
     sua_pos = (sizeof(struct iso9660_dirrec)) + rootdir.file_identifier_length + (rootdir.file_identifier_length % 2) - 2;
     //int sua_size = rootdir.dirrec_length - rootdir.file_identifier_length;
@@ -361,6 +351,8 @@ static fsw_status_t fsw_iso9660_volume_mount(struct fsw_iso9660_volume *vol)
 
 #if 1
     status = fsw_block_get(vol, ISOINT(rootdir.extent_location), 0, &buffer);
+    if (status)
+        return status;
     sig = (char *)buffer + sua_pos;
     entry = (struct fsw_rock_ridge_susp_entry *)sig;
     if (   entry->sig[0] == 'S'
@@ -370,15 +362,29 @@ static fsw_status_t fsw_iso9660_volume_mount(struct fsw_iso9660_volume *vol)
         if (sp->magic[0] == 0xbe && sp->magic[1] == 0xef)
         {
             vol->fRockRidge = 1;
+            vol->rr_susp_skip = sp->skip;
         } else {
  //           FSW_MSG_DEBUG((FSW_MSGSTR("fsw_iso9660_volume_mount: SP magic isn't valid\n")));
 //          DBG("fsw_iso9660_volume_mount: SP magic isn't valid\n");
         }
     }
+    fsw_block_release(vol, ISOINT(rootdir.extent_location), buffer);
 #endif
+
+    // without Rock Ridge, use the Joliet tree for its long, mixed-case names
+    if (!vol->fRockRidge && vol->joliet_voldesc != NULL)
+    {
+        fsw_memcpy(&vol->g.root->dirrec, &vol->joliet_voldesc->root_directory, sizeof(struct iso9660_dirrec));
+        vol->fJoliet = 1;
+    }
+
     // release volume descriptors
     fsw_free(vol->primary_voldesc);
     vol->primary_voldesc = NULL;
+    if (vol->joliet_voldesc) {
+        fsw_free(vol->joliet_voldesc);
+        vol->joliet_voldesc = NULL;
+    }
 
 
 //    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_iso9660_volume_mount: success\n")));
@@ -397,6 +403,8 @@ static void fsw_iso9660_volume_free(struct fsw_iso9660_volume *vol)
 {
     if (vol->primary_voldesc)
         fsw_free(vol->primary_voldesc);
+    if (vol->joliet_voldesc)
+        fsw_free(vol->joliet_voldesc);
 }
 
 /**
@@ -438,6 +446,13 @@ static fsw_status_t fsw_iso9660_dnode_fill(struct fsw_iso9660_volume *vol, struc
 
 static void fsw_iso9660_dnode_free(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno)
 {
+    fsw_u32 i;
+
+    if (dno->dirents) {
+        for (i = 0; i < dno->dirent_count; i++)
+            fsw_strfree(&dno->dirents[i].name);
+        fsw_free(dno->dirents);
+    }
 }
 
 /**
@@ -483,57 +498,252 @@ static fsw_status_t fsw_iso9660_get_extent(struct fsw_iso9660_volume *vol, struc
     return FSW_SUCCESS;
 }
 
+/**
+ * Fold a UTF-16 character for case-insensitive name comparison. Only ASCII and
+ * the Latin-1 letters are folded.
+ */
+
+static fsw_u16 fsw_iso9660_fold(fsw_u16 ch)
+{
+    if ((ch >= 'A' && ch <= 'Z') || (ch >= 0xc0 && ch <= 0xde && ch != 0xd7))
+        return ch + 0x20;
+    return ch;
+}
+
+/**
+ * Compare two UTF-16 names case-insensitively. This is the sort order of a
+ * directory's name index.
+ */
+
+static int fsw_iso9660_namecmp(struct fsw_string *s1, struct fsw_string *s2)
+{
+    fsw_u16 *p1 = (fsw_u16 *)s1->data;
+    fsw_u16 *p2 = (fsw_u16 *)s2->data;
+    fsw_u16 c1, c2;
+    int     i, len;
+
+    len = s1->len < s2->len ? s1->len : s2->len;
+    for (i = 0; i < len; i++) {
+        c1 = fsw_iso9660_fold(p1[i]);
+        c2 = fsw_iso9660_fold(p2[i]);
+        if (c1 != c2)
+            return c1 < c2 ? -1 : 1;
+    }
+    return s1->len - s2->len;
+}
+
+static void fsw_iso9660_sift_down(struct fsw_iso9660_dirent *dirents, fsw_u32 root, fsw_u32 count)
+{
+    struct fsw_iso9660_dirent tmp;
+    fsw_u32 child;
+
+    while ((child = 2 * root + 1) < count) {
+        if (child + 1 < count && fsw_iso9660_namecmp(&dirents[child].name, &dirents[child + 1].name) < 0)
+            child++;
+        if (fsw_iso9660_namecmp(&dirents[root].name, &dirents[child].name) >= 0)
+            break;
+        tmp = dirents[root];
+        dirents[root] = dirents[child];
+        dirents[child] = tmp;
+        root = child;
+    }
+}
+
+/**
+ * Sort directory entries by name (heapsort, so large directories in any
+ * on-disk order are fine).
+ */
+
+static void fsw_iso9660_sort_dirents(struct fsw_iso9660_dirent *dirents, fsw_u32 count)
+{
+    struct fsw_iso9660_dirent tmp;
+    fsw_u32 i;
+
+    for (i = count / 2; i-- > 0; )
+        fsw_iso9660_sift_down(dirents, i, count);
+    for (i = count; i-- > 1; ) {
+        tmp = dirents[0];
+        dirents[0] = dirents[i];
+        dirents[i] = tmp;
+        fsw_iso9660_sift_down(dirents, 0, i);
+    }
+}
+
+/**
+ * Get the next directory record from a buffer holding a whole directory,
+ * skipping the zero padding at the end of each sector. *dirrec_out is set to
+ * NULL at the end of the directory.
+ */
+
+static fsw_status_t fsw_iso9660_next_dirrec(fsw_u8 *buffer, fsw_u32 size, fsw_u32 *pos,
+                                            struct iso9660_dirrec **dirrec_out)
+{
+    struct iso9660_dirrec *dirrec;
+    fsw_u32 len;
+
+    while (*pos < size) {
+        len = buffer[*pos];
+        if (len == 0) {
+            // records don't cross sector boundaries, try the next sector
+            *pos = (*pos & ~(ISO9660_BLOCKSIZE - 1)) + ISO9660_BLOCKSIZE;
+            continue;
+        }
+        dirrec = (struct iso9660_dirrec *)(buffer + *pos);
+        if (len < 33 || len > size - *pos || len < 33 + dirrec->file_identifier_length)
+            return FSW_VOLUME_CORRUPTED;
+        *pos += len;
+        *dirrec_out = dirrec;
+        return FSW_SUCCESS;
+    }
+    *dirrec_out = NULL;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Build the name index of a directory. The directory's data is read in one go
+ * and parsed once: every entry's name is decoded (Rock Ridge, Joliet or plain
+ * ISO9660) and the entries are sorted case-insensitively, so that lookups in
+ * large directories can use a binary search.
+ */
+
+static fsw_status_t fsw_iso9660_dir_index(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno)
+{
+    fsw_status_t    status;
+    struct fsw_shandle shand;
+    fsw_u8          *buffer = NULL;
+    fsw_u32         buffer_size, pos, count, i;
+    struct iso9660_dirrec *dirrec;
+    struct fsw_iso9660_dirent *dirents = NULL;
+
+    // read the whole directory
+    buffer_size = (fsw_u32)dno->g.size;
+    if (buffer_size > 0) {
+        status = fsw_alloc(buffer_size, (void **)&buffer);
+        if (status)
+            return status;
+        status = fsw_shandle_open(dno, &shand);
+        if (status)
+            goto errorexit;
+        status = fsw_shandle_read(&shand, &buffer_size, buffer);
+        fsw_shandle_close(&shand);
+        if (status)
+            goto errorexit;
+    }
+
+    // count the records
+    count = 0;
+    pos = 0;
+    while (1) {
+        status = fsw_iso9660_next_dirrec(buffer, buffer_size, &pos, &dirrec);
+        if (status)
+            goto errorexit;
+        if (dirrec == NULL)
+            break;
+        count++;
+    }
+
+    // one spare entry, so that the index exists even for an empty directory
+    status = fsw_alloc_zero(sizeof(struct fsw_iso9660_dirent) * (count + 1), (void **)&dirents);
+    if (status)
+        goto errorexit;
+
+    // decode the entries, skipping . and ..
+    i = 0;
+    pos = 0;
+    while (i < count) {
+        status = fsw_iso9660_next_dirrec(buffer, buffer_size, &pos, &dirrec);
+        if (status || dirrec == NULL)
+            break;
+        if (dirrec->file_identifier_length == 1 &&
+            (dirrec->file_identifier[0] == 0 || dirrec->file_identifier[0] == 1))
+            continue;
+
+        // same inode number as fsw_iso9660_read_dirrec gives
+        dirents[i].ino = (ISOINT(dno->dirrec.extent_location) << ISO9660_BLOCKSIZE_BITS)
+            + (fsw_u32)((fsw_u8 *)dirrec - buffer);
+        fsw_memcpy(&dirents[i].dirrec, dirrec, 33);
+        status = fsw_iso9660_decode_name(vol, dirrec, &dirents[i].name);
+        if (status)
+            break;
+        i++;
+    }
+    if (status) {
+        while (i-- > 0)
+            fsw_strfree(&dirents[i].name);
+        fsw_free(dirents);
+        goto errorexit;
+    }
+
+    fsw_iso9660_sort_dirents(dirents, i);
+    dno->dirents = dirents;
+    dno->dirent_count = i;
+
+errorexit:
+    if (buffer)
+        fsw_free(buffer);
+    return status;
+}
+
 /**
  * Lookup a directory's child dnode by name. This function is called on a directory
  * to retrieve the directory entry with the given name. A dnode is constructed for
  * this entry and returned. The core makes sure that fsw_iso9660_dnode_fill has been called
  * and the dnode is actually a directory.
+ *
+ * The directory's name index is built on the first lookup and then binary-searched.
+ * Names are compared case-insensitively; if several entries differ only in case
+ * (possible with Rock Ridge), an exact match wins.
  */
 
 static fsw_status_t fsw_iso9660_dir_lookup(struct fsw_iso9660_volume *vol, struct fsw_iso9660_dnode *dno,
                                            struct fsw_string *lookup_name, struct fsw_iso9660_dnode **child_dno_out)
 {
     fsw_status_t    status;
-    struct fsw_shandle shand;
-    struct iso9660_dirrec_buffer dirrec_buffer;
-    struct iso9660_dirrec *dirrec = &dirrec_buffer.dirrec;
+    struct fsw_string name;
+    struct fsw_iso9660_dirent *dirent;
+    fsw_u32         lower, upper, i;
 
     // Preconditions: The caller has checked that dno is a directory node.
 
-    // setup handle to read the directory
-    status = fsw_shandle_open(dno, &shand);
-    if (status)
-        return status;
-
-    // scan the directory for the file
-    while (1) {
-        // read next entry
-        status = fsw_iso9660_read_dirrec(vol, &shand, &dirrec_buffer);
+    if (dno->dirents == NULL) {
+        status = fsw_iso9660_dir_index(vol, dno);
         if (status)
-            goto errorexit;
-        if (dirrec->dirrec_length == 0) {
-            // end of directory reached
-            status = FSW_NOT_FOUND;
-            goto errorexit;
-        }
+            return status;
+    }
 
-        // skip . and ..
-        if (dirrec->file_identifier_length == 1 &&
-            (dirrec->file_identifier[0] == 0 || dirrec->file_identifier[0] == 1))
-            continue;
+    status = fsw_strdup_coerce(&name, FSW_STRING_TYPE_UTF16, lookup_name);
+    if (status)
+        return status;
 
-        // compare name
-        if (fsw_streq(lookup_name, &dirrec_buffer.name))  // TODO: compare case-insensitively
+    // find the first entry that doesn't sort before the name
+    lower = 0;
+    upper = dno->dirent_count;
+    while (lower < upper) {
+        i = (lower + upper) / 2;
+        if (fsw_iso9660_namecmp(&dno->dirents[i].name, &name) < 0)
+            lower = i + 1;
+        else
+            upper = i;
+    }
+    if (lower == dno->dirent_count || fsw_iso9660_namecmp(&dno->dirents[lower].name, &name) != 0) {
+        status = FSW_NOT_FOUND;
+        goto errorexit;
+    }
+    dirent = &dno->dirents[lower];
+    for (i = lower; i < dno->dirent_count && fsw_iso9660_namecmp(&dno->dirents[i].name, &name) == 0; i++) {
+        if (fsw_streq(&dno->dirents[i].name, &name)) {
+            dirent = &dno->dirents[i];
             break;
+        }
     }
 
     // setup a dnode for the child item
-    status = fsw_dnode_create(dno, dirrec_buffer.ino, FSW_DNODE_TYPE_UNKNOWN, &dirrec_buffer.name, child_dno_out);
+    status = fsw_dnode_create(dno, dirent->ino, FSW_DNODE_TYPE_UNKNOWN, &dirent->name, child_dno_out);
     if (status == FSW_SUCCESS)
-        fsw_memcpy(&(*child_dno_out)->dirrec, dirrec, sizeof(struct iso9660_dirrec));
+        fsw_memcpy(&(*child_dno_out)->dirrec, &dirent->dirrec, sizeof(struct iso9660_dirrec));
 
 errorexit:
-    fsw_shandle_close(&shand);
+    fsw_strfree(&name);
     return status;
 }
 
@@ -549,6 +759,7 @@ static fsw_status_t fsw_iso9660_dir_read(struct fsw_iso9660_volume *vol, struct
                                          struct fsw_shandle *shand, struct fsw_iso9660_dnode **child_dno_out)
 {
     fsw_status_t    status;
+    fsw_u64         pos;
     struct iso9660_dirrec_buffer dirrec_buffer;
     struct iso9660_dirrec *dirrec = &dirrec_buffer.dirrec;
 
@@ -563,13 +774,15 @@ static fsw_status_t fsw_iso9660_dir_read(struct fsw_iso9660_volume *vol, struct
         // read next entry
         if (shand->pos >= dno->g.size)
             return FSW_NOT_FOUND; // end of directory
+        pos = shand->pos;
         status = fsw_iso9660_read_dirrec(vol, shand, &dirrec_buffer);
         if (status)
             return status;
         if (dirrec->dirrec_length == 0)
         {
-            // try the next block
-            shand->pos =(shand->pos & ~(vol->g.log_blocksize - 1)) + vol->g.log_blocksize;
+            // try the next block (counting from where the padding started, the
+            // read above may already have crossed into the next block)
+            shand->pos = (pos & ~(vol->g.log_blocksize - 1)) + vol->g.log_blocksize;
             continue;
         }
 
@@ -580,28 +793,30 @@ static fsw_status_t fsw_iso9660_dir_read(struct fsw_iso9660_volume *vol, struct
         break;
     }
 
+    status = fsw_iso9660_decode_name(vol, dirrec, &dirrec_buffer.name);
+    if (status)
+        return status;
+
     // setup a dnode for the child item
     status = fsw_dnode_create(dno, dirrec_buffer.ino, FSW_DNODE_TYPE_UNKNOWN, &dirrec_buffer.name, child_dno_out);
     if (status == FSW_SUCCESS)
         fsw_memcpy(&(*child_dno_out)->dirrec, dirrec, sizeof(struct iso9660_dirrec));
 
+    fsw_strfree(&dirrec_buffer.name);
     return status;
 }
 
 /**
  * Read a directory entry from the directory's raw data. This internal function is used
  * to read a raw iso9660 directory entry into memory. The shandle's position pointer is adjusted
- * to point to the next entry.
+ * to point to the next entry. The name is not decoded, see fsw_iso9660_decode_name.
  */
 
 static fsw_status_t fsw_iso9660_read_dirrec(struct fsw_iso9660_volume *vol, struct fsw_shandle *shand, struct iso9660_dirrec_buffer *dirrec_buffer)
 {
     fsw_status_t    status;
-    fsw_u32         i, buffer_size, remaining_size, name_len;
-    struct fsw_rock_ridge_susp_sp *sp = NULL;
+    fsw_u32         i, buffer_size, remaining_size;
     struct iso9660_dirrec *dirrec = &dirrec_buffer->dirrec;
-    int sp_off;
-    int rc;
 
     dirrec_buffer->ino = (ISOINT(((struct fsw_iso9660_dnode *)shand->dnode)->dirrec.extent_location)
                           << ISO9660_BLOCKSIZE_BITS)
@@ -642,36 +857,66 @@ static fsw_status_t fsw_iso9660_read_dirrec(struct fsw_iso9660_volume *vol, stru
     if (buffer_size < remaining_size)
         return FSW_VOLUME_CORRUPTED;
 
-//     dump_dirrec(dirrec);
-     if (vol->fRockRidge)
-     {
-         sp_off = sizeof(*dirrec) + dirrec->file_identifier_length;
-         rc = rr_find_sp(dirrec, &sp);
-         if (   rc == FSW_SUCCESS
-             && sp != NULL)
-         {
-            sp_off = (fsw_u8 *)&sp[1] - (fsw_u8*)dirrec + sp->skip;
-         }
-         rc = rr_find_nm(vol, dirrec, sp_off,  &dirrec_buffer->name);
-         if (rc == FSW_SUCCESS)
-            return FSW_SUCCESS;
+    return FSW_SUCCESS;
+}
+
+/**
+ * Decode the name of a directory record into a newly allocated UTF-16 string: the
+ * Rock Ridge NM name if there is one, the UCS-2 name on a Joliet tree, or else the
+ * plain ISO9660 name with its version number cut off. The caller must free the
+ * string with fsw_strfree.
+ */
+
+static fsw_status_t fsw_iso9660_decode_name(struct fsw_iso9660_volume *vol, struct iso9660_dirrec *dirrec, struct fsw_string *name)
+{
+    fsw_status_t    status;
+    fsw_u32         i, name_len;
+    fsw_u8          *id = (fsw_u8 *)dirrec->file_identifier;
+    struct fsw_string raw;
+    int             sua_off;
+
+    if (vol->fRockRidge) {
+        // the System Use Area follows the identifier, padded to an even offset
+        sua_off = 33 + dirrec->file_identifier_length + ((dirrec->file_identifier_length & 1) ^ 1);
+        status = rr_find_nm(vol, dirrec, sua_off + vol->rr_susp_skip, &raw);
+        if (status == FSW_SUCCESS) {
+            status = fsw_strdup_coerce(name, FSW_STRING_TYPE_UTF16, &raw);
+            fsw_free(raw.data);
+            return status;
+        }
+        if (status != FSW_NOT_FOUND)
+            return status;
     }
 
-    // setup name
     name_len = dirrec->file_identifier_length;
-    for (i = name_len - 1; i > 0; i--) {
-        if (dirrec->file_identifier[i] == ';') {
-            name_len = i;   // cut the ISO9660 version number off
-            break;
+    if (vol->fJoliet) {
+        // big-endian UCS-2
+        name_len /= 2;
+        for (i = name_len - 1; i > 0 && i < name_len; i--) {
+            if (id[2*i] == 0 && id[2*i+1] == ';') {
+                name_len = i;   // cut the ISO9660 version number off
+                break;
+            }
         }
+        if (name_len > 0 && id[2*name_len-2] == 0 && id[2*name_len-1] == '.')
+            name_len--;
+        raw.type = FSW_STRING_TYPE_UTF16_BE;
+        raw.len = name_len;
+        raw.size = name_len * 2;
+    } else {
+        for (i = name_len - 1; i > 0 && i < name_len; i--) {
+            if (id[i] == ';') {
+                name_len = i;   // cut the ISO9660 version number off
+                break;
+            }
+        }
+        if (name_len > 0 && id[name_len-1] == '.')
+            name_len--;   // also cut the extension separator if the extension is empty
+        raw.type = FSW_STRING_TYPE_ISO88591;
+        raw.len = raw.size = name_len;
     }
-    if (name_len > 0 && dirrec->file_identifier[name_len-1] == '.')
-        name_len--;   // also cut the extension separator if the extension is empty
-    dirrec_buffer->name.type = FSW_STRING_TYPE_ISO88591;
-    dirrec_buffer->name.len = dirrec_buffer->name.size = name_len;
-    dirrec_buffer->name.data = dirrec->file_identifier;
-//    DEBUG((DEBUG_INFO, "%a:%d: dirrec_buffer->name.data:%a\n", __FILE__, __LINE__, dirrec_buffer->name.data));
-    return FSW_SUCCESS;
+    raw.data = id;
+    return fsw_strdup_coerce(name, FSW_STRING_TYPE_UTF16, &raw);
 }
 
 /**
@@ -98,9 +98,8 @@ struct iso9660_primary_volume_descriptor {
     char        volume_identifier[32];
     fsw_u8      unused2[8];
     iso9660_u32 volume_space_size;
-    fsw_u8      unused3[4];
-    fsw_u8      escape[3];
-    fsw_u8      unused4[25];
+    fsw_u8      escape[3];          //!< Escape sequences (Supplementary Volume Descriptor only)
+    fsw_u8      unused4[29];
     iso9660_u16 volume_set_size;
     iso9660_u16 volume_sequence_number;
     iso9660_u16 logical_block_size;
@@ -139,6 +138,16 @@ struct iso9660_dirrec_buffer {
     char        dirrec_buffer[222];
 };
 
+/**
+ * ISO9660: One entry of a directory's name index.
+ */
+
+struct fsw_iso9660_dirent {
+    fsw_u32     ino;                //!< Inode number, derived from the record's position
+    struct iso9660_dirrec dirrec;   //!< Fixed part of the directory record
+    struct fsw_string name;         //!< Decoded name (UTF-16), as used for lookups
+};
+
 
 /**
  * ISO9660: Volume structure with ISO9660-specific data.
@@ -154,6 +163,7 @@ struct fsw_iso9660_volume {
     int rr_susp_skip;
 
     struct iso9660_primary_volume_descriptor *primary_voldesc;  //!< Full Primary Volume Descriptor
+    struct iso9660_primary_volume_descriptor *joliet_voldesc;   //!< Joliet Supplementary Volume Descriptor
 };
 
 /**
@@ -164,6 +174,9 @@ struct fsw_iso9660_dnode {
     struct fsw_dnode g;             //!< Generic dnode structure
 
     struct iso9660_dirrec dirrec;   //!< Fixed part of the directory record (i.e. w/o name)
+
+    struct fsw_iso9660_dirent *dirents; //!< Directories: entries sorted by name, built on first lookup
+    fsw_u32     dirent_count;       //!< Number of entries in dirents
 };
 
 
@@ -192,6 +205,8 @@ struct fsw_rock_ridge_susp_nm
 #define RR_NM_CURR (1<<1)
 #define RR_NM_PARE (1<<2)
 
+#define RR_MAX_CE_HOPS 32   // CE entries followed per System Use Area before giving up
+
 union fsw_rock_ridge_susp_ce
 {
     struct X{
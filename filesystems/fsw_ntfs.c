@@ -22,8 +22,6 @@
 
 #include "fsw_core.h"
 
-#define Print(x...)	/* */
-
 static inline fsw_u8 GETU8(fsw_u8 *buf, int pos)
 {
     return buf[pos];
@@ -102,6 +100,15 @@ struct extent_map
     int used;
 };
 
+#define INDEX_CACHE_SIZE 8	/* index blocks cached per directory */
+
+struct index_slot
+{
+    fsw_u64 block;		/* index block#, 0 if unused */
+    fsw_u32 stamp;		/* LRU clock, 0 if unused */
+    fsw_u8 *buf;		/* fixed-up INDX block */
+};
+
 struct ntfs_mft
 {
     fsw_u64 mftno;		/* current MFT no */
@@ -151,12 +158,14 @@ struct fsw_ntfs_dnode
     int idxsz;			/* size of index block */
     int rootsz;			/* size of idxroot: AT_INDEX_ROOT:$I30 */
     int bmpsz;			/* size of idxbmp: AT_BITMAP:$I30 */
-    struct extent_slot cext;	/* cached extent */
+    struct extent_map runs;	/* decoded runlist of attr, lcn 0 for sparse */
     fsw_u64 fsize;		/* logical file size */
     fsw_u64 finited;		/* initialized file size */
     fsw_u64 cvcn;		/* vcn of compress chunk: cbuf */
     fsw_u64 clcn[16];		/* cluster map of compress chunk */
-    fsw_u8 *cbuf;		/* compress chunk/index block/symlink target */
+    fsw_u8 *cbuf;		/* compress chunk/symlink target */
+    struct index_slot *icache;	/* recently used index blocks */
+    fsw_u32 istamp;		/* LRU clock of icache */
 };
 
 static fsw_status_t fixup(fsw_u8 *record, char *magic, int sectorsize, int size)
@@ -666,7 +675,7 @@ static fsw_status_t fsw_ntfs_volume_mount(struct fsw_volume *volg)
 
     vol->sctbits = tobits(sector_size);
     vol->totalbytes = GETU64(buffer, 0x28) << vol->sctbits;
-    Print(L"NTFS size=%ld M\n", vol->totalbytes>>20);
+    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_volume_mount: size=%ld M\n"), vol->totalbytes>>20));
 
     cluster_size = GETU8(buffer, 0xD) * sector_size;
     if(cluster_size==0 || (cluster_size & (cluster_size-1)) || cluster_size > 0x10000)
@@ -726,11 +735,11 @@ static fsw_status_t fsw_ntfs_volume_mount(struct fsw_volume *volg)
     {
     int i;
     for(i=0; i<vol->extmap.used; i++)
-	Print(L"extent %d: vcn=%lx lcn=%lx len=%lx\n",
+	FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_ntfs_volume_mount: MFT extent %d: vcn=%lx lcn=%lx len=%lx\n"),
 		i,
 		vol->extmap.extent[i].vcn,
 		vol->extmap.extent[i].lcn,
-		vol->extmap.extent[i].cnt);
+		vol->extmap.extent[i].cnt));
     }
 
     free_mft(&mft0);
@@ -748,7 +757,7 @@ static fsw_status_t fsw_ntfs_volume_mount(struct fsw_volume *volg)
 	s.size = GETU16(ptr, 0x10);
 	s.len = s.size / 2;
 	s.data = ptr + GETU16(ptr, 0x14);
-	Print(L"Volume name [%.*ls]\n", s.len, s.data);
+	FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_volume_mount: volume name [%.*ls]\n"), s.len, s.data));
 	err = fsw_strdup_coerce(&volg->label, volg->host_string_type, &s);
     }
     free_mft(&mft0);
@@ -783,12 +792,25 @@ static void fsw_ntfs_dnode_free(struct fsw_volume *vol, struct fsw_dnode *dnog)
     struct fsw_ntfs_dnode *dno = (struct fsw_ntfs_dnode *)dnog;
     free_mft(&dno->mft);
     free_attr(&dno->attr);
+    if(dno->runs.extent) {
+	fsw_free(dno->runs.extent);
+	dno->runs.extent = NULL;
+	dno->runs.total = dno->runs.used = 0;
+    }
     if(dno->idxroot)
 	fsw_free(dno->idxroot);
     if(dno->idxbmp)
 	fsw_free(dno->idxbmp);
     if(dno->cbuf)
 	fsw_free(dno->cbuf);
+    if(dno->icache) {
+	int i;
+	for(i=0; i<INDEX_CACHE_SIZE; i++)
+	    if(dno->icache[i].buf)
+		fsw_free(dno->icache[i].buf);
+	fsw_free(dno->icache);
+	dno->icache = NULL;
+    }
 }
 
 static fsw_status_t fsw_ntfs_dnode_fill(struct fsw_volume *volg, struct fsw_dnode *dnog)
@@ -835,7 +857,7 @@ static fsw_status_t fsw_ntfs_dnode_fill(struct fsw_volume *volg, struct fsw_dnod
 	err = read_small_attribute(vol, &dno->mft, AT_INDEX_ROOT|AT_I30, &dno->idxroot, &dno->rootsz);
 	if(err != FSW_SUCCESS)
 	{
-	    Print(L"dno_fill INDEX_ROOT:$I30 error %d\n", err);
+	    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_dnode_fill: INDEX_ROOT:$I30 error %d\n"), err));
 	    goto error_out;
 	}
 
@@ -847,7 +869,7 @@ static fsw_status_t fsw_ntfs_dnode_fill(struct fsw_volume *volg, struct fsw_dnod
 	err = read_small_attribute(vol, &dno->mft, AT_BITMAP|AT_I30, &dno->idxbmp, &dno->bmpsz);
 	if(err != FSW_SUCCESS && err != FSW_NOT_FOUND)
 	{
-	    Print(L"dno_fill $Bitmap:$I30 error %d\n", err);
+	    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_dnode_fill: $Bitmap:$I30 error %d\n"), err));
 	    goto error_out;
 	}
 
@@ -859,7 +881,7 @@ static fsw_status_t fsw_ntfs_dnode_fill(struct fsw_volume *volg, struct fsw_dnod
 	    dno->fsize = attribute_size(dno->attr.ptr, dno->attr.len);
 	    dno->finited = dno->fsize;
 	} else if(err != FSW_NOT_FOUND) {
-	    Print(L"dno_fill $INDEX_ALLOCATION:$I30 error %d\n", err);
+	    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_dnode_fill: $INDEX_ALLOCATION:$I30 error %d\n"), err));
 	    goto error_out;
 	}
 
@@ -869,7 +891,7 @@ static fsw_status_t fsw_ntfs_dnode_fill(struct fsw_volume *volg, struct fsw_dnod
 	err = find_attribute(vol, &dno->mft, &dno->attr, 0);
 	if(err != FSW_SUCCESS)
 	{
-	    Print(L"dno_fill AT_DATA error %d\n", err);
+	    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_dnode_fill: AT_DATA error %d\n"), err));
 	    goto error_out;
 	}
 	dno->embeded = !attribute_ondisk(dno->attr.ptr, dno->attr.len);
@@ -937,46 +959,135 @@ static fsw_status_t fsw_ntfs_dnode_stat(struct fsw_volume *volg, struct fsw_dnod
     return FSW_SUCCESS;
 }
 
-static fsw_status_t fsw_ntfs_dnode_get_lcn(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno, fsw_u64 vcn, fsw_u64 *lcnp)
+static fsw_status_t add_run(struct extent_map *map, fsw_u64 vcn, fsw_u64 lcn, fsw_u64 cnt)
 {
-    fsw_status_t err;
-    if(vcn >= dno->cext.vcn && vcn < dno->cext.vcn+dno->cext.cnt) {
-	*lcnp = dno->cext.lcn + vcn - dno->cext.vcn;
-	return FSW_SUCCESS;
+    int u = map->used;
+
+    /* merge with the previous run if it continues on disk, or is sparse too */
+    if(u > 0) {
+	struct extent_slot *e = &map->extent[u-1];
+	if(e->vcn + e->cnt == vcn &&
+		((lcn == 0 && e->lcn == 0) || (lcn != 0 && e->lcn != 0 && e->lcn + e->cnt == lcn))) {
+	    e->cnt += cnt;
+	    return FSW_SUCCESS;
+	}
     }
-    if(!attribute_has_vcn(dno->attr.ptr, dno->attr.len, vcn)) {
+    if(u >= map->total) {
+	struct extent_slot *e;
+	int total = map->extent ? u*2 : 16;
+	if(fsw_alloc(total * sizeof(struct extent_slot), &e) != FSW_SUCCESS)
+	    return FSW_OUT_OF_MEMORY;
+	if(map->extent) {
+	    fsw_memcpy(e, map->extent, u*sizeof(struct extent_slot));
+	    fsw_free(map->extent);
+	}
+	map->extent = e;
+	map->total = total;
+    }
+    map->extent[u].vcn = vcn;
+    map->extent[u].lcn = lcn;
+    map->extent[u].cnt = cnt;
+    map->used++;
+    return FSW_SUCCESS;
+}
+
+/*
+ * Decode the whole runlist of the dnode's non-resident attribute once,
+ * following the attribute list through all its fragments, into a sorted
+ * table of runs.
+ */
+static fsw_status_t fsw_ntfs_load_runs(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno)
+{
+    fsw_status_t err;
+    fsw_u64 vcn = 0;
+    fsw_u64 ncl = 0;
+
+    do {
 	err = find_attribute(vol, &dno->mft, &dno->attr, vcn);
-	if( err != FSW_SUCCESS )
+	if(err != FSW_SUCCESS)
 	    return err;
-	if(!attribute_has_vcn(dno->attr.ptr, dno->attr.len, vcn))
+
+	fsw_u8 *ptr = dno->attr.ptr;
+	int len = dno->attr.len;
+	if(!attribute_ondisk(ptr, len))
 	    return FSW_VOLUME_CORRUPTED;
+	fsw_u64 svcn = attribute_first_vcn(ptr, len);
+	fsw_u64 evcn = attribute_last_vcn(ptr, len) + 1;
+	/* only the first fragment knows the allocated size */
+	if(svcn == 0)
+	    ncl = GETU64(ptr, 0x28) >> vol->clbits;
+	if(svcn != vcn || evcn <= svcn)
+	    return FSW_VOLUME_CORRUPTED;
+
+	fsw_u64 pos = 0;
+	fsw_u64 lcn, cnt;
+	int off = attribute_rle_offset(ptr, len);
+	ptr += off;
+	len -= off;
+	while(len > 0 && vcn < evcn && get_extent(&ptr, &len, &lcn, &cnt, &pos)==FSW_SUCCESS) {
+	    if(cnt > evcn - vcn)
+		cnt = evcn - vcn;
+	    if(add_run(&dno->runs, vcn, lcn, cnt) != FSW_SUCCESS)
+		return FSW_OUT_OF_MEMORY;
+	    vcn += cnt;
+	}
+	vcn = evcn;
+    } while(dno->mft.atlst && vcn < ncl);
+
+    return FSW_SUCCESS;
+}
+
+/* Find the run containing vcn, FSW_NOT_FOUND past the end of the attribute. */
+static fsw_status_t fsw_ntfs_find_run(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno, fsw_u64 vcn, struct extent_slot **outp)
+{
+    struct extent_slot *e;
+    fsw_status_t err;
+    int l = 0;
+    int r;
+    int m;
+
+    if(dno->runs.extent == NULL) {
+	err = fsw_ntfs_load_runs(vol, dno);
+	if(err != FSW_SUCCESS) {
+	    /* don't keep half a map, try again next time */
+	    if(dno->runs.extent)
+		fsw_free(dno->runs.extent);
+	    dno->runs.extent = NULL;
+	    dno->runs.total = dno->runs.used = 0;
+	    return err;
+	}
     }
-    fsw_u8 *ptr = dno->attr.ptr;
-    int len = dno->attr.len;
-    fsw_u64 pos = 0;
-    fsw_u64 lcn, cnt;
-    fsw_u64 svcn = attribute_first_vcn(ptr, len);
-    fsw_u64 evcn = attribute_last_vcn(ptr, len) + 1;
-    int off = GETU16(ptr, 0x20);
-    ptr += off;
-    len -= off;
-    while(len > 0 && get_extent(&ptr, &len, &lcn, &cnt, &pos)==FSW_SUCCESS) {
-	if(vcn >= svcn && vcn < svcn+cnt) {
-	    dno->cext.vcn = svcn;
-	    dno->cext.lcn = lcn;
-	    dno->cext.cnt = cnt;
-	    if(lcn == 0)
-		return FSW_NOT_FOUND;
-	    *lcnp = lcn + vcn - svcn;
+
+    e = dno->runs.extent;
+    r = dno->runs.used - 1;
+    while(l <= r) {
+	m = (l+r)/2;
+	if(vcn < e[m].vcn)
+	    r = m - 1;
+	else if(vcn >= e[m].vcn + e[m].cnt)
+	    l = m + 1;
+	else {
+	    *outp = &e[m];
 	    return FSW_SUCCESS;
 	}
-	svcn += cnt;
-	if(svcn >= evcn)
-	    break;
     }
     return FSW_NOT_FOUND;
 }
 
+static fsw_status_t fsw_ntfs_dnode_get_lcn(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno, fsw_u64 vcn, fsw_u64 *lcnp)
+{
+    struct extent_slot *e;
+    fsw_status_t err;
+
+    err = fsw_ntfs_find_run(vol, dno, vcn, &e);
+    if(err != FSW_SUCCESS)
+	return err;
+    if(e->lcn == 0)
+	return FSW_NOT_FOUND;
+    *lcnp = e->lcn + vcn - e->vcn;
+    return FSW_SUCCESS;
+}
+
 static int fsw_ntfs_read_buffer(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno, fsw_u8 *buf, fsw_u64 offset, int size)
 {
     if(dno->embeded) {
@@ -994,7 +1105,7 @@ static int fsw_ntfs_read_buffer(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dno
     }
 
     if(!dno->attr.ptr || !dno->attr.len) {
-	Print(L"BAD--------: attr.ptr %p attr.len %x cleared\n", dno->attr.ptr, dno->attr.len);
+	FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_read_buffer: attr.ptr %p attr.len %x cleared\n"), dno->attr.ptr, dno->attr.len));
 	if(find_attribute(vol, &dno->mft, &dno->attr, 0) != FSW_SUCCESS)
 	    return 0;
     }
@@ -1159,7 +1270,7 @@ static fsw_status_t fsw_ntfs_get_extent_compressed(struct fsw_ntfs_volume *vol,
 	if(err == FSW_NOT_FOUND) {
 	    break;
 	} else if(err != FSW_SUCCESS) {
-	    Print(L"BAD LCN\n");
+	    FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_get_extent_compressed: bad LCN\n")));
 	    dno->cperror = 1;
 	    return FSW_VOLUME_CORRUPTED;
 	}
@@ -1188,7 +1299,7 @@ static fsw_status_t fsw_ntfs_get_extent_compressed(struct fsw_ntfs_volume *vol,
 	    char *block;
 	    if (fsw_block_get(&vol->g, dno->clcn[b], 0, (void **)&block) != FSW_SUCCESS) {
 		dno->cperror = 1;
-		Print(L"Read ERROR at block %d\n", i);
+		FSW_MSG_DEBUG((FSW_MSGSTR("fsw_ntfs_get_extent_compressed: read error at block %d\n"), i));
 		break;
 	    }
 	    fsw_memcpy(src+(b<<vol->clbits), block, 1<<vol->clbits);
@@ -1234,15 +1345,16 @@ static fsw_status_t fsw_ntfs_get_extent_sparse(struct fsw_ntfs_volume *vol, stru
 
     if((extent->log_start << vol->clbits) > dno->fsize)
 	return FSW_NOT_FOUND;
-    if((extent->log_start << vol->clbits) > dno->finited)
+    if((extent->log_start << vol->clbits) >= dno->finited)
     {
 	extent->log_count = 1;
 	extent->buffer = NULL;
 	extent->type = FSW_EXTENT_TYPE_SPARSE;
 	return FSW_SUCCESS;
     }
-    fsw_u64 lcn;
-    err = fsw_ntfs_dnode_get_lcn(vol, dno, extent->log_start, &lcn);
+
+    struct extent_slot *e;
+    err = fsw_ntfs_find_run(vol, dno, extent->log_start, &e);
     if(err == FSW_NOT_FOUND) {
 	extent->log_count = 1;
 	extent->buffer = NULL;
@@ -1251,11 +1363,20 @@ static fsw_status_t fsw_ntfs_get_extent_sparse(struct fsw_ntfs_volume *vol, stru
     }
     if(err != FSW_SUCCESS)
 	return err;
-    extent->phys_start = lcn;
-    extent->log_count = 1;
-    if(extent->log_start >= dno->cext.vcn && extent->log_start < dno->cext.vcn+dno->cext.cnt)
-	extent->log_count = dno->cext.cnt + extent->log_start - dno->cext.vcn;
-    extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
+
+    /* the rest of the run, but not past the initialized data */
+    fsw_u64 count = e->cnt - (extent->log_start - e->vcn);
+    fsw_u64 inited = ((dno->finited - 1) >> vol->clbits) + 1 - extent->log_start;
+    if(count > inited)
+	count = inited;
+    extent->log_count = count;
+    if(e->lcn == 0) {
+	extent->buffer = NULL;
+	extent->type = FSW_EXTENT_TYPE_SPARSE;
+    } else {
+	extent->phys_start = e->lcn + extent->log_start - e->vcn;
+	extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
+    }
     return FSW_SUCCESS;
 }
 
@@ -1349,22 +1470,45 @@ static fsw_status_t fsw_ntfs_create_subnode(struct fsw_ntfs_dnode *dno, fsw_u8 *
     return fsw_dnode_create(&dno->g, mftno, type, &s, child_dno);
 }
 
+/*
+ * Index blocks are kept fixed-up in a small per-directory LRU cache, so
+ * repeated lookups descend the B+ tree without touching the disk.
+ */
 static fsw_u8 *fsw_ntfs_read_index_block(struct fsw_ntfs_volume *vol, struct fsw_ntfs_dnode *dno, fsw_u64 block)
 {
-    if(dno->cbuf==NULL) {
-	if(fsw_alloc(dno->idxsz, &dno->cbuf) != FSW_SUCCESS)
+    struct index_slot *slot, *victim;
+    int i;
+
+    if(dno->icache==NULL) {
+	if(fsw_alloc_zero(INDEX_CACHE_SIZE * sizeof(struct index_slot), (void **)&dno->icache) != FSW_SUCCESS)
 	    return NULL;
-    } else if(block == dno->cvcn)
-	return dno->cbuf;
+    }
 
-    dno->cvcn = BADVCN;
-    if(fsw_ntfs_read_buffer(vol, dno, dno->cbuf, (block-1)*dno->idxsz, dno->idxsz) != dno->idxsz)
+    victim = dno->icache;
+    for(i=0; i<INDEX_CACHE_SIZE; i++) {
+	slot = &dno->icache[i];
+	if(slot->block == block) {
+	    slot->stamp = ++dno->istamp;
+	    return slot->buf;
+	}
+	if(slot->stamp < victim->stamp)
+	    victim = slot;
+    }
+
+    if(victim->buf==NULL) {
+	if(fsw_alloc(dno->idxsz, &victim->buf) != FSW_SUCCESS)
+	    return NULL;
+    }
+    victim->block = 0;
+    victim->stamp = 0;
+    if(fsw_ntfs_read_buffer(vol, dno, victim->buf, (block-1)*dno->idxsz, dno->idxsz) != dno->idxsz)
 	return NULL;
-    if(fixup(dno->cbuf, "INDX", 1<<vol->sctbits, dno->idxsz) != FSW_SUCCESS)
+    if(fixup(victim->buf, "INDX", 1<<vol->sctbits, dno->idxsz) != FSW_SUCCESS)
 	return NULL;
 
-    dno->cvcn = block;
-    return dno->cbuf;
+    victim->block = block;
+    victim->stamp = ++dno->istamp;
+    return victim->buf;
 }
 
 static fsw_status_t fsw_ntfs_dir_lookup(struct fsw_volume *volg, struct fsw_dnode *dnog, struct fsw_string *lookup_name, struct fsw_dnode **child_dno)
@@ -1413,12 +1557,12 @@ static fsw_status_t fsw_ntfs_dir_lookup(struct fsw_volume *volg, struct fsw_dnod
 	    if(flag & 2) {
 		/* the end of index entry */
 		cmp = -1;
-		Print(L"depth %d len %x off %x flag %x next %x cmp %d\n", depth, len, off, flag, next, cmp);
+		FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_ntfs_dir_lookup: depth %d len %x off %x flag %x next %x cmp %d\n"), depth, len, off, flag, next, cmp));
 	    } else {
 		int nlen = GETU8(buf, off+0x50);
 		fsw_u8 *name = buf+off+0x52;
 		cmp = ntfs_filename_cmp(vol, s.data, s.len, name, nlen);
-		Print(L"depth %d len %x off %x flag %x next %x cmp %d name %d[%.*ls]\n", depth, len, off, flag, next, cmp, nlen, nlen, name);
+		FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_ntfs_dir_lookup: depth %d len %x off %x flag %x next %x cmp %d name %d[%.*ls]\n"), depth, len, off, flag, next, cmp, nlen, nlen, name));
 	    }
 
 	    if(cmp == 0) {
@@ -1505,12 +1649,12 @@ static fsw_status_t fsw_ntfs_dir_read(struct fsw_volume *volg, struct fsw_dnode
 	    len = GETU32(buf, 4);
 	if(off == 0)
 	    off = GETU32(buf, 0);
-	Print(L"block %d len %x off %x\n", block, len, off);
+	FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_ntfs_dir_read: block %d len %x off %x\n"), block, len, off));
 	while(off + 0x18 <= len) {
 	    int flag = GETU8(buf, off+12);
 	    if(flag & 2) break;
 	    int next = off + GETU16(buf, off+8);
-	    Print(L"flag %x next %x nt %x [%.*ls]\n", flag, next, GETU8(buf, off+0x51), GETU8(buf, off+0x50), buf+off+0x52);
+	    FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_ntfs_dir_read: flag %x next %x nt %x [%.*ls]\n"), flag, next, GETU8(buf, off+0x51), GETU8(buf, off+0x50), buf+off+0x52));
 	    if((GETU8(buf, off+0x51) != 2)) {
 		/* LONG FILE NAME */
 		fsw_status_t err = fsw_ntfs_create_subnode(dno, buf+off, child_dno);
@@ -287,6 +287,8 @@ static void fsw_reiserfs_dnode_free(struct fsw_reiserfs_volume *vol, struct fsw_
         fsw_free(dno->sd_v1);
     if (dno->sd_v2)
         fsw_free(dno->sd_v2);
+    if (dno->ind_ptrs)
+        fsw_free(dno->ind_ptrs);
 }
 
 /**
@@ -331,9 +333,9 @@ static fsw_status_t fsw_reiserfs_get_extent(struct fsw_reiserfs_volume *vol, str
                                             struct fsw_extent *extent)
 {
     fsw_status_t    status;
-    fsw_u64         search_offset, intra_offset;
-    struct fsw_reiserfs_item item;
-    fsw_u32         intra_bno, nr_item;
+    fsw_u64         search_offset, intra_offset, item_span, file_bcnt;
+    struct fsw_reiserfs_item *item = &dno->item;
+    fsw_u32         intra_bno, nr_item, phys_bno, next_bno;
 
     // Preconditions: The caller has checked that the requested logical block
     //  is within the file's size. The dnode has complete information, i.e.
@@ -345,75 +347,107 @@ static fsw_status_t fsw_reiserfs_get_extent(struct fsw_reiserfs_volume *vol, str
     extent->type = FSW_EXTENT_TYPE_SPARSE;
     extent->log_count = 1;
 
-    // get the item for the requested block
     search_offset = (fsw_u64)extent->log_start * vol->g.log_blocksize + 1;
-    status = fsw_reiserfs_item_search(vol, dno->dir_id, dno->g.dnode_id, search_offset, &item);
-    if (status)
-        return status;
-    if (item.item_offset == 0) {
-        fsw_reiserfs_item_release(vol, &item);
-        return FSW_SUCCESS;       // no data items found, assume all-sparse file
-    }
-    intra_offset = search_offset - item.item_offset;
 
-    // check the kind of block
-    if (item.item_type == TYPE_INDIRECT || item.item_type == V1_INDIRECT_UNIQUENESS) {
-        // indirect item, contains block numbers
-
-        if (intra_offset & (vol->g.log_blocksize - 1)) {
-            FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: intra_offset not block-aligned for indirect block\n")));
-            goto bail;
+    // Look for the item holding the requested block, unless it is the indirect item
+    // we mapped last time. Sequential reads usually continue in the item right after
+    // that one, so try to step there along the remembered tree path before searching
+    // the tree from the root.
+    if (dno->ind_ptrs == NULL || search_offset < item->item_offset ||
+        search_offset - item->item_offset >= (fsw_u64)dno->ind_count * vol->g.log_blocksize) {
+
+        status = FSW_NOT_FOUND;
+        if (dno->ind_ptrs != NULL && search_offset > item->item_offset) {
+            status = fsw_reiserfs_item_next(vol, item);
+            if (status == FSW_SUCCESS) {
+                if (item->item_type == TYPE_INDIRECT || item->item_type == V1_INDIRECT_UNIQUENESS)
+                    item_span = (fsw_u64)(item->ih.ih_item_len / sizeof(fsw_u32)) * vol->g.log_blocksize;
+                else
+                    item_span = item->ih.ih_item_len;
+                if (item->item_offset > search_offset || search_offset - item->item_offset >= item_span) {
+                    // the block isn't in the next item, e.g. after a seek
+                    fsw_reiserfs_item_release(vol, item);
+                    status = FSW_NOT_FOUND;
+                }
+            }
         }
-        intra_bno = (fsw_u32)FSW_U64_DIV(intra_offset, vol->g.log_blocksize);
-        nr_item = item.ih.ih_item_len / sizeof(fsw_u32);
-        if (intra_bno >= nr_item) {
-            FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: indirect block too small\n")));
-            goto bail;
+        if (dno->ind_ptrs != NULL) {
+            fsw_free(dno->ind_ptrs);
+            dno->ind_ptrs = NULL;
+            dno->ind_count = 0;
+        }
+        if (status) {
+            // get the item for the requested block
+            status = fsw_reiserfs_item_search(vol, dno->dir_id, dno->g.dnode_id, search_offset, item);
+            if (status)
+                return status;
+        }
+        if (item->item_offset == 0) {
+            fsw_reiserfs_item_release(vol, item);
+            return FSW_SUCCESS;       // no data items found, assume all-sparse file
         }
-        extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
-        extent->phys_start = ((fsw_u32 *)item.item_data)[intra_bno];
-
-        // TODO: check if the following blocks can be aggregated into one extent
 
-        fsw_reiserfs_item_release(vol, &item);
-        return FSW_SUCCESS;
+        // check the kind of block
+        if (item->item_type == TYPE_INDIRECT || item->item_type == V1_INDIRECT_UNIQUENESS) {
+            // indirect item, contains block numbers; keep them for the following calls
+            nr_item = item->ih.ih_item_len / sizeof(fsw_u32);
+            status = fsw_memdup((void **)&dno->ind_ptrs, item->item_data, nr_item * sizeof(fsw_u32));
+            fsw_reiserfs_item_release(vol, item);
+            if (status)
+                return status;
+            dno->ind_count = nr_item;
 
-    } else if (item.item_type == TYPE_DIRECT || item.item_type == V1_DIRECT_UNIQUENESS) {
-        // direct item, contains file data
+        } else if (item->item_type == TYPE_DIRECT || item->item_type == V1_DIRECT_UNIQUENESS) {
+            // direct item, contains file data
 
-        // TODO: Check if direct items always start on block boundaries. If not, we may have
-        //  to do extra work here.
+            // TODO: Check if direct items always start on block boundaries. If not, we may have
+            //  to do extra work here.
 
-        if (intra_offset != 0) {
-            FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: intra_offset not aligned for direct block\n")));
-            goto bail;
-        }
+            if (search_offset != item->item_offset) {
+                FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: intra_offset not aligned for direct block\n")));
+                fsw_reiserfs_item_release(vol, item);
+                return FSW_VOLUME_CORRUPTED;
+            }
 
-        extent->type = FSW_EXTENT_TYPE_BUFFER;
-        status = fsw_memdup(&extent->buffer, item.item_data, item.ih.ih_item_len);
-        fsw_reiserfs_item_release(vol, &item);
-        if (status)
+            extent->type = FSW_EXTENT_TYPE_BUFFER;
+            status = fsw_memdup(&extent->buffer, item->item_data, item->ih.ih_item_len);
+            fsw_reiserfs_item_release(vol, item);
             return status;
 
-        return FSW_SUCCESS;
+        } else {
+            fsw_reiserfs_item_release(vol, item);
+            return FSW_VOLUME_CORRUPTED;
+        }
+    }
 
+    // indirect item, map the block from its block numbers
+    intra_offset = search_offset - item->item_offset;
+    if (intra_offset & (vol->g.log_blocksize - 1)) {
+        FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: intra_offset not block-aligned for indirect block\n")));
+        return FSW_VOLUME_CORRUPTED;
+    }
+    intra_bno = (fsw_u32)FSW_U64_DIV(intra_offset, vol->g.log_blocksize);
+    if (intra_bno >= dno->ind_count) {
+        FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_get_extent: indirect block too small\n")));
+        return FSW_VOLUME_CORRUPTED;
     }
 
-bail:
-    fsw_reiserfs_item_release(vol, &item);
-    return FSW_VOLUME_CORRUPTED;
-
-    /*    
-    // check if the following blocks can be aggregated into one extent
-    file_bcnt = (fsw_u32)((dno->g.size + vol->g.log_blocksize - 1) & (vol->g.log_blocksize - 1));
-    while (path[i]           + extent->log_count < buf_bcnt &&    // indirect block has more block pointers
-           extent->log_start + extent->log_count < file_bcnt) {   // file has more blocks
-        if (buffer[path[i] + extent->log_count] == buffer[path[i] + extent->log_count - 1] + 1)
-            extent->log_count++;
-        else
+    // aggregate the following blocks into one extent while they are contiguous on
+    // disk; a block number of zero is a hole, aggregate runs of those as well
+    file_bcnt = FSW_U64_DIV(dno->g.size + vol->g.log_blocksize - 1, vol->g.log_blocksize);
+    phys_bno = dno->ind_ptrs[intra_bno];
+    while (intra_bno + extent->log_count < dno->ind_count &&
+           extent->log_start + extent->log_count < file_bcnt) {
+        next_bno = dno->ind_ptrs[intra_bno + extent->log_count];
+        if (phys_bno == 0 ? next_bno != 0 : next_bno != phys_bno + extent->log_count)
             break;
+        extent->log_count++;
     }
-    */
+    if (phys_bno != 0) {
+        extent->type = FSW_EXTENT_TYPE_PHYSBLOCK;
+        extent->phys_start = phys_bno;
+    }
+    return FSW_SUCCESS;
 }
 
 /**
@@ -717,6 +751,12 @@ static fsw_status_t fsw_reiserfs_item_search(struct fsw_reiserfs_volume *vol,
         return FSW_NOT_FOUND;   // Found no key for this object at all
     }
 
+    if ((fsw_u32)ihead->ih_item_location + ihead->ih_item_len > vol->g.log_blocksize) {
+        FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_item_search: item extends past its block %d\n"), tree_bno));
+        fsw_block_release(vol, tree_bno, buffer);
+        return FSW_VOLUME_CORRUPTED;
+    }
+
     // return results
     fsw_memcpy(&item->ih, ihead, sizeof(struct item_head));
     item->item_type = (fsw_u32)FSW_U64_SHR(ihead->ih_key.u.k_offset_v2.v, 60);
@@ -824,6 +864,12 @@ static fsw_status_t fsw_reiserfs_item_next(struct fsw_reiserfs_volume *vol,
             return FSW_NOT_FOUND;   // Found no next key for this object
         }
 
+        if ((fsw_u32)ihead->ih_item_location + ihead->ih_item_len > vol->g.log_blocksize) {
+            FSW_MSG_ASSERT((FSW_MSGSTR("fsw_reiserfs_item_next: item extends past its block %d\n"), tree_bno));
+            fsw_block_release(vol, tree_bno, buffer);
+            return FSW_VOLUME_CORRUPTED;
+        }
+
         // return results
         fsw_memcpy(&item->ih, ihead, sizeof(struct item_head));
         item->item_type = (fsw_u32)FSW_U64_SHR(ihead->ih_key.u.k_offset_v2.v, 60);
@@ -82,6 +82,10 @@ struct fsw_reiserfs_dnode {
     fsw_u32 dir_id;                 //!< Locality ID for the reiserfs tree (parent dir id)
     struct stat_data_v1 *sd_v1;     //!< Full stat_data, version 1
     struct stat_data *sd_v2;        //!< Full stat_data, version 2
+
+    struct fsw_reiserfs_item item;  //!< Tree path to the last data item mapped (block released)
+    fsw_u32 *ind_ptrs;              //!< Block pointers of that item, if it is an indirect item
+    fsw_u32 ind_count;              //!< Number of block pointers in ind_ptrs
 };
 
 
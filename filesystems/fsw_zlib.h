@@ -0,0 +1,36 @@
+/*
+ * filesystems/fsw_zlib.h
+ *
+ * Builds the zlib inflater from ../gzip/zlib_inflate (the one rEFInd uses for
+ * gzip-compressed loaders) into a file system driver. Include it once, from
+ * the driver's main source file.
+ *
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FSW_ZLIB_H_
+#define _FSW_ZLIB_H_
+
+#define memcpy(d, s, n) fsw_memcpy(d, s, n)
+
+#include "../gzip/zlib_inflate/inftrees.c"
+#include "../gzip/zlib_inflate/inffast.c"
+#include "../gzip/zlib_inflate/inflate.c"
+
+#undef memcpy
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * filesystems/lzvn.c
+ *
+ * Decoder for LZVN, the LZ77 variant macOS uses for compressed HFS+ files
+ * (decmpfs types 7 and 8). Written from the format description in Apple's
+ * open source lzfse package. Included by fsw_hfs.c.
+ *
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each opcode carries up to three literal bytes (L) that are copied first,
+ * followed by a match of M bytes at distance D back in the output:
+ *
+ *   sml_d  LLMMMDDD DDDDDDDD              D < 2048
+ *   med_d  101LLMMM DDDDDDMM DDDDDDDD     M up to 34, D < 16384
+ *   lrg_d  LLMMM111 DDDDDDDD DDDDDDDD     D < 65536
+ *   pre_d  LLMMM110                       D is the previous distance
+ *   sml_m  1111MMMM                       match only, previous distance
+ *   lrg_m  11110000 MMMMMMMM              M = 16 + byte
+ *   sml_l  1110LLLL                       literals only
+ *   lrg_l  11100000 LLLLLLLL              L = 16 + byte
+ *   eos    00000110                       end of stream
+ *   nop    00001110, 00010110
+ *
+ * Opcodes 0x1e-0x3e (step 8), 0x70-0x7f and 0xd0-0xdf are undefined.
+ */
+
+/*
+ * Decode the LZVN stream src into dst. Returns the number of bytes written,
+ * or -1 if the stream is corrupt or doesn't fit into dst_len bytes.
+ */
+static fsw_s32 lzvn_decode(const fsw_u8 *src, fsw_u32 src_len, fsw_u8 *dst, fsw_u32 dst_len)
+{
+    const fsw_u8 *src_end = src + src_len;
+    fsw_u32 out = 0;
+    fsw_u32 d_prev = 0;
+
+    while (src < src_end) {
+        fsw_u8 op = src[0];
+        fsw_u32 oplen = 1, L = 0, M = 0, D = d_prev;
+
+        if (op == 0x06)
+            return (fsw_s32)out;            // eos
+        if (op == 0x0e || op == 0x16) {
+            src++;                          // nop
+            continue;
+        }
+
+        if (op >= 0xf0) {                   // sml_m, lrg_m
+            if (op == 0xf0) {
+                oplen = 2;
+                if (src_end - src < 2)
+                    return -1;
+                M = src[1] + 16;
+            } else {
+                M = op & 0x0f;
+            }
+        } else if (op >= 0xe0) {            // sml_l, lrg_l
+            if (op == 0xe0) {
+                oplen = 2;
+                if (src_end - src < 2)
+                    return -1;
+                L = src[1] + 16;
+            } else {
+                L = op & 0x0f;
+            }
+        } else if ((op >= 0xd0) || (op >= 0x70 && op < 0x80)) {
+            return -1;
+        } else if (op >= 0xa0 && op < 0xc0) {  // med_d
+            fsw_u32 w;
+
+            oplen = 3;
+            if (src_end - src < 3)
+                return -1;
+            w = src[1] | (src[2] << 8);
+            L = (op >> 3) & 3;
+            M = (((op & 7) << 2) | (w & 3)) + 3;
+            D = w >> 2;
+        } else {
+            L = op >> 6;
+            M = ((op >> 3) & 7) + 3;
+            switch (op & 7) {
+                case 6:                     // pre_d
+                    if (op < 0x40)
+                        return -1;
+                    break;
+                case 7:                     // lrg_d
+                    oplen = 3;
+                    if (src_end - src < 3)
+                        return -1;
+                    D = src[1] | (src[2] << 8);
+                    break;
+                default:                    // sml_d
+                    oplen = 2;
+                    if (src_end - src < 2)
+                        return -1;
+                    D = ((op & 7) << 8) | src[1];
+                    break;
+            }
+        }
+        src += oplen;
+
+        if (L > 0) {
+            if ((fsw_u32)(src_end - src) < L || dst_len - out < L)
+                return -1;
+            fsw_memcpy(dst + out, src, L);
+            src += L;
+            out += L;
+        }
+
+        if (M > 0) {
+            fsw_u8 *p;
+
+            if (D == 0 || D > out || dst_len - out < M)
+                return -1;
+            // the match may overlap its own output, so copy bytewise
+            for (p = dst + out; M > 0; M--, p++)
+                *p = p[-(fsw_s32)D];
+            out = (fsw_u32)(p - dst);
+            d_prev = D;
+        }
+    }
+
+    // the stream ended without an eos opcode
+    return -1;
+}
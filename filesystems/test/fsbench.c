@@ -0,0 +1,324 @@
+/**
+ * \file fsbench.c
+ * Benchmark and robustness driver for the POSIX user space environment.
+ *
+ * Mounts an image file with the driver selected at build time, then times a
+ * full directory walk, path lookups of every file found and full reads of
+ * the files, reporting block cache and host I/O statistics for each phase.
+ * With -z, blocks read from the image are randomly corrupted to exercise
+ * the driver's error handling on damaged file systems.
+ */
+
+/*
+ * This program is licensed under the terms of the GNU GPL, version 3,
+ * or (at your option) any later version.
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsw_posix.h"
+
+#include <time.h>
+
+
+#define READ_BUFFER_SIZE (64*1024)
+
+/**
+ * Paths of the regular files found by the directory walk.
+ */
+
+struct path_list {
+    char        **paths;
+    int         count;
+    int         alloc;
+};
+
+static struct fsw_posix_volume *pvol;
+static struct path_list files;
+
+static unsigned int fuzz_seed;
+static unsigned int fuzz_rate;          // corrupt one of every fuzz_rate blocks read, 0 to disable
+static fsw_status_t (*posix_read_block)(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer);
+static fsw_status_t (*posix_read_blocks)(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer);
+
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Print one line of the report: elapsed time plus the statistics delta of a phase.
+ */
+
+static void report(const char *phase, double ms, long items, fsw_u64 bytes,
+                   struct fsw_volume_stats *before, struct fsw_volume_stats *after)
+{
+    fsw_u64 hits   = after->bcache_hits - before->bcache_hits;
+    fsw_u64 misses = after->bcache_misses - before->bcache_misses;
+
+    printf("%-8s %10.2f %8ld %10.2f %10llu %10llu %6.1f%% %8llu %8llu %12llu\n",
+           phase, ms, items, ms > 0 ? bytes * 1000.0 / ms / 1024.0 : 0.0,
+           (unsigned long long)hits, (unsigned long long)misses,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+           (unsigned long long)(after->bcache_evictions - before->bcache_evictions),
+           (unsigned long long)(after->read_calls - before->read_calls),
+           (unsigned long long)(after->read_bytes - before->read_bytes));
+}
+
+/**
+ * Host read functions used with -z: pass through to the POSIX host, then flip
+ * a random byte in some of the blocks.
+ */
+
+static void fuzz_buffer(struct fsw_volume *vol, fsw_u32 count, void *buffer)
+{
+    fsw_u32 i;
+
+    for (i = 0; i < count; i++) {
+        if (rand_r(&fuzz_seed) % fuzz_rate == 0)
+            ((fsw_u8 *)buffer)[i * vol->phys_blocksize + rand_r(&fuzz_seed) % vol->phys_blocksize] ^=
+                (fsw_u8)(1 + rand_r(&fuzz_seed) % 255);
+    }
+}
+
+static fsw_status_t fuzz_read_block(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer)
+{
+    fsw_status_t status = posix_read_block(vol, phys_bno, buffer);
+
+    if (status == FSW_SUCCESS)
+        fuzz_buffer(vol, 1, buffer);
+    return status;
+}
+
+static fsw_status_t fuzz_read_blocks(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer)
+{
+    fsw_status_t status = posix_read_blocks(vol, phys_bno, count, buffer);
+
+    if (status == FSW_SUCCESS)
+        fuzz_buffer(vol, count, buffer);
+    return status;
+}
+
+static void add_path(struct path_list *list, const char *path)
+{
+    char **new_paths;
+
+    if (list->count >= list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 256;
+        new_paths = realloc(list->paths, list->alloc * sizeof(char *));
+        if (new_paths == NULL) {
+            fprintf(stderr, "fsbench: out of memory\n");
+            exit(1);
+        }
+        list->paths = new_paths;
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+/**
+ * Walk a directory tree the way the EFI host lists directories: read each entry,
+ * fill and stat its dnode. Regular files are added to the path list.
+ */
+
+static long walk_dir(struct fsw_dnode *dir_dno, const char *path, int depth)
+{
+    fsw_status_t        status;
+    struct fsw_shandle  shand;
+    struct fsw_dnode    *dno;
+    struct fsw_dnode_stat sb;
+    struct fsw_string   name;
+    struct stat         st;
+    char                subpath[4096];
+    long                entries = 0;
+
+    if (depth > 64)
+        return 0;
+    if (fsw_shandle_open(dir_dno, &shand))
+        return 0;
+
+    while ((status = fsw_dnode_dir_read(&shand, &dno)) == FSW_SUCCESS) {
+        entries++;
+        if (fsw_dnode_fill(dno) == FSW_SUCCESS) {
+            memset(&st, 0, sizeof(st));
+            memset(&sb, 0, sizeof(sb));
+            sb.host_data = &st;
+            fsw_dnode_stat(dno, &sb);
+
+            if (fsw_strdup_coerce(&name, FSW_STRING_TYPE_ISO88591, &dno->name) == FSW_SUCCESS) {
+                snprintf(subpath, sizeof(subpath), "%s/%.*s", path, name.len, (char *)name.data);
+                fsw_strfree(&name);
+                if (dno->type == FSW_DNODE_TYPE_DIR)
+                    entries += walk_dir(dno, subpath, depth + 1);
+                else if (dno->type == FSW_DNODE_TYPE_FILE)
+                    add_path(&files, subpath);
+            }
+        }
+        fsw_dnode_release(dno);
+    }
+    if (status != FSW_NOT_FOUND)
+        fprintf(stderr, "fsbench: reading directory %s/ failed: %d\n", path, status);
+
+    fsw_shandle_close(&shand);
+    return entries;
+}
+
+static fsw_status_t lookup_path(const char *path, struct fsw_dnode **dno_out)
+{
+    struct fsw_string   lookup_path;
+
+    lookup_path.type = FSW_STRING_TYPE_ISO88591;
+    lookup_path.len  = strlen(path);
+    lookup_path.size = lookup_path.len;
+    lookup_path.data = (void *)path;
+    return fsw_dnode_lookup_path(pvol->vol->root, &lookup_path, '/', dno_out);
+}
+
+/**
+ * Read a whole file through fsw_shandle_read. Returns the number of bytes read.
+ */
+
+static fsw_u64 read_file(const char *path, void *buffer)
+{
+    struct fsw_dnode    *dno;
+    struct fsw_shandle  shand;
+    fsw_u32             buffer_size;
+    fsw_u64             total = 0;
+
+    if (lookup_path(path, &dno)) {
+        fprintf(stderr, "fsbench: %s: lookup failed\n", path);
+        return 0;
+    }
+    if (fsw_dnode_fill(dno) == FSW_SUCCESS && fsw_shandle_open(dno, &shand) == FSW_SUCCESS) {
+        do {
+            buffer_size = READ_BUFFER_SIZE;
+            if (fsw_shandle_read(&shand, &buffer_size, buffer)) {
+                fprintf(stderr, "fsbench: %s: read failed at %llu\n", path, (unsigned long long)shand.pos);
+                break;
+            }
+            total += buffer_size;
+        } while (buffer_size > 0);
+        fsw_shandle_close(&shand);
+    }
+    fsw_dnode_release(dno);
+    return total;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: fsbench [-n rounds] [-z seed[:rate]] <file/device> [file ...]\n"
+                    "  -n rounds   number of lookup rounds over all files (default 1)\n"
+                    "  -z seed     corrupt random bytes in blocks read, one block in rate (default 16)\n"
+                    "  file ...    files to read, default is every file found by the walk\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct fsw_volume_stats before, after, zero;
+    struct path_list    reads;
+    struct fsw_dnode    *dno;
+    fsw_u64             bytes;
+    double              start;
+    long                entries, found;
+    int                 rounds = 1, opt, i, r;
+    void                *buffer;
+
+    while ((opt = getopt(argc, argv, "n:z:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'z':
+                fuzz_rate = 16;
+                if (sscanf(optarg, "%u:%u", &fuzz_seed, &fuzz_rate) < 1 || fuzz_rate == 0)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    if (fuzz_rate) {
+        posix_read_block = fsw_posix_host_table.read_block;
+        posix_read_blocks = fsw_posix_host_table.read_blocks;
+        fsw_posix_host_table.read_block = fuzz_read_block;
+        fsw_posix_host_table.read_blocks = fuzz_read_blocks;
+    }
+
+    buffer = malloc(READ_BUFFER_SIZE);
+    if (buffer == NULL)
+        return 1;
+
+    printf("%-8s %10s %8s %10s %10s %10s %7s %8s %8s %12s\n",
+           "phase", "ms", "items", "KiB/s", "bc hits", "bc misses", "hit", "evict", "reads", "bytes");
+
+    // mount
+    memset(&zero, 0, sizeof(zero));
+    start = now_ms();
+    pvol = fsw_posix_mount(argv[optind], NULL);
+    if (pvol == NULL) {
+        fprintf(stderr, "Mounting failed.\n");
+        return fuzz_rate ? 0 : 1;
+    }
+    after = pvol->vol->stats;
+    report("mount", now_ms() - start, 1, 0, &zero, &after);
+
+    // directory walk
+    before = pvol->vol->stats;
+    start = now_ms();
+    entries = walk_dir(pvol->vol->root, "", 0);
+    after = pvol->vol->stats;
+    report("walk", now_ms() - start, entries, 0, &before, &after);
+
+    // path lookups of every file found
+    for (r = 0; r < rounds; r++) {
+        before = pvol->vol->stats;
+        start = now_ms();
+        found = 0;
+        for (i = 0; i < files.count; i++) {
+            if (lookup_path(files.paths[i], &dno) == FSW_SUCCESS) {
+                found++;
+                fsw_dnode_release(dno);
+            }
+        }
+        after = pvol->vol->stats;
+        report("lookup", now_ms() - start, found, 0, &before, &after);
+        if (found != files.count && !fuzz_rate)
+            fprintf(stderr, "fsbench: only %ld of %d files found again\n", found, files.count);
+    }
+
+    // full file reads
+    memset(&reads, 0, sizeof(reads));
+    for (i = optind + 1; i < argc; i++)
+        add_path(&reads, argv[i]);
+    if (reads.count == 0)
+        reads = files;
+    before = pvol->vol->stats;
+    start = now_ms();
+    bytes = 0;
+    for (i = 0; i < reads.count; i++)
+        bytes += read_file(reads.paths[i], buffer);
+    after = pvol->vol->stats;
+    report("read", now_ms() - start, reads.count, bytes, &before, &after);
+
+    fsw_posix_unmount(pvol);
+
+    if (reads.paths != files.paths) {
+        for (i = 0; i < reads.count; i++)
+            free(reads.paths[i]);
+        free(reads.paths);
+    }
+    for (i = 0; i < files.count; i++)
+        free(files.paths[i]);
+    free(files.paths);
+    free(buffer);
+    return 0;
+}
+
+// EOF
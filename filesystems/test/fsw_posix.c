@@ -52,7 +52,8 @@ fsw_status_t fsw_posix_open_dno(struct fsw_posix_volume *pvol, const char *path,
 void fsw_posix_change_blocksize(struct fsw_volume *vol,
                               fsw_u32 old_phys_blocksize, fsw_u32 old_log_blocksize,
                               fsw_u32 new_phys_blocksize, fsw_u32 new_log_blocksize);
-fsw_status_t fsw_posix_read_block(struct fsw_volume *vol, fsw_u32 phys_bno, void *buffer);
+fsw_status_t fsw_posix_read_block(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer);
+fsw_status_t fsw_posix_read_blocks(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer);
 
 /**
  * Dispatch table for our FSW host driver.
@@ -62,7 +63,8 @@ struct fsw_host_table   fsw_posix_host_table = {
     FSW_STRING_TYPE_ISO88591,
 
     fsw_posix_change_blocksize,
-    fsw_posix_read_block
+    fsw_posix_read_block,
+    fsw_posix_read_blocks
 };
 
 extern struct fsw_fstype_table   FSW_FSTYPE_TABLE_NAME(FSTYPE);
@@ -362,62 +364,76 @@ void fsw_posix_change_blocksize(struct fsw_volume *vol,
  * to read a block of data from the device. The buffer is allocated by the core code.
  */
 
-fsw_status_t fsw_posix_read_block(struct fsw_volume *vol, fsw_u32 phys_bno, void *buffer)
+fsw_status_t fsw_posix_read_block(struct fsw_volume *vol, fsw_u64 phys_bno, void *buffer)
+{
+    return fsw_posix_read_blocks(vol, phys_bno, 1, buffer);
+}
+
+/**
+ * FSW interface function to read a run of consecutive data blocks straight into
+ * a caller's buffer, bypassing the block cache.
+ */
+
+fsw_status_t fsw_posix_read_blocks(struct fsw_volume *vol, fsw_u64 phys_bno, fsw_u32 count, void *buffer)
 {
     struct fsw_posix_volume *pvol = (struct fsw_posix_volume *)vol->host_data;
-    off_t           block_offset, seek_result;
+    off_t           block_offset;
+    size_t          read_size;
     ssize_t         read_result;
 
-    FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_posix_read_block: %d  (%d)\n"), phys_bno, vol->phys_blocksize));
+    FSW_MSG_DEBUGV((FSW_MSGSTR("fsw_posix_read_blocks: %llu+%u  (%d)\n"),
+                    (unsigned long long)phys_bno, count, vol->phys_blocksize));
 
     // read from disk
     block_offset = (off_t)phys_bno * vol->phys_blocksize;
-    seek_result = lseek(pvol->fd, block_offset, SEEK_SET);
-    if (seek_result != block_offset)
-        return FSW_IO_ERROR;
-    read_result = read(pvol->fd, buffer, vol->phys_blocksize);
-    if (read_result != vol->phys_blocksize)
+    read_size = (size_t)count * vol->phys_blocksize;
+    read_result = pread(pvol->fd, buffer, read_size, block_offset);
+    if (read_result < 0 || (size_t)read_result != read_size)
         return FSW_IO_ERROR;
 
     return FSW_SUCCESS;
 }
 
-
 /**
- * Time mapping callback for the fsw_dnode_stat call. This function converts
- * a Posix style timestamp into an EFI_TIME structure and writes it to the
- * appropriate member of the EFI_FILE_INFO structure that we're filling.
+ * Time mapping callback for the fsw_dnode_stat call. Stores a Posix style
+ * timestamp into the struct stat passed as host data, if any.
  */
 
-/*
-static void fsw_posix_store_time_posix(struct fsw_dnode_stat *sb, int which, fsw_u32 posix_time)
+void fsw_store_time_posix(struct fsw_dnode_stat *sb, int which, fsw_u32 posix_time)
 {
-    EFI_FILE_INFO       *FileInfo = (EFI_FILE_INFO *)sb->host_data;
+    struct stat         *st = (struct stat *)sb->host_data;
 
+    if (st == NULL)
+        return;
     if (which == FSW_DNODE_STAT_CTIME)
-        fsw_posix_decode_time(&FileInfo->CreateTime,       posix_time);
+        st->st_ctime = posix_time;
     else if (which == FSW_DNODE_STAT_MTIME)
-        fsw_posix_decode_time(&FileInfo->ModificationTime, posix_time);
+        st->st_mtime = posix_time;
     else if (which == FSW_DNODE_STAT_ATIME)
-        fsw_posix_decode_time(&FileInfo->LastAccessTime,   posix_time);
+        st->st_atime = posix_time;
 }
-*/
 
 /**
- * Mode mapping callback for the fsw_dnode_stat call. This function looks at
- * the Posix mode passed by the file system driver and makes appropriate
- * adjustments to the EFI_FILE_INFO structure that we're filling.
+ * Mode mapping callbacks for the fsw_dnode_stat call. Posix permission bits are
+ * stored as they are, EFI attributes only carry the read-only flag over.
  */
 
-/*
-static void fsw_posix_store_attr_posix(struct fsw_dnode_stat *sb, fsw_u16 posix_mode)
+void fsw_store_attr_posix(struct fsw_dnode_stat *sb, fsw_u16 posix_mode)
 {
-    EFI_FILE_INFO       *FileInfo = (EFI_FILE_INFO *)sb->host_data;
+    struct stat         *st = (struct stat *)sb->host_data;
 
-    if ((posix_mode & S_IWUSR) == 0)
-        FileInfo->Attribute |= EFI_FILE_READ_ONLY;
+    if (st != NULL)
+        st->st_mode = (st->st_mode & S_IFMT) | (posix_mode & ~S_IFMT);
+}
+
+void fsw_store_attr_efi(struct fsw_dnode_stat *sb, fsw_u16 attr)
+{
+    struct stat         *st = (struct stat *)sb->host_data;
+
+    // EFI_FILE_READ_ONLY
+    if (st != NULL && (attr & 0x01))
+        st->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
 }
-*/
 
 /**
  * Common function to fill an EFI_FILE_INFO with information about a dnode.
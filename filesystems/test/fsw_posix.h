@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/dir.h>
+#include <sys/stat.h>
 
 
 /**
@@ -81,6 +82,8 @@ struct fsw_posix_dir {
 
 /* functions */
 
+extern struct fsw_host_table fsw_posix_host_table;
+
 struct fsw_posix_volume * fsw_posix_mount(const char *path, struct fsw_fstype_table *fstype_table);
 int fsw_posix_unmount(struct fsw_posix_volume *pvol);
 
@@ -87,4 +87,34 @@ typedef uint64_t            fsw_u64;
 #define RShiftU64(val, shift) ((val) >> (shift))
 #define LShiftU64(val, shift) ((val) << (shift))
 
+// EFI calling convention and the subset of the EFI library used by some drivers
+
+#define EFIAPI
+
+typedef uint8_t             BOOLEAN;
+typedef uintptr_t           UINTN;
+typedef intptr_t            INTN;
+typedef uint8_t             UINT8;
+typedef uint16_t            UINT16;
+typedef uint32_t            UINT32;
+typedef uint64_t            UINT64;
+typedef int32_t             INT32;
+typedef int64_t             INT64;
+
+#ifndef TRUE
+#define TRUE  (1)
+#define FALSE (0)
+#endif
+
+#define AllocatePool(size) malloc(size)
+#define AllocateZeroPool(size) calloc(1, size)
+#define FreePool(ptr) free(ptr)
+
+static inline UINT64 DivU64x32Remainder(UINT64 dividend, UINT32 divisor, void *remainder)
+{
+    if (remainder != NULL)
+        *(UINT32 *)remainder = (UINT32)(dividend % divisor);
+    return dividend / divisor;
+}
+
 #endif
@@ -43,6 +43,7 @@ extern struct fsw_fstype_table FSW_FSTYPE_TABLE_NAME(iso9660);
 extern struct fsw_fstype_table FSW_FSTYPE_TABLE_NAME(hfs);
 extern struct fsw_fstype_table FSW_FSTYPE_TABLE_NAME(ext2);
 extern struct fsw_fstype_table FSW_FSTYPE_TABLE_NAME(ext4);
+extern struct fsw_fstype_table FSW_FSTYPE_TABLE_NAME(FSTYPE);
 
 int main(int argc, char **argv)
 {
@@ -1855,6 +1855,7 @@ ZSTD_DStream *ZSTD_initDStream(size_t maxWindowSize, void *workspace, size_t wor
 	size_t const blockSize = MIN(zds->maxWindowSize, ZSTD_BLOCKSIZE_ABSOLUTEMAX);
 	size_t const neededOutSize = zds->maxWindowSize + blockSize + WILDCOPY_OVERLENGTH * 2;
 
+	zds->blockSize = blockSize; /* the flush stage wraps outBuff once less than a block is left */
 	zds->inBuff = ws->Buffer;
 	zds->inBuffSize = blockSize;
 	zds->outBuff = ws->Buffer + blockSize;
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Builds the zstd decoder into the including program: the btrfs driver
+ * (through fsw_btrfs_zstd.h) and rEFInd's loader decompression
+ * (gzip/decompress_zstd.c). The includer defines uint16_t, int16_t,
+ * uint32_t, uint64_t and uintptr_t if it lacks them, plus sys_memmove,
+ * memcpy and memset.
+ */
+
+#ifndef _ZSTD_LIB_H_
+#define _ZSTD_LIB_H_
+
+static inline uint16_t get_unaligned_le16(const void *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	return p[0]+ (p[1]<<8);
+}
+
+static inline uint32_t get_unaligned_le32(const void *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	return p[0]+ (p[1]<<8) + (p[2]<<16) + (p[3]<<24);
+}
+
+static inline uint64_t get_unaligned_le64(const void *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	uint64_t v0 = get_unaligned_le32(p);
+	uint64_t v1 = get_unaligned_le32(p+4);
+	return v0 + (v1<<32);
+}
+
+static inline void put_unaligned_le16(uint16_t v, void *s)
+{
+	unsigned char *p = (unsigned char *)s;
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+#define UP_U32(a)	(((a)+3) >> 2)
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#include "xxhash64.c"
+#include "zstd_decompress.c"
+#include "fse_decompress.c"
+#include "huf_decompress.c"
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * gzip/decompress.c
+ * Decompression of compressed loaders, using whichever decompressor
+ * recognizes the data
+ *
+ */
+
+/*
+ * This program is licensed under the terms of the GNU GPL, version 3,
+ * or (at your option) any later version.
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../refind/lib.h"
+#include "../refind/log.h"
+#include "../include/refit_call_wrapper.h"
+#include "decompress.h"
+
+#define DECOMPRESS_CHUNK_SIZE (1024*1024)
+
+static DECOMPRESSOR Decompressors[] = {
+    { L"gzip", { 0x1F, 0x8B, 0x08 },       3, GzipInit, GzipRun, GzipFree },
+    { L"zstd", { 0x28, 0xB5, 0x2F, 0xFD }, 4, ZstdInit, ZstdRun, ZstdFree },
+};
+
+// Returns the decompressor whose magic number starts Data, or NULL if none does.
+DECOMPRESSOR *FindDecompressor(IN UINT8 *Data, IN UINTN DataSize) {
+    UINTN i;
+
+    for (i = 0; i < sizeof(Decompressors) / sizeof(Decompressors[0]); i++) {
+        if ((DataSize >= Decompressors[i].MagicSize) &&
+            (CompareMem(Data, Decompressors[i].Magic, Decompressors[i].MagicSize) == 0))
+            return &Decompressors[i];
+    } // for
+    return NULL;
+} // DECOMPRESSOR *FindDecompressor()
+
+/*
+ * Load the compressed file FileName from BaseDir and decompress it into a
+ * buffer allocated here, which the caller frees with MyFreePool(). The file
+ * is read DECOMPRESS_CHUNK_SIZE bytes at a time and each chunk is
+ * handed to the decompressor as soon as it has been read, so the compressed
+ * file needn't be held in memory as a whole (only the zstd decoder collects
+ * it, for frames it decodes in one call). The output buffer is sized from the
+ * decompressor's size hint, or at four times the file size if there's none
+ * or it can't be allocated, and grows as needed.
+ */
+EFI_STATUS DecompressFile(IN EFI_FILE_PROTOCOL *BaseDir, IN CHAR16 *FileName,
+                          OUT UINT8 **FileData, OUT UINTN *FileDataLength) {
+    EFI_STATUS          Status;
+    EFI_FILE_HANDLE     FileHandle;
+    EFI_FILE_INFO       *FileInfo;
+    UINT64              FileSize;
+    UINT8               Tail[DECOMPRESS_TAIL_SIZE];
+    UINTN               ReadSize, BufSize, NewSize, Done, InSize, OutSize;
+    UINT8               *InBuf = NULL, *Buf = NULL, *NewBuf, *In, *Out;
+    DECOMPRESSOR        *Decompressor = NULL;
+    VOID                *State = NULL;
+    BOOLEAN             Eof = FALSE;
+
+    if ((BaseDir == NULL) || (FileName == NULL))
+        return EFI_NOT_FOUND;
+
+    Status = refit_call5_wrapper(BaseDir->Open, BaseDir, &FileHandle, FileName, EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    FileInfo = LibFileInfo(FileHandle);
+    if (FileInfo == NULL) {
+        refit_call1_wrapper(FileHandle->Close, FileHandle);
+        return EFI_NOT_FOUND;
+    }
+    FileSize = FileInfo->FileSize;
+    FreePool(FileInfo);
+    if (FileSize < DECOMPRESS_TAIL_SIZE) {
+        refit_call1_wrapper(FileHandle->Close, FileHandle);
+        return EFI_LOAD_ERROR;
+    }
+
+    ReadSize = DECOMPRESS_TAIL_SIZE;
+    Status = refit_call2_wrapper(FileHandle->SetPosition, FileHandle, FileSize - DECOMPRESS_TAIL_SIZE);
+    if (!EFI_ERROR(Status))
+        Status = refit_call3_wrapper(FileHandle->Read, FileHandle, &ReadSize, Tail);
+    if (!EFI_ERROR(Status))
+        Status = refit_call2_wrapper(FileHandle->SetPosition, FileHandle, 0);
+    if (EFI_ERROR(Status)) {
+        refit_call1_wrapper(FileHandle->Close, FileHandle);
+        return Status;
+    }
+
+    Status = EFI_OUT_OF_RESOURCES;
+    InBuf = AllocatePool(DECOMPRESS_CHUNK_SIZE);
+    if (!InBuf)
+        goto out;
+
+    Status = EFI_LOAD_ERROR;
+    InSize = DECOMPRESS_CHUNK_SIZE;
+    if (EFI_ERROR(refit_call3_wrapper(FileHandle->Read, FileHandle, &InSize, InBuf)))
+        goto out;
+    Decompressor = FindDecompressor(InBuf, InSize);
+    if (Decompressor == NULL) {
+        LOG(1, LOG_LINE_NORMAL, L"'%s' is not in a known compressed format", FileName);
+        goto out;
+    }
+    State = Decompressor->Init(InBuf, InSize, Tail, FileSize, &BufSize);
+    if (State == NULL) {
+        LOG(1, LOG_LINE_NORMAL, L"Could not start %s decompression of '%s'", Decompressor->Name, FileName);
+        goto out;
+    }
+    if (BufSize != 0) {
+        Buf = AllocatePool(BufSize);
+        if (!Buf)
+            LOG(1, LOG_LINE_NORMAL, L"Could not allocate %d bytes for '%s', growing the buffer instead",
+                BufSize, FileName);
+    }
+    if (!Buf) {
+        BufSize = (UINTN) FileSize * 4;
+        Buf = AllocatePool(BufSize);
+    }
+    if (!Buf) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto out;
+    }
+    In = InBuf;
+    Out = Buf;
+    OutSize = BufSize;
+
+    for (;;) {
+        if (InSize == 0 && !Eof) {
+            InSize = DECOMPRESS_CHUNK_SIZE;
+            if (EFI_ERROR(refit_call3_wrapper(FileHandle->Read, FileHandle, &InSize, InBuf))) {
+                LOG(1, LOG_LINE_NORMAL, L"Read error in '%s'", FileName);
+                goto out;
+            }
+            Eof = (InSize == 0);
+            In = InBuf;
+        }
+
+        ReadSize = InSize;
+        Done = OutSize;
+        Status = Decompressor->Run(State, &In, &InSize, &Out, &OutSize);
+        if (Status == EFI_SUCCESS)
+            break;
+        if (Status != EFI_NOT_READY) {
+            LOG(1, LOG_LINE_NORMAL, L"Decompression of '%s' failed", FileName);
+            goto out;
+        }
+        Status = EFI_LOAD_ERROR;
+        if (OutSize == 0) {
+            // The output doesn't fit, make room for half as much again.
+            Done = BufSize;
+            NewSize = BufSize + BufSize / 2;
+            NewBuf = AllocatePool(NewSize);
+            if (!NewBuf) {
+                Status = EFI_OUT_OF_RESOURCES;
+                goto out;
+            }
+            CopyMem(NewBuf, Buf, Done);
+            MyFreePool(Buf);
+            Buf = NewBuf;
+            BufSize = NewSize;
+            Out = Buf + Done;
+            OutSize = BufSize - Done;
+        } else if ((InSize == ReadSize) && (OutSize == Done) && (InSize != 0 || Eof)) {
+            // No progress although there was room on both sides, or the file ran out.
+            LOG(1, LOG_LINE_NORMAL, L"'%s' is truncated or corrupt", FileName);
+            goto out;
+        }
+    } // for
+
+    *FileData = Buf;
+    *FileDataLength = Out - Buf;
+    Buf = NULL;
+    Status = EFI_SUCCESS;
+
+out:
+    refit_call1_wrapper(FileHandle->Close, FileHandle);
+    if (State)
+        Decompressor->Free(State);
+    MyFreePool(Buf);
+    MyFreePool(InBuf);
+    return Status;
+} // EFI_STATUS DecompressFile()
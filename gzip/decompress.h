@@ -0,0 +1,56 @@
+/*
+ * gzip/decompress.h
+ * The decompressors rEFInd can apply to compressed loaders
+ *
+ */
+
+/*
+ * This program is licensed under the terms of the GNU GPL, version 3,
+ * or (at your option) any later version.
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DECOMPRESS_H_
+#define __DECOMPRESS_H_
+
+// Bytes from the end of a compressed file passed to a decompressor's Init()
+#define DECOMPRESS_TAIL_SIZE 8
+
+// A streaming decompressor, recognized by the magic number at the start of
+// the data. Init() sees the first chunk of the file (Head) and its last
+// DECOMPRESS_TAIL_SIZE bytes (Tail). It returns the decompressor's state,
+// or NULL on failure, and sets *SizeHint to the expected size of the
+// decompressed data, or to 0 if that isn't known. Run() consumes input from
+// *In and writes output to *Out, advancing both and reducing *InSize and
+// *OutSize to match. It returns EFI_SUCCESS at the end of the data,
+// EFI_NOT_READY when it needs more input or room for more output, or an
+// error if the data is corrupt. Free() releases the state.
+typedef struct {
+    CHAR16      *Name;
+    UINT8       Magic[4];
+    UINTN       MagicSize;
+    VOID        *(*Init)(IN UINT8 *Head, IN UINTN HeadSize, IN UINT8 *Tail, IN UINT64 FileSize,
+                         OUT UINTN *SizeHint);
+    EFI_STATUS  (*Run)(IN VOID *State, IN OUT UINT8 **In, IN OUT UINTN *InSize,
+                       IN OUT UINT8 **Out, IN OUT UINTN *OutSize);
+    VOID        (*Free)(IN VOID *State);
+} DECOMPRESSOR;
+
+DECOMPRESSOR *FindDecompressor(IN UINT8 *Data, IN UINTN DataSize);
+EFI_STATUS DecompressFile(IN EFI_FILE_PROTOCOL *BaseDir, IN CHAR16 *FileName,
+                          OUT UINT8 **FileData, OUT UINTN *FileDataLength);
+
+// decompress_inflate.c
+VOID *GzipInit(IN UINT8 *Head, IN UINTN HeadSize, IN UINT8 *Tail, IN UINT64 FileSize, OUT UINTN *SizeHint);
+EFI_STATUS GzipRun(IN VOID *State, IN OUT UINT8 **In, IN OUT UINTN *InSize, IN OUT UINT8 **Out, IN OUT UINTN *OutSize);
+VOID GzipFree(IN VOID *State);
+
+// decompress_zstd.c
+VOID *ZstdInit(IN UINT8 *Head, IN UINTN HeadSize, IN UINT8 *Tail, IN UINT64 FileSize, OUT UINTN *SizeHint);
+EFI_STATUS ZstdRun(IN VOID *State, IN OUT UINT8 **In, IN OUT UINTN *InSize, IN OUT UINT8 **Out, IN OUT UINTN *OutSize);
+VOID ZstdFree(IN VOID *State);
+
+#endif
+
+/* EOF */
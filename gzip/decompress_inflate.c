@@ -9,176 +9,168 @@
 #include "../refind/lib.h"
 #include "../libeg/lodepng.h"
 #include "../refind/log.h"
-
-#define malloc AllocatePool
-#define free MyFreePool
+#include "../refind/crc32.h"
+#include "decompress.h"
 
 #include "zlib_inflate/inftrees.c"
 #include "zlib_inflate/inffast.c"
 #include "zlib_inflate/inflate.c"
 
-#define GZIP_IOBUF_SIZE (16*1024)
-
 #define u8 UINT8
 
-static long nofill(void *buffer, unsigned long len)
+/*
+ * Return the length of the gzip member header at the start of buf, or -1 if
+ * buf doesn't start with a complete gzip header.
+ */
+static long gzip_header_size(const u8 *buf, long len)
 {
-    return -1;
-}
-
-/* Included from initramfs et al code */
-int gunzip(unsigned char *buf, long len,
-               long (*fill)(void*, unsigned long),
-               long (*flush)(void*, unsigned long),
-               unsigned char *out_buf, long out_len,
-               long *pos) {
-    u8 *zbuf;
-    struct z_stream_s *strm;
-    int rc;
-
-    rc = -1;
-    if (flush) {
-        out_len = 0x8000; /* 32 K */
-        out_buf = malloc(out_len);
-    } else {
-        if (!out_len)
-            out_len = ((size_t)~0) - (size_t)out_buf; /* no limit */
+    long pos = 10;
+    u8 flags;
+
+    if (len < 10 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 0x08)
+        return -1;
+    flags = buf[3];
+    if (flags & 0xe0)           /* reserved */
+        return -1;
+    if (flags & 0x04) {         /* FEXTRA */
+        if (len < pos + 2)
+            return -1;
+        pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
     }
-    if (!out_buf) {
-        LOG(1, LOG_LINE_NORMAL, L"Out of memory while allocating output buffer");
-        goto gunzip_nomem1;
+    if (flags & 0x08) {         /* FNAME */
+        while (pos < len && buf[pos])
+            pos++;
+        pos++;
     }
-
-    if (buf)
-        zbuf = buf;
-    else {
-        zbuf = malloc(GZIP_IOBUF_SIZE);
-        len = 0;
-    }
-    if (!zbuf) {
-        LOG(1, LOG_LINE_NORMAL, L"Out of memory while allocating input buffer");
-        goto gunzip_nomem2;
-    }
-
-    strm = malloc(sizeof(*strm));
-    if (strm == NULL) {
-        LOG(1, LOG_LINE_NORMAL, L"Out of memory while allocating z_stream");
-        goto gunzip_nomem3;
+    if (flags & 0x10) {         /* FCOMMENT */
+        while (pos < len && buf[pos])
+            pos++;
+        pos++;
     }
+    if (flags & 0x02)           /* FHCRC */
+        pos += 2;
+    return pos <= len ? pos : -1;
+}
 
-    strm->workspace = malloc(flush ? zlib_inflate_workspacesize() :
-#ifdef CONFIG_ZLIB_DFLTCC
-    /* Always allocate the full workspace for DFLTCC */
-                 zlib_inflate_workspacesize());
-#else
-                 sizeof(struct inflate_state));
-#endif
-    if (strm->workspace == NULL) {
-        LOG(1, LOG_LINE_NORMAL, L"Out of memory while allocating workspace");
-        goto gunzip_nomem4;
-    }
+typedef struct {
+    struct z_stream_s   Strm;
+    long                HeaderSize;
+    UINT32              Crc;            // of the output so far
+    BOOLEAN             StreamEnd;      // inflate is done, the trailer follows
+    UINT8               Trailer[8];     // CRC32 and ISIZE of the member
+    UINTN               TrailerLen;
+} GZIP_STATE;
 
-    if (!fill)
-        fill = nofill;
+VOID GzipFree(IN VOID *State)
+{
+    GZIP_STATE *Gzip = (GZIP_STATE *) State;
 
-    if (len == 0)
-        len = fill(zbuf, GZIP_IOBUF_SIZE);
+    if (Gzip) {
+        MyFreePool(Gzip->Strm.workspace);
+        MyFreePool(Gzip);
+    }
+}
 
-    /* verify the gzip header */
-    if (len < 10 ||
-       zbuf[0] != 0x1f || zbuf[1] != 0x8b || zbuf[2] != 0x08) {
-        if (pos)
-            *pos = 0;
-        LOG(1, LOG_LINE_NORMAL, L"Not a gzip file");
-        goto gunzip_5;
+// The last four bytes of a gzip file hold the uncompressed size, modulo 2^32.
+// It's passed on as the size hint when it's plausible; it's too small if
+// something follows the gzip data. Only the first gzip member is read.
+VOID *GzipInit(IN UINT8 *Head, IN UINTN HeadSize, IN UINT8 *Tail, IN UINT64 FileSize, OUT UINTN *SizeHint)
+{
+    GZIP_STATE *Gzip;
+    UINT32     ISize;
+
+    if (FileSize < 18)      // header and trailer alone take 18 bytes
+        return NULL;
+    Gzip = AllocateZeroPool(sizeof(GZIP_STATE));
+    if (Gzip == NULL)
+        return NULL;
+    Gzip->HeaderSize = gzip_header_size(Head, HeadSize);
+    if (Gzip->HeaderSize < 0) {
+        LOG(1, LOG_LINE_NORMAL, L"No valid gzip header");
+        GzipFree(Gzip);
+        return NULL;
+    }
+    Gzip->Strm.workspace = AllocatePool(zlib_inflate_workspacesize());
+    if (!Gzip->Strm.workspace || zlib_inflateInit2(&Gzip->Strm, -MAX_WBITS) != Z_OK) {
+        GzipFree(Gzip);
+        return NULL;
     }
 
-    /* skip over gzip header (1f,8b,08... 10 bytes total +
-     * possible asciz filename)
-     */
-    strm->next_in = zbuf + 10;
-    strm->avail_in = len - 10;
-    /* skip over asciz filename */
-    if (zbuf[3] & 0x8) {
-        do {
-            /*
-             * If the filename doesn't fit into the buffer,
-             * the file is very probably corrupt. Don't try
-             * to read more data.
-             */
-            if (strm->avail_in == 0) {
-                LOG(1, LOG_LINE_NORMAL, L"header error");
-                goto gunzip_5;
-            }
-            --strm->avail_in;
-        } while (*strm->next_in++);
+    ISize = Tail[DECOMPRESS_TAIL_SIZE - 4] | (Tail[DECOMPRESS_TAIL_SIZE - 3] << 8) |
+            (Tail[DECOMPRESS_TAIL_SIZE - 2] << 16) | ((UINT32) Tail[DECOMPRESS_TAIL_SIZE - 1] << 24);
+    // deflate barely expands incompressible data, and kernels and initrds rarely
+    // compress better than 10:1. Trailing bytes make ISize garbage, so anything
+    // outside that range is ignored and the output buffer grows as needed instead.
+    if ((ISize >= FileSize / 2) && (ISize / 16 <= FileSize)) {
+        *SizeHint = ISize;
+    } else {
+        LOG(1, LOG_LINE_NORMAL, L"Ignoring implausible gzip size %d", (UINTN) ISize);
+        *SizeHint = 0;
     }
+    return Gzip;
+}
 
-    strm->next_out = out_buf;
-    strm->avail_out = out_len;
+// The member's own trailer follows the deflate data and may be split across
+// reads, so it's collected before the output is checked against it.
+EFI_STATUS GzipRun(IN VOID *State, IN OUT UINT8 **In, IN OUT UINTN *InSize, IN OUT UINT8 **Out, IN OUT UINTN *OutSize)
+{
+    GZIP_STATE  *Gzip = (GZIP_STATE *) State;
+    UINT8       *Start = *Out;
+    UINTN       Size;
+    UINT32      Crc, ISize;
+    int         rc;
+
+    // The first call starts at the header that GzipInit() measured.
+    if (Gzip->HeaderSize) {
+        *In += Gzip->HeaderSize;
+        *InSize -= Gzip->HeaderSize;
+        Gzip->HeaderSize = 0;
+    }
 
-    rc = zlib_inflateInit2(strm, -MAX_WBITS);
+    if (!Gzip->StreamEnd) {
+        Gzip->Strm.next_in = *In;
+        Gzip->Strm.avail_in = *InSize;
+        Gzip->Strm.next_out = *Out;
+        Gzip->Strm.avail_out = *OutSize;
 
-#ifdef CONFIG_ZLIB_DFLTCC
-    /* Always keep the window for DFLTCC */
-#else
-    if (!flush) {
-        WS(strm)->inflate_state.wsize = 0;
-        WS(strm)->inflate_state.window = NULL;
-    }
-#endif
-
-    while (rc == Z_OK) {
-        if (strm->avail_in == 0) {
-            /* TODO: handle case where both pos and fill are set */
-            len = fill(zbuf, GZIP_IOBUF_SIZE);
-            if (len < 0) {
-                rc = -1;
-                LOG(1, LOG_LINE_NORMAL, L"read error");
-                break;
-            }
-            strm->next_in = zbuf;
-            strm->avail_in = len;
-        }
-        rc = zlib_inflate(strm, 0);
-
-        /* Write any data generated */
-        if (flush && strm->next_out > out_buf) {
-            long l = strm->next_out - out_buf;
-            if (l != flush(out_buf, l)) {
-                rc = -1;
-                LOG(1, LOG_LINE_NORMAL, L"write error");
-                break;
-            }
-            strm->next_out = out_buf;
-            strm->avail_out = out_len;
-        }
+        rc = zlib_inflate(&Gzip->Strm, Z_SYNC_FLUSH);
 
-        /* after Z_FINISH, only Z_STREAM_END is "we unpacked it all" */
+        *In = (UINT8 *) Gzip->Strm.next_in;
+        *InSize = Gzip->Strm.avail_in;
+        *Out = Gzip->Strm.next_out;
+        *OutSize = Gzip->Strm.avail_out;
+        Gzip->Crc = crc32(Gzip->Crc, Start, *Out - Start);
         if (rc == Z_STREAM_END) {
-            rc = 0;
-            break;
-        } else if (rc != Z_OK) {
-            LOG(1, LOG_LINE_NORMAL, L"uncompression error");
-            rc = -1;
+            Gzip->StreamEnd = TRUE;
+        } else if (rc == Z_OK || rc == Z_BUF_ERROR) {
+            // Z_BUF_ERROR only means that no progress was possible.
+            return EFI_NOT_READY;
+        } else {
+            LOG(1, LOG_LINE_NORMAL, L"Decompression error %d", rc);
+            return EFI_LOAD_ERROR;
         }
     }
 
-    zlib_inflateEnd(strm);
-    if (pos)
-        /* add + 8 to skip over trailer */
-        *pos = strm->next_in - zbuf+8;
-
-gunzip_5:
-    free(strm->workspace);
-gunzip_nomem4:
-    free(strm);
-gunzip_nomem3:
-    if (!buf)
-        free(zbuf);
-gunzip_nomem2:
-    if (flush)
-        free(out_buf);
-gunzip_nomem1:
-    return rc; /* returns Z_OK (0) if successful */
+    Size = sizeof(Gzip->Trailer) - Gzip->TrailerLen;
+    if (Size > *InSize)
+        Size = *InSize;
+    CopyMem(Gzip->Trailer + Gzip->TrailerLen, *In, Size);
+    Gzip->TrailerLen += Size;
+    *In += Size;
+    *InSize -= Size;
+    if (Gzip->TrailerLen < sizeof(Gzip->Trailer))
+        return EFI_NOT_READY;
+
+    Crc = Gzip->Trailer[0] | (Gzip->Trailer[1] << 8) | (Gzip->Trailer[2] << 16) | ((UINT32) Gzip->Trailer[3] << 24);
+    ISize = Gzip->Trailer[4] | (Gzip->Trailer[5] << 8) | (Gzip->Trailer[6] << 16) | ((UINT32) Gzip->Trailer[7] << 24);
+    if ((UINT32) Gzip->Strm.total_out != ISize) {
+        LOG(1, LOG_LINE_NORMAL, L"Decompressed to %d bytes, gzip trailer says %d",
+            (UINTN) Gzip->Strm.total_out, (UINTN) ISize);
+        return EFI_LOAD_ERROR;
+    }
+    if (Gzip->Crc != Crc) {
+        LOG(1, LOG_LINE_NORMAL, L"gzip CRC mismatch");
+        return EFI_LOAD_ERROR;
+    }
+    return EFI_SUCCESS;
 }
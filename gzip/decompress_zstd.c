@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * zstd uncompression support for rEFInd, using the zstd decoder that the
+ * btrfs driver also uses (../filesystems/zstd).
+ *
+ */
+
+#include "../refind/lib.h"
+#include "../libeg/lodepng.h"
+#include "../refind/log.h"
+#include "decompress.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define sys_memmove(d, s, n) CopyMem(d, s, n)
+
+// zstd_internal.h brings its own
+#undef MIN
+#undef MAX
+
+#include "../filesystems/zstd/zstd_lib.h"
+
+typedef struct {
+    ZSTD_DStream    *Stream;
+    VOID            *Workspace;
+    ZSTD_DCtx       *DCtx;          // set when the whole frame is decoded in one call
+    UINT8           *Input;
+    UINTN           InputSize, InputLen, ContentSize;
+} ZSTD_STATE;
+
+VOID ZstdFree(IN VOID *State)
+{
+    ZSTD_STATE *Zstd = (ZSTD_STATE *) State;
+
+    if (Zstd) {
+        MyFreePool(Zstd->Workspace);
+        MyFreePool(Zstd->Input);
+        MyFreePool(Zstd);
+    }
+}
+
+// A frame that records its content size (which every single-segment frame
+// does) is decoded in one call straight into the output buffer, which
+// DecompressFile sizes from the hint; that needs only a decoding context and
+// the compressed file. Other frames are streamed, and the decoder then keeps
+// a window as large as the one the frame header asks for, so the workspace
+// is sized from that header.
+VOID *ZstdInit(IN UINT8 *Head, IN UINTN HeadSize, IN UINT8 *Tail, IN UINT64 FileSize, OUT UINTN *SizeHint)
+{
+    ZSTD_frameParams    Params;
+    ZSTD_STATE          *Zstd;
+    size_t              WorkspaceSize, rc;
+
+    rc = ZSTD_getFrameParams(&Params, Head, HeadSize);
+    if (ZSTD_isError(rc) || (rc != 0)) {
+        LOG(1, LOG_LINE_NORMAL, L"No usable zstd frame header");
+        return NULL;
+    }
+
+    Zstd = AllocateZeroPool(sizeof(ZSTD_STATE));
+    if (Zstd == NULL)
+        return NULL;
+
+    // frameContentSize is 0 when the compressor didn't record it.
+    if ((Params.frameContentSize != 0) && (Params.frameContentSize == (UINTN) Params.frameContentSize) &&
+        (FileSize == (UINTN) FileSize)) {
+        Zstd->Workspace = AllocatePool(sizeof(ZSTD_DCtx));
+        Zstd->Input = AllocatePool((UINTN) FileSize);
+        if ((Zstd->Workspace == NULL) || (Zstd->Input == NULL)) {
+            ZstdFree(Zstd);
+            return NULL;
+        }
+        Zstd->DCtx = (ZSTD_DCtx *) Zstd->Workspace;
+        Zstd->InputSize = (UINTN) FileSize;
+        Zstd->ContentSize = (UINTN) Params.frameContentSize;
+        *SizeHint = Zstd->ContentSize;
+        return Zstd;
+    }
+
+    // A single-segment frame's window is its content size, which may be tiny.
+    if (Params.windowSize < (1U << ZSTD_WINDOWLOG_ABSOLUTEMIN))
+        Params.windowSize = 1U << ZSTD_WINDOWLOG_ABSOLUTEMIN;
+    if (Params.windowSize > (1U << ZSTD_WINDOWLOG_MAX)) {
+        LOG(1, LOG_LINE_NORMAL, L"zstd window of %d bytes is too large", (UINTN) Params.windowSize);
+        ZstdFree(Zstd);
+        return NULL;
+    }
+    WorkspaceSize = ZSTD_DStreamWorkspaceBound(Params.windowSize);
+    Zstd->Workspace = AllocatePool(WorkspaceSize);
+    if (Zstd->Workspace)
+        Zstd->Stream = ZSTD_initDStream(Params.windowSize, Zstd->Workspace, WorkspaceSize);
+    if (Zstd->Stream == NULL) {
+        ZstdFree(Zstd);
+        return NULL;
+    }
+
+    *SizeHint = 0;
+    return Zstd;
+}
+
+// Collects the whole compressed file, then decodes its first frame into Out.
+static EFI_STATUS ZstdRunOnce(IN ZSTD_STATE *Zstd, IN OUT UINT8 **In, IN OUT UINTN *InSize, IN OUT UINT8 **Out, IN OUT UINTN *OutSize)
+{
+    UINTN   Size;
+    size_t  rc;
+
+    Size = Zstd->InputSize - Zstd->InputLen;
+    if (Size > *InSize)
+        Size = *InSize;
+    CopyMem(Zstd->Input + Zstd->InputLen, *In, Size);
+    Zstd->InputLen += Size;
+    *In += Size;
+    *InSize -= Size;
+    if (Zstd->InputLen < Zstd->InputSize)
+        return EFI_NOT_READY;
+
+    if (*OutSize < Zstd->ContentSize) {
+        LOG(1, LOG_LINE_NORMAL, L"No room for %d bytes of zstd output", Zstd->ContentSize);
+        return EFI_LOAD_ERROR;
+    }
+    rc = ZSTD_findFrameCompressedSize(Zstd->Input, Zstd->InputLen);
+    if (!ZSTD_isError(rc))
+        rc = ZSTD_decompressMultiFrame(Zstd->DCtx, *Out, *OutSize, Zstd->Input, rc, NULL, 0);
+    if (ZSTD_isError(rc)) {
+        LOG(1, LOG_LINE_NORMAL, L"zstd decompression error %d", (UINTN) ZSTD_getErrorCode(rc));
+        return EFI_LOAD_ERROR;
+    }
+    *Out += rc;
+    *OutSize -= rc;
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS ZstdRun(IN VOID *State, IN OUT UINT8 **In, IN OUT UINTN *InSize, IN OUT UINT8 **Out, IN OUT UINTN *OutSize)
+{
+    ZSTD_STATE      *Zstd = (ZSTD_STATE *) State;
+    ZSTD_inBuffer   InBuf;
+    ZSTD_outBuffer  OutBuf;
+    size_t          rc;
+
+    if (Zstd->DCtx)
+        return ZstdRunOnce(Zstd, In, InSize, Out, OutSize);
+
+    InBuf.src = *In;
+    InBuf.size = *InSize;
+    InBuf.pos = 0;
+    OutBuf.dst = *Out;
+    OutBuf.size = *OutSize;
+    OutBuf.pos = 0;
+
+    rc = ZSTD_decompressStream(Zstd->Stream, &OutBuf, &InBuf);
+
+    *In += InBuf.pos;
+    *InSize -= InBuf.pos;
+    *Out += OutBuf.pos;
+    *OutSize -= OutBuf.pos;
+    if (ZSTD_isError(rc)) {
+        LOG(1, LOG_LINE_NORMAL, L"zstd decompression error %d", (UINTN) ZSTD_getErrorCode(rc));
+        return EFI_LOAD_ERROR;
+    }
+    return (rc == 0) ? EFI_SUCCESS : EFI_NOT_READY;
+}
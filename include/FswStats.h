@@ -0,0 +1,70 @@
+/*
+ * include/FswStats.h
+ *
+ * Driver-private protocol installed by rEFInd's file system drivers on every
+ * volume handle they mount. It reports the driver's I/O statistics for that
+ * volume, so that rEFInd can log them.
+ *
+ */
+
+/*
+ * This program is licensed under the terms of the GNU GPL, version 3,
+ * or (at your option) any later version.
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REFIND_FSW_STATS_H
+#define _REFIND_FSW_STATS_H
+
+//
+// {6E1B1D64-6C1F-4B5A-9E0D-2C3A8F4B7D15}
+#define REFIND_FSW_STATS_PROTOCOL_GUID \
+  { \
+    0x6e1b1d64, 0x6c1f, 0x4b5a, { 0x9e, 0x0d, 0x2c, 0x3a, 0x8f, 0x4b, 0x7d, 0x15 } \
+  }
+
+#define REFIND_FSW_STATS_PROTOCOL_REVISION  0x00000001
+
+//
+// Statistics of one volume, counted since it was mounted. New fields are
+// only ever appended, so older callers keep working.
+//
+typedef struct {
+  CHAR16    FsName[16];             // file system type, e.g. L"ext4"
+  // FSW core
+  UINT64    BlockCacheHits;         // fsw_block_get calls served from the block cache
+  UINT64    BlockCacheMisses;       // fsw_block_get calls that had to read the block
+  UINT64    BlockCacheEvictions;    // block cache entries reused for a different block
+  UINT64    ReadCalls;              // block read requests passed to the EFI host
+  UINT64    ReadBytes;              // bytes requested by those reads
+  UINT64    GetExtentCalls;         // extent lookups in the file system driver
+  UINT64    DnodeCreates;           // file system objects instantiated
+  UINT64    LookupCacheHits;        // directory lookups answered by the lookup cache
+  UINT64    LookupCacheMisses;      // directory lookups passed on to the driver
+  // EFI host
+  UINT64    DiskCacheHits;          // block reads served from the read-ahead caches
+  UINT64    DiskReads;              // DiskIo->ReadDisk calls
+  UINT64    DiskReadBytes;          // bytes read by those calls
+} REFIND_FSW_STATS;
+
+typedef struct _REFIND_FSW_STATS_PROTOCOL REFIND_FSW_STATS_PROTOCOL;
+
+//
+// Copy the volume's statistics to Stats. On input, *StatsSize is the size of
+// the caller's buffer; on output, the number of bytes filled in.
+//
+typedef
+EFI_STATUS
+(EFIAPI *REFIND_FSW_STATS_GET) (
+  IN REFIND_FSW_STATS_PROTOCOL      *This,
+  IN OUT UINTN                      *StatsSize,
+  OUT REFIND_FSW_STATS              *Stats
+  );
+
+struct _REFIND_FSW_STATS_PROTOCOL {
+  UINT32                    Revision;
+  REFIND_FSW_STATS_GET      GetStats;
+};
+
+#endif
@@ -76,6 +76,7 @@
 #include "launch_efi.h"
 #include "log.h"
 #include "../include/refit_call_wrapper.h"
+#include "../include/FswStats.h"
 
 #if defined (EFIX64)
 #define DRIVER_DIRS             L"drivers,drivers_x64"
@@ -97,6 +98,7 @@ EFI_GUID gMyEfiDevicePathProtocolGuid = { 0x09576E91, 0x6D3F, 0x11D2, { 0x8E, 0x
 EFI_GUID gMyEfiDiskIoProtocolGuid = { 0xCE345171, 0xBA0B, 0x11D2, { 0x8E, 0x4F, 0x00, 0xA0, 0xC9, 0x69, 0x72, 0x3B }};
 EFI_GUID gMyEfiBlockIoProtocolGuid = { 0x964E5B21, 0x6459, 0x11D2, { 0x8E, 0x39, 0x00, 0xA0, 0xC9, 0x69, 0x72, 0x3B }};
 EFI_GUID gMyEfiSimpleFileSystemProtocolGuid = { 0x964E5B22, 0x6459, 0x11D2, { 0x8E, 0x39, 0x00, 0xA0, 0xC9, 0x69, 0x72, 0x3B }};
+static EFI_GUID RefindFswStatsProtocolGuid = REFIND_FSW_STATS_PROTOCOL_GUID;
 
 #ifdef __MAKEWITH_GNUEFI
 struct MY_EFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
@@ -606,3 +608,55 @@ BOOLEAN LoadDrivers(VOID) {
         ConnectAllDriversToAllControllers();
     return (NumFound > 0);
 } /* BOOLEAN LoadDrivers() */
+
+// Write the I/O statistics of every volume mounted by one of rEFInd's own
+// filesystem drivers to the log, so that slow boots can be traced to a
+// driver or cache. Only does anything at log level 2 or above.
+VOID LogFilesystemDriverStats(VOID) {
+    EFI_STATUS                  Status;
+    UINTN                       HandleCount = 0, Index, VolIndex, StatsSize;
+    EFI_HANDLE                  *Handles = NULL;
+    REFIND_FSW_STATS_PROTOCOL   *StatsProtocol;
+    REFIND_FSW_STATS            Stats;
+    CHAR16                      *VolName;
+
+    if (GlobalConfig.LogLevel < 2)
+        return;
+
+    Status = refit_call5_wrapper(gBS->LocateHandleBuffer, ByProtocol, &RefindFswStatsProtocolGuid, NULL,
+                                 &HandleCount, &Handles);
+    if (EFI_ERROR(Status) || HandleCount == 0)
+        return;
+
+    LOG(2, LOG_LINE_THIN_SEP, L"Filesystem driver I/O statistics");
+    for (Index = 0; Index < HandleCount; Index++) {
+        Status = refit_call3_wrapper(gBS->HandleProtocol, Handles[Index], &RefindFswStatsProtocolGuid,
+                                     (VOID **) &StatsProtocol);
+        if (EFI_ERROR(Status))
+            continue;
+        ZeroMem(&Stats, sizeof(Stats));
+        StatsSize = sizeof(Stats);
+        Status = refit_call3_wrapper(StatsProtocol->GetStats, StatsProtocol, &StatsSize, &Stats);
+        if (EFI_ERROR(Status))
+            continue;
+
+        VolName = L"(unknown volume)";
+        for (VolIndex = 0; VolIndex < VolumesCount; VolIndex++) {
+            if (Volumes[VolIndex]->DeviceHandle == Handles[Index] && Volumes[VolIndex]->VolName) {
+                VolName = Volumes[VolIndex]->VolName;
+                break;
+            }
+        }
+        LOG(2, LOG_LINE_NORMAL, L"%s on '%s':", Stats.FsName, VolName);
+        LOG(2, LOG_LINE_NORMAL,
+            L"  block cache: %ld hits, %ld misses, %ld evictions; %ld reads, %ld bytes",
+            Stats.BlockCacheHits, Stats.BlockCacheMisses, Stats.BlockCacheEvictions,
+            Stats.ReadCalls, Stats.ReadBytes);
+        LOG(2, LOG_LINE_NORMAL,
+            L"  %ld extent lookups, %ld dnodes created, lookup cache: %ld hits, %ld misses",
+            Stats.GetExtentCalls, Stats.DnodeCreates, Stats.LookupCacheHits, Stats.LookupCacheMisses);
+        LOG(2, LOG_LINE_NORMAL, L"  disk: %ld cache hits, %ld ReadDisk calls, %ld bytes",
+            Stats.DiskCacheHits, Stats.DiskReads, Stats.DiskReadBytes);
+    } // for
+    MyFreePool(Handles);
+} // VOID LogFilesystemDriverStats()
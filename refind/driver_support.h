@@ -55,5 +55,6 @@ LibScanHandleDatabase (
 EFI_STATUS ConnectAllDriversToAllControllers(VOID);
 VOID ConnectFilesystemDriver(EFI_HANDLE DriverHandle);
 BOOLEAN LoadDrivers(VOID);
+VOID LogFilesystemDriverStats(VOID);
 
 #endif
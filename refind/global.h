@@ -424,12 +424,6 @@ LOADER_ENTRY * MakeGenericLoaderEntry(VOID);
 VOID StoreLoaderName(IN CHAR16 *Name);
 VOID RescanAll(BOOLEAN DisplayMessage, BOOLEAN Reconnect);
 
-int gunzip(unsigned char *buf, long len,
-           long (*fill)(void*, unsigned long),
-           long (*flush)(void*, unsigned long),
-           unsigned char *out_buf, long out_len,
-           long *pos);
-
 #endif
 
 /* EOF */
@@ -65,6 +65,7 @@
 #include "launch_efi.h"
 #include "log.h"
 #include "scan.h"
+#include "../gzip/decompress.h"
 
 //
 // constants
@@ -110,10 +111,12 @@ static VOID WarnSecureBootError(CHAR16 *Name, BOOLEAN Verbose) {
 // Returns file type:
 //  LOADER_TYPE_INVALID if the file type is unknown
 //  LOADER_TYPE_EFI if the file is an EFI executable for the current platform
-//  LOADER_TYPE_GZIP if the file is a gzip binary *AND* if GlobalConfig.GzippedLoaders is set
-// Note that gzip files are not further interrogated; they could uncompress
-// into non-executable files and this function would still call them valid
-// gzip loaders.
+//  LOADER_TYPE_COMPRESSED if the file is in a format that one of the
+//   decompressors in ../gzip recognizes (gzip or zstd) *AND* if
+//   GlobalConfig.GzippedLoaders is set
+// Note that compressed files are not further interrogated; they could
+// uncompress into non-executable files and this function would still call
+// them valid compressed loaders.
 UINTN IsValidLoader(EFI_FILE_PROTOCOL *RootDir, CHAR16 *FileName) {
     UINTN           LoaderType = LOADER_TYPE_EFI;
 #if defined (EFIX64) | defined (EFI32) | defined (EFIAARCH64)
@@ -122,7 +125,7 @@ UINTN IsValidLoader(EFI_FILE_PROTOCOL *RootDir, CHAR16 *FileName) {
     EFI_FILE_HANDLE FileHandle;
     CHAR8           Header[512];
     CHAR16          *TypeDesc = L"a valid";
-    UINTN           Size = sizeof(Header);
+    UINTN           Size = sizeof(Header), ReadSize;
 
     if ((RootDir == NULL) || (FileName == NULL)) {
         // Assume valid here, because Macs produce NULL RootDir (& maybe FileName)
@@ -137,6 +140,7 @@ UINTN IsValidLoader(EFI_FILE_PROTOCOL *RootDir, CHAR16 *FileName) {
 
     Status = refit_call3_wrapper(FileHandle->Read, FileHandle, &Size, Header);
     refit_call1_wrapper(FileHandle->Close, FileHandle);
+    ReadSize = EFI_ERROR(Status) ? 0 : Size; // Size is reused for the PE header offset below
 
     IsValid = !EFI_ERROR(Status) &&
               Size == sizeof(Header) &&
@@ -147,9 +151,9 @@ UINTN IsValidLoader(EFI_FILE_PROTOCOL *RootDir, CHAR16 *FileName) {
                *(UINT16 *)&Header[Size+4] == EFI_STUB_ARCH) ||
               (*(UINT32 *)&Header == FAT_ARCH));
     if (!IsValid) {
-        if ((Header[0] == (CHAR8) 0x1F && Header[1] == (CHAR8) 0x8B) && GlobalConfig.GzippedLoaders) {
-            LoaderType = LOADER_TYPE_GZIP;
-            TypeDesc = L"a gzipped";
+        if (GlobalConfig.GzippedLoaders && FindDecompressor((UINT8 *) Header, ReadSize)) {
+            LoaderType = LOADER_TYPE_COMPRESSED;
+            TypeDesc = L"a compressed";
         } else {
             LoaderType = LOADER_TYPE_INVALID;
             TypeDesc = L"an invalid";
@@ -176,11 +180,9 @@ EFI_STATUS StartEFIImage(IN REFIT_VOLUME *Volume,
     CHAR16                  *ErrorInfo;
     CHAR16                  *FullLoadOptions = NULL;
     CHAR16                  *EspGUID;
-    UINT8                   *gzData, *ImageData = NULL;
-    UINTN                   gzSize, ImageSize;
+    UINT8                   *ImageData = NULL;
+    UINTN                   ImageSize = 0;
     UINTN                   LoaderType;
-    int                     gzStatus;
-    long                    ReadSize = 0;
     EFI_GUID                SystemdGuid = SYSTEMD_GUID_VALUE;
 
     // set load options
@@ -205,7 +207,7 @@ EFI_STATUS StartEFIImage(IN REFIT_VOLUME *Volume,
     // protect for this condition; but sometimes Volume comes back NULL, so provide
     // an exception. (TODO: Handle this special condition better.)
     LoaderType = IsValidLoader(Volume->RootDir, Filename);
-    if ((LoaderType == LOADER_TYPE_EFI) || (LoaderType == LOADER_TYPE_GZIP)) {
+    if ((LoaderType == LOADER_TYPE_EFI) || (LoaderType == LOADER_TYPE_COMPRESSED)) {
         DevicePath = FileDevicePath(Volume->DeviceHandle, Filename);
         // NOTE: Below commented-out line could be more efficient if file were read ahead of
         // time and passed as a pre-loaded image to LoadImage(), but it doesn't work on my
@@ -218,24 +220,18 @@ EFI_STATUS StartEFIImage(IN REFIT_VOLUME *Volume,
             ReturnStatus = Status = refit_call6_wrapper(BS->LoadImage, FALSE, SelfImageHandle, DevicePath,
                                                         NULL, 0, &ChildImageHandle);
         } else {
-            Status = egLoadFile(Volume->RootDir, Filename, &gzData, &gzSize);
+            Status = DecompressFile(Volume->RootDir, Filename, &ImageData, &ImageSize);
+            LOG(1, LOG_LINE_NORMAL, L"DecompressFile returned %r; ImageSize of %d", Status, ImageSize);
             if (!EFI_ERROR(Status)) {
-                // We need to allocate a buffer sufficient to hold the uncompressed loader.
-                // If the buffer is inadequate, the gunzip() call should fail.
-                // On ARM64 Linux, an uncompressed kernel is about 3-3.5x the size of a
-                // gzip-compressed kernel. To be sure we're well within those limits, go
-                // to a factor of 10x....
-                ImageSize = gzSize * 10;
-                ImageData = AllocateZeroPool(ImageSize);
-                gzStatus = gunzip(gzData, gzSize, NULL, NULL, ImageData, ImageSize, &ReadSize);
-                LOG(1, LOG_LINE_NORMAL, L"gunzip returned '%d'; ReadSize of '%ld'", gzStatus, ReadSize);
-                if (gzStatus == 0) {
-                    ReturnStatus = Status = refit_call6_wrapper(BS->LoadImage, FALSE, SelfImageHandle, DevicePath,
-                                                                ImageData, 0x8000000, &ChildImageHandle);
-                } else {
-                    LOG(1, LOG_LINE_NORMAL, L"gunzip failure!");
-                    ReturnStatus = Status = EFI_LOAD_ERROR;
-                }
+                ReturnStatus = Status = refit_call6_wrapper(BS->LoadImage, FALSE, SelfImageHandle, DevicePath,
+                                                            ImageData, ImageSize, &ChildImageHandle);
+                // LoadImage() has made its own copy, so give the memory back before the
+                // program runs.
+                MyFreePool(ImageData);
+                ImageData = NULL;
+            } else {
+                LOG(1, LOG_LINE_NORMAL, L"Decompression failure!");
+                ReturnStatus = Status = EFI_LOAD_ERROR;
             }
         }
         if (secure_mode() && ShimLoaded() && !EFI_ERROR(Status)) {
@@ -294,6 +290,8 @@ EFI_STATUS StartEFIImage(IN REFIT_VOLUME *Volume,
         MyFreePool(EspGUID);
     } // if write systemd EFI variables
 
+    LogFilesystemDriverStats();
+
     // close open file handles
     LOG(1, LOG_LINE_NORMAL, L"Launching '%s'", ImageTitle);
     UninitRefitLib();
@@ -71,9 +71,9 @@
 #endif
 
 // Return values for IsValidLoader()
-#define LOADER_TYPE_INVALID 0
-#define LOADER_TYPE_EFI     1
-#define LOADER_TYPE_GZIP    2
+#define LOADER_TYPE_INVALID    0
+#define LOADER_TYPE_EFI        1
+#define LOADER_TYPE_COMPRESSED 2
 
 EFI_STATUS StartEFIImage(IN REFIT_VOLUME *Volume,
                          IN CHAR16 *Filename,